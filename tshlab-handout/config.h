@@ -42,7 +42,9 @@
   "trace21.txt",\
   "trace22.txt",\
   "trace23.txt",\
-  "trace24.txt"
+  "trace24.txt",\
+  "trace25.txt",\
+  "trace26.txt"
 
 /* Various constants */
 #define ITERS 2
@@ -1,44 +1,200 @@
 /*
  * fork.c - Wrapper for fork() that introduces non-determinism
  *          in the order that the parent and child are executed
+ *
+ * The environment picks the schedule, so that sdriver -e can explore
+ * schedules and replay the one that broke a shell:
+ *
+ *   TSH_SCHED=random      (default) flip a coin to decide whether the
+ *                         parent or the child sleeps, for a random time
+ *                         of up to MAX_SLEEP us
+ *   TSH_SCHED=pct[:d]     PCT-style: one side runs first at every fork,
+ *                         except that d-1 change points among the first
+ *                         TSH_SCHED_FORKS forks flip which (default d=3)
+ *   TSH_SCHED=order:<s>   fork i runs the parent first if s[i] is 'p' or
+ *                         the child first if it is 'c'; forks past the
+ *                         end of s run the parent first
+ *   TSH_SCHED_SEED=n      makes random and pct reproducible; without it,
+ *                         random seeds itself from the clock
+ *   TSH_SCHED_LOG=file    append "fork <i> <p|c> <us>" for every fork
+ *
+ * Every decision is a function of the seed and the fork's index, so a
+ * seed replays the same choices as long as the shell forks in the same
+ * order. Forks the shell makes from a signal handler (tsh starts queued
+ * and pending jobs from its SIGCHLD handler) are numbered in the same
+ * sequence, so where they fall depends on when the signal arrives:
+ * with -l, -L or after, a seed may not replay exactly.
  */
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "labutil.h"
 
 /* Sleep for a random period between 0 and MAX_SLEEP microseconds */
 #define MAX_SLEEP 100000
 
+/* How long pct and order hold back the side that runs second */
+#define SCHED_DELAY 20000
+
+/* Defaults for pct */
+#define PCT_DEPTH 3
+#define PCT_FORKS 16
+#define PCT_MAXDEPTH 16
+
 #define CONVERT(val) (((double)val)/(double)RAND_MAX)
 
+#define SCHED_RANDOM 0
+#define SCHED_PCT    1
+#define SCHED_ORDER  2
+
 struct timeval time;
 
+/* The schedule, read from the environment by the first fork */
+static int sched_init = 0;
+static int sched_mode = SCHED_RANDOM;
+static int sched_seeded = 0;
+static unsigned long long sched_seed;
+static char *sched_order = "";
+static char *sched_log = NULL;
+static int pct_first;                     /* 0 parent first, 1 child */
+static int pct_changes[PCT_MAXDEPTH];     /* forks where that flips */
+static int pct_nchanges = 0;
+static int nforks = 0;                    /* forks so far */
+
 pid_t __real_fork(void);
 
+/*
+ * read_sched - Parse TSH_SCHED and friends (see the top of the file)
+ */
+static void read_sched(void)
+{
+    char *str;
+    int i, depth = PCT_DEPTH, window = PCT_FORKS;
+
+    sched_init = 1;
+    if ((str = getenv("TSH_SCHED_SEED")) != NULL) {
+	sched_seed = strtoull(str, NULL, 0);
+	sched_seeded = 1;
+    }
+    sched_log = getenv("TSH_SCHED_LOG");
+    if ((str = getenv("TSH_SCHED")) == NULL || !strcmp(str, "random"))
+	return;
+
+    if (!strncmp(str, "order:", 6)) {
+	sched_mode = SCHED_ORDER;
+	sched_order = str + 6;
+    }
+    else if (!strncmp(str, "pct", 3)) {
+	sched_mode = SCHED_PCT;
+	if (str[3] == ':')
+	    depth = atoi(str + 4);
+	if (depth < 1)
+	    depth = 1;
+	if (depth > PCT_MAXDEPTH)
+	    depth = PCT_MAXDEPTH;
+	if ((str = getenv("TSH_SCHED_FORKS")) != NULL && atoi(str) > 0)
+	    window = atoi(str);
+
+	/* A random first side, and d-1 random points where it flips */
+	pct_first = mix(sched_seed) & 1;
+	for (i = 0; i < depth - 1; i++)
+	    pct_changes[pct_nchanges++] = mix(sched_seed + i + 1) % window;
+    }
+}
+
+/*
+ * log_fork - Append "fork <i> <p|c> <us>" to TSH_SCHED_LOG. Uses only
+ *     async-signal-safe calls, since the shell may fork in a handler.
+ *     Stops logging if the log can't be written.
+ */
+static void log_fork(int i, int child_first, unsigned us)
+{
+    char line[64], digits[16];
+    int fd, len = 0, n;
+
+    memcpy(line, "fork ", 5);
+    len = 5;
+    n = 0;
+    do { digits[n++] = '0' + i % 10; i /= 10; } while (i);
+    while (n)
+	line[len++] = digits[--n];
+    line[len++] = ' ';
+    line[len++] = child_first ? 'c' : 'p';
+    line[len++] = ' ';
+    do { digits[n++] = '0' + us % 10; us /= 10; } while (us);
+    while (n)
+	line[len++] = digits[--n];
+    line[len++] = '\n';
+
+    if ((fd = open(sched_log, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0) {
+	sched_log = NULL;
+	return;
+    }
+    if (write(fd, line, len) != len)
+	sched_log = NULL;
+    close(fd);
+}
+
 /*
  * __wrap_fork - Link-time wrapper for fork() that introduces
  * non-determinism in the order that parent and child are executed.
- * After calling fork, randomly decide whether to sleep for a random
- * period in either the parent or child process, which results in
- * yielding control to the other process.  Based on a link-time
- * positioning technique: Given the -Wl,--wrap,fork argument, the linker
- * replaces all references to fork to __wrap_fork(), and all
- * references to __real_fork to fork().
+ * After calling fork, decide whether to sleep for a while in either
+ * the parent or child process, which results in yielding control to
+ * the other process.  Based on a link-time positioning technique:
+ * Given the -Wl,--wrap,fork argument, the linker replaces all
+ * references to fork to __wrap_fork(), and all references to
+ * __real_fork to fork().
  */
 pid_t __wrap_fork(void)
 {
-    gettimeofday(&time, NULL);
-    srand(time.tv_usec);
+    unsigned long long r;
+    unsigned bool, secs;
+    int i, k, first;
 
-    unsigned bool = (unsigned)(CONVERT(rand()) + 0.5);
-    unsigned secs = (unsigned)(CONVERT(rand()) * MAX_SLEEP);
+    if (!sched_init)
+	read_sched();
+    k = nforks++;
+
+    /* bool is 1 if the parent runs first (the child sleeps) */
+    switch (sched_mode) {
+    case SCHED_ORDER:
+	bool = k >= (int)strlen(sched_order) || sched_order[k] != 'c';
+	secs = SCHED_DELAY;
+	break;
+    case SCHED_PCT:
+	first = pct_first;
+	for (i = 0; i < pct_nchanges; i++)
+	    if (pct_changes[i] <= k)
+		first = !first;
+	bool = !first;
+	secs = SCHED_DELAY;
+	break;
+    default:
+	if (sched_seeded) {
+	    r = mix(sched_seed ^ mix(k));
+	    bool = r & 1;
+	    secs = (unsigned)((r >> 1) % MAX_SLEEP);
+	}
+	else {
+	    gettimeofday(&time, NULL);
+	    srand(time.tv_usec);
+	    bool = (unsigned)(CONVERT(rand()) + 0.5);
+	    secs = (unsigned)(CONVERT(rand()) * MAX_SLEEP);
+	}
+    }
 
     /* Call the real fork function */
     pid_t pid = __real_fork();
 
-    /* Randomly decide to sleep in the parent or the child */
+    if (pid > 0 && sched_log)
+	log_fork(k, !bool, secs);
+
+    /* Sleep in the parent or the child, whichever goes second */
     if (pid == 0) {
 	if(bool) {
 	    usleep(secs);
@@ -0,0 +1,45 @@
+/*
+ * labutil.h - Small helpers shared by the Shell Lab's tools
+ *
+ * tracegen and runtrace -R both write traces, and label each command
+ * the way the lab's traces do; tracegen and fork.c both derive their
+ * random choices from a seed with the same hash.
+ */
+#ifndef __LABUTIL_H__
+#define __LABUTIL_H__
+
+#include <stdio.h>
+
+/*
+ * mix - splitmix64 finalizer: a well-scrambled 64-bit hash of x
+ */
+static inline unsigned long long mix(unsigned long long x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/*
+ * echo_cmd - Write the echo that labels the output with "tsh> cmd",
+ *     and the NEXT after it, as the lab's traces put before each
+ *     command line
+ */
+static inline void echo_cmd(FILE *fp, char *cmd)
+{
+    fprintf(fp, "/bin/echo -e tsh\\076 ");
+    for (; *cmd; cmd++) {
+	if (*cmd == '&')
+	    fprintf(fp, "\\046");
+	else if (*cmd == '<')
+	    fprintf(fp, "\\074");
+	else if (*cmd == '>')
+	    fprintf(fp, "\\076");
+	else
+	    fputc(*cmd, fp);
+    }
+    fprintf(fp, "\nNEXT\n");
+}
+
+#endif /* __LABUTIL_H__ */
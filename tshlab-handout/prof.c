@@ -0,0 +1,292 @@
+/*
+ * prof.c - Link-time interposition profiler for the shell (make tsh-prof)
+ *
+ * Like fork.c, this relies on the linker's --wrap: tsh-prof is linked
+ * with --wrap for execve, waitpid, kill, sigprocmask, setpgid and
+ * write, so tsh.c's calls land in the __wrap_ functions below, which
+ * time the __real_ ones with CLOCK_MONOTONIC. fork.c is compiled with
+ * __real_fork renamed to prof_fork, so its wrapper keeps injecting
+ * delays while only the real fork is timed. tsh.c needs no changes.
+ *
+ * Every call is counted into a histogram of log2(ns) buckets. The
+ * histograms live in shared memory, so the calls a child makes
+ * between fork and exec (setpgid, sigprocmask, execve) count too.
+ * They are appended to the file named by TSH_PROF (default tsh.prof)
+ * when the shell exits, and whenever it gets SIGUSR1; children that
+ * exit without exec'ing don't report. execve only returns when it
+ * fails, so its row counts failed execs.
+ *
+ * The wrappers may run inside the shell's signal handlers, so they
+ * make no calls that aren't async-signal-safe. The report does use
+ * sprintf, which is good enough for a profiling build.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+
+#define NBUCKETS 40   /* bucket b holds calls of [2^b, 2^(b+1)) ns */
+
+#define CALL_FORK        0
+#define CALL_EXECVE      1
+#define CALL_WAITPID     2
+#define CALL_KILL        3
+#define CALL_SIGPROCMASK 4
+#define CALL_SETPGID     5
+#define CALL_WRITE       6
+#define NCALLS           7
+
+/* One wrapped call's statistics */
+struct prof_t {
+    unsigned long n;
+    unsigned long long total, min, max;   /* ns */
+    unsigned long hist[NBUCKETS];
+};
+
+static char *names[NCALLS] = {
+    "fork", "execve", "waitpid", "kill", "sigprocmask", "setpgid", "write"
+};
+
+/* Shared with the shell's children once prof_init has run */
+static struct prof_t local[NCALLS];
+static struct prof_t *prof = local;
+
+static pid_t prof_pid;                 /* the shell's process */
+static unsigned long long prof_start;  /* when it started, ns */
+
+/* The real functions, resolved by the linker's --wrap */
+pid_t __real_fork(void);
+int __real_execve(const char *path, char *const argv[], char *const envp[]);
+pid_t __real_waitpid(pid_t pid, int *status, int options);
+int __real_kill(pid_t pid, int sig);
+int __real_sigprocmask(int how, const sigset_t *set, sigset_t *old);
+int __real_setpgid(pid_t pid, pid_t pgid);
+ssize_t __real_write(int fd, const void *buf, size_t n);
+
+void prof_dump(void);
+
+/*
+ * now_ns - Monotonic time in nanoseconds
+ */
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * record - Count one call that took ns nanoseconds. A handler may
+ *     interrupt the main program's update of the same call, so the
+ *     counters are bumped atomically; min and max are best effort.
+ */
+static void record(int call, unsigned long long ns)
+{
+    struct prof_t *p = &prof[call];
+    int b = 0;
+
+    while (b < NBUCKETS - 1 && (ns >> (b + 1)) != 0)
+	b++;
+    __atomic_fetch_add(&p->n, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->total, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->hist[b], 1, __ATOMIC_RELAXED);
+    if (p->min == 0 || ns < p->min)
+	p->min = ns;
+    if (ns > p->max)
+	p->max = ns;
+}
+
+/*
+ * The wrappers. Each one keeps the real call's errno.
+ */
+pid_t prof_fork(void)
+{
+    unsigned long long t = now_ns();
+    pid_t pid = __real_fork();
+    int saved = errno;
+
+    if (pid != 0)    /* count it once, in the parent */
+	record(CALL_FORK, now_ns() - t);
+    errno = saved;
+    return pid;
+}
+
+int __wrap_execve(const char *path, char *const argv[], char *const envp[])
+{
+    unsigned long long t = now_ns();
+    int rc = __real_execve(path, argv, envp);
+    int saved = errno;
+
+    record(CALL_EXECVE, now_ns() - t);
+    errno = saved;
+    return rc;
+}
+
+pid_t __wrap_waitpid(pid_t pid, int *status, int options)
+{
+    unsigned long long t = now_ns();
+    pid_t rc = __real_waitpid(pid, status, options);
+    int saved = errno;
+
+    record(CALL_WAITPID, now_ns() - t);
+    errno = saved;
+    return rc;
+}
+
+int __wrap_kill(pid_t pid, int sig)
+{
+    unsigned long long t = now_ns();
+    int rc = __real_kill(pid, sig);
+    int saved = errno;
+
+    record(CALL_KILL, now_ns() - t);
+    errno = saved;
+    return rc;
+}
+
+int __wrap_sigprocmask(int how, const sigset_t *set, sigset_t *old)
+{
+    unsigned long long t = now_ns();
+    int rc = __real_sigprocmask(how, set, old);
+    int saved = errno;
+
+    record(CALL_SIGPROCMASK, now_ns() - t);
+    errno = saved;
+    return rc;
+}
+
+int __wrap_setpgid(pid_t pid, pid_t pgid)
+{
+    unsigned long long t = now_ns();
+    int rc = __real_setpgid(pid, pgid);
+    int saved = errno;
+
+    record(CALL_SETPGID, now_ns() - t);
+    errno = saved;
+    return rc;
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t n)
+{
+    unsigned long long t = now_ns();
+    ssize_t rc = __real_write(fd, buf, n);
+    int saved = errno;
+
+    record(CALL_WRITE, now_ns() - t);
+    errno = saved;
+    return rc;
+}
+
+/*
+ * fmt_ns - Print ns into buf with a unit that keeps it short
+ */
+static char *fmt_ns(char *buf, unsigned long long ns)
+{
+    if (ns < 10000ULL)
+	sprintf(buf, "%lluns", ns);
+    else if (ns < 10000000ULL)
+	sprintf(buf, "%.1fus", ns / 1e3);
+    else if (ns < 10000000000ULL)
+	sprintf(buf, "%.1fms", ns / 1e6);
+    else
+	sprintf(buf, "%.1fs", ns / 1e9);
+    return buf;
+}
+
+/*
+ * prof_dump - Append the histograms to TSH_PROF: one line of totals
+ *     per call it made, then a line per non-empty bucket
+ */
+void prof_dump(void)
+{
+    char line[256], a[32], b[32], c[32], d[32], bar[41];
+    char *file = getenv("TSH_PROF");
+    struct prof_t *p;
+    int fd, i, k, len, width;
+    unsigned long most;
+
+    if (getpid() != prof_pid)
+	return;
+    if (!file)
+	file = "tsh.prof";
+    if ((fd = open(file, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0)
+	return;
+
+    len = sprintf(line, "# tsh-prof pid %d after %s\n%-12s %8s %10s %10s %10s %10s\n",
+		  (int)prof_pid, fmt_ns(a, now_ns() - prof_start),
+		  "call", "count", "total", "mean", "min", "max");
+    __real_write(fd, line, len);
+
+    for (i = 0; i < NCALLS; i++) {
+	p = &prof[i];
+	if (p->n == 0)
+	    continue;
+	len = sprintf(line, "%-12s %8lu %10s %10s %10s %10s\n", names[i], p->n,
+		      fmt_ns(a, p->total), fmt_ns(b, p->total / p->n),
+		      fmt_ns(c, p->min), fmt_ns(d, p->max));
+	__real_write(fd, line, len);
+
+	most = 0;
+	for (k = 0; k < NBUCKETS; k++)
+	    if (p->hist[k] > most)
+		most = p->hist[k];
+	for (k = 0; k < NBUCKETS; k++) {
+	    if (p->hist[k] == 0)
+		continue;
+	    width = (int)((p->hist[k] * 40 + most - 1) / most);
+	    memset(bar, '#', width);
+	    bar[width] = '\0';
+	    len = sprintf(line, "    %10s .. %-10s %8lu %s\n",
+			  fmt_ns(a, 1ULL << k), fmt_ns(b, 2ULL << k),
+			  p->hist[k], bar);
+	    __real_write(fd, line, len);
+	}
+    }
+    __real_write(fd, "\n", 1);
+    close(fd);
+}
+
+/*
+ * prof_signal - SIGUSR1 handler: report without stopping
+ */
+static void prof_signal(int sig)
+{
+    int saved = errno;
+
+    prof_dump();
+    errno = saved;
+}
+
+/*
+ * prof_init - Runs before main: move the counters to shared memory,
+ *     note the shell's PID, and arrange for the report at exit and
+ *     on SIGUSR1
+ */
+__attribute__((constructor))
+static void prof_init(void)
+{
+    struct sigaction sa;
+    void *shared;
+
+    shared = mmap(NULL, sizeof(local), PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared != MAP_FAILED)
+	prof = shared;
+    prof_pid = getpid();
+    prof_start = now_ns();
+    atexit(prof_dump);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = prof_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+}
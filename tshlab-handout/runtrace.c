@@ -6,6 +6,7 @@
  * Copyright (c) 2004, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -13,12 +14,27 @@
 #include <signal.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <time.h>
+#include <regex.h>
 #include "config.h"
+#include "syncshm.h"
+#include "sandbox.h"
+#include "vtime.h"
+#include "labutil.h"
 
 #define MAXBUF 1024
 #define BOMB_USER "eslab_shell"
@@ -27,6 +43,38 @@
 
 #define MAX_LINE           80
 
+/* Shell output is read and forwarded in chunks of this size */
+#define CHUNK 65536
+
+/* Trace operations */
+#define OP_COMMAND  0   /* send a command line to the shell */
+#define OP_COMMENT  1   /* echo a comment line */
+#define OP_WAIT     2   /* wait for a sync from a job */
+#define OP_NEXT     3   /* forward output up to the next prompt(s) */
+#define OP_SIGNAL   4   /* send a sync to a job */
+#define OP_SIGINT   5   /* SIGINT the shell */
+#define OP_SIGTSTP  6   /* SIGTSTP the shell */
+#define OP_TIMEOUT  7   /* set the default step timeout */
+#define OP_LOOP     8   /* run the ops up to the matching END n times */
+#define OP_END      9
+#define OP_SLEEPMS  10  /* pause for some milliseconds */
+#define OP_EXPECT   11  /* match the last NEXT's output against a regex */
+#define OP_LATENCY  12  /* fail if the last step took too long */
+#define OP_PAUSEMS  13  /* recorded think time, kept only with -r */
+#define OP_REAP     14  /* wait for the shell to reap a job SIGNAL released */
+
+#define MAXNEST     16  /* deepest LOOP nesting */
+
+/* Most rounds clean() takes to work its way down the process tree */
+#define CLEAN_ROUNDS 64
+
+/* Adaptive timeouts (-a) */
+#define MAXSTEPS    256   /* trace lines that keep a latency history */
+#define HISTKEEP    100   /* most recent samples kept per line */
+#define HISTMIN     5     /* samples needed before a line adapts */
+#define HISTFACTOR  10    /* deadline is this many times the p99 */
+#define MIN_TIMEOUT 100   /* adaptive deadlines never go below this (ms) */
+
 /* 
  * Global variables 
  */
@@ -34,7 +82,6 @@ char buf[MAXBUF];
 char line[MAXBUF];
 char command[MAXBUF];
 extern char **environ;
-char *state;
 /* Global scratch buffer */
 char scratch[MAX_LINE];
 
@@ -45,46 +92,180 @@ int sandboxing = 0;
 char *tracefile = NULL;
 char *shellprog = "./tsh";
 char *shellargs = NULL;
+int timeout_ms = DRIVER_TIMEOUT * 1000; /* -T, or TIMEOUT in the trace */
+char *histfile = NULL;                  /* -a: latency history file */
+FILE *perffp = NULL;                    /* -p: step latencies and rusage */
+double warp = 1.0;                      /* -w: virtual seconds per real one */
+char *recordfile = NULL;                /* -R: record a session into this trace */
+int realtime = 0;                       /* -r: replay PAUSEMS pauses */
+int nosync = 0;                         /* jobs don't sync with runtrace */
+
+/* Per-line latency history loaded from and appended to histfile */
+struct hist_t {
+    int n;                   /* samples in us[] */
+    int next;                /* slot the next sample overwrites */
+    long long us[HISTKEEP];  /* latencies in microseconds */
+    long long run;           /* this run's sample, or -1 */
+} hist[MAXSTEPS];
+
+/* Trace line being executed */
+int lineno = 0;
+
+/* 
+ * The trace compiled into a list of ops before it runs, so executing
+ * a step costs no parsing
+ */
+struct op_t {
+    int type;     /* OP_* */
+    int line;     /* line in the trace file */
+    int arg;      /* count or milliseconds; -1 if not given */
+    int jump;     /* LOOP: index of its END; END: index of its LOOP */
+    int left;     /* LOOP: iterations left while running */
+    char *text;   /* command line (with newline), comment or pattern */
+    regex_t re;   /* EXPECT pattern */
+};
+struct op_t *ops = NULL;
+int nops = 0;
+int nlines = 0;   /* lines in the trace file */
+
+/* Output forwarded by the last NEXT, for EXPECT */
+char *seen = NULL;
+size_t seen_len = 0, seen_cap = 0;
+
+/* How long the last WAIT or NEXT took, for ASSERT_LATENCY_MS */
+long long last_us = 0;
+
+/* epoll set holding the deadline timer */
+int epfd = -1;
+int timerfd = -1;
 
 /* domain socket pairs */
 int datafd[2];
 int syncfd[2];
 
+/* Shared-memory sync channel offered to jobs, NULL if not (-S) */
+struct syncshm *syncsh = NULL;
+int sockets_only = 0;
+uint32_t waited = 0;      /* arrivals consumed by WAIT */
+
+/* The shell's children at the last SIGNAL, if the trace has a REAP */
+int reaping = 0;
+pid_t *signalled = NULL;
+int nsignalled = 0, maxsignalled = 0;
+char shmenv[32];
+
+/* Environment that preloads vtime.so into the shell (-w) */
+char vtimeenv[80];
+char preloadenv[2 * MAXBUF];
+
+/*
+ * Shell output received on the data stream but not yet forwarded.
+ * The first scan bytes have been fed to the prompt matcher, which has
+ * matched the first match characters of PROMPT at that point.
+ */
+struct stream_t {
+    int fd;
+    char *data;
+    size_t len, cap;
+    size_t scan;
+    int match;
+} out;
+
+/* KMP failure function for PROMPT */
+int prompt_fail[sizeof(PROMPT)];
+
+/* Load generator mode (-c) */
+int nshells = 0;                    /* shells to drive, 0 for a trace run */
+long long duration_us = 10000000;   /* -d: how long to drive them */
+
+/* One shell driven by the load generator */
+struct shell_t {
+    pid_t pid;
+    int fd[2];
+    struct stream_t s;
+    int next;          /* index of the next command in the mix */
+    long long sent;    /* when the outstanding command was sent, or 0 */
+    int done;          /* finished, or given up on */
+};
+
+/* Command mix used when -c is given without a trace */
+char *default_mix[] = {
+    "/bin/true\n",
+    "/bin/echo load\n",
+    "jobs\n",
+    NULL
+};
+
+/* The shell under test */
+pid_t shell_pid = 0;
+
+/* Keys the user pressed while a session is being recorded (-R) */
+volatile sig_atomic_t rec_sigint = 0, rec_sigtstp = 0;
+
 /* Prototypes */
 void usage(char *msg);
 int blankline(char *str);
 void print_child_status(void);
-int next_prompt(void);
-int readable(int fd, int secs);
+int next_prompt(int ms, int count);
+void compile_trace(FILE *fp);
+struct op_t *add_op(int type, int arg, char *text);
+void compile_error(char *msg);
+int readable(int fd, int ms);
+pid_t launch_shell(int *fd);
+int stream_recv(struct stream_t *s);
+int stream_fill(struct stream_t *s, long long deadline);
+void stream_forward(struct stream_t *s, size_t n);
+void stream_drop(struct stream_t *s, size_t n);
+size_t stream_scan(struct stream_t *s);
+int stream_prompt(struct stream_t *s, long long deadline);
+void prompt_init(void);
+long long parse_duration(char *str);
+void load_run(void);
+void record_session(void);
+void record_handler(int sig);
+void record_pause(FILE *fp, long long *last);
+void record_expect(FILE *fp, char *out);
+long long now_us(void);
+int remaining(long long deadline);
+int step_timeout(int step, int ms);
+int real_ms(int ms);
+void vtime_setup(void);
+int cmp_ll(const void *a, const void *b);
+void record_latency(int step, long long us);
+void load_history(void);
+void save_history(void);
 void clean(void);
+int children(pid_t parent, pid_t **pids, int *max);
+int reaped(pid_t shell, int ms);
+void add_pid(pid_t **pids, int *max, int n, pid_t pid);
 
 void send_msg(int defused);
-/*
- * sigalrm_handler - Notify when we timeout waiting for the child
- */
-void sigalrm_handler(int sig) 
-{
-    printf("%s: Runtrace timed out while %s.\n", tracefile, state);
-    clean();
-    exit(1);
-}
 
 /* Main routine */
 int main(int argc, char **argv) 
 {
-    char *shellargv[MAXARGS];
     int child_pid;
     char c;
     char *bufp;
     FILE *tracefp;
-    int n;
+    int n, ms, pc, pidfd;
+    long long start, deadline;
+    struct op_t *op;
     struct stat statbuf;
-    
-    /* Install the signal handler */
-    signal(SIGALRM, sigalrm_handler);
+    struct rusage ru;
+
+    /*
+     * Become the reaper of every orphaned descendant, so that jobs the
+     * shell leaves behind stay in our process tree where clean() can
+     * find them.
+     */
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) < 0) {
+	perror("prctl PR_SET_CHILD_SUBREAPER");
+	exit(1);
+    }
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hVxs:f:")) != EOF) {
+    while ((c = getopt(argc, argv, "hVxSrs:f:T:a:c:d:p:w:R:")) != EOF) {
         switch (c) {
         case 'h':             /* Print help message */
             usage("");
@@ -101,13 +282,56 @@ int main(int argc, char **argv)
 	case 'x':             /* Enable sandboxing */
 	    sandboxing = 1;   /* Hidden argument */
 	    break;
+	case 'S':             /* Sync with jobs over the socket only */
+	    sockets_only = 1;
+	    break;
+	case 'T':             /* Step timeout in milliseconds */
+	    timeout_ms = atoi(optarg);
+	    break;
+	case 'a':             /* Adapt timeouts to the history in this file */
+	    histfile = strdup(optarg);
+	    break;
+	case 'p':             /* Record step latencies and rusage here */
+	    if ((perffp = fopen(optarg, "w")) == NULL) {
+		perror(optarg);
+		exit(1);
+	    }
+	    break;
+	case 'w':             /* Run the shell's clocks this much faster */
+	    warp = atof(optarg);
+	    break;
+	case 'c':             /* Load generator: number of shells */
+	    nshells = atoi(optarg);
+	    if (nshells <= 0)
+		usage("Number of shells must be positive (-c)");
+	    break;
+	case 'd':             /* Load generator: duration, e.g. 60s */
+	    if ((duration_us = parse_duration(optarg)) <= 0)
+		usage("Bad duration (-d)");
+	    break;
+	case 'R':             /* Record an interactive session here */
+	    recordfile = strdup(optarg);
+	    break;
+	case 'r':             /* Replay recorded pauses in real time */
+	    realtime = 1;
+	    break;
 	default:
             usage("Unrecognized argument");
 	}
     }
 
-    if (!tracefile)
+    if (!tracefile && !nshells && !recordfile)
 	  usage("Missing required argument (-f)");
+    if (recordfile && (tracefile || nshells))
+	usage("Recording (-R) makes a trace; drop -f and -c");
+    if (recordfile)
+	nosync = 1;
+    if (sandboxing && nshells)
+	usage("The sandbox (-x) watches a single shell; drop -c");
+    if (timeout_ms <= 0)
+	usage("Timeout must be a positive number of milliseconds (-T)");
+    if (warp <= 0)
+	usage("Warp factor must be positive (-w)");
     
     /* Make sure the requested shell is executable */
     if (stat(shellprog, &statbuf) < 0) {
@@ -120,16 +344,15 @@ int main(int argc, char **argv)
     } 
 
     /* Open the trace file for reading */
-    if ((tracefp = fopen(tracefile, "r")) == NULL) {
-	fprintf(stderr, "Unable to open trace file %s\n", tracefile);
-	exit(1);
-    }
-
-    /* Socket pair for data transfers between runtrace and shell */
-    if (socketpair(AF_LOCAL, SOCK_DGRAM, 0, datafd) < 0) {
-	perror("socketpair datafd");
-	exit(1);
+    if (tracefile) {
+	if ((tracefp = fopen(tracefile, "r")) == NULL) {
+	    fprintf(stderr, "Unable to open trace file %s\n", tracefile);
+	    exit(1);
+	}
+	compile_trace(tracefp);
+	fclose(tracefp);
     }
+    prompt_init();
 
     /* Socket pair for synchronization between runtrace and shell jobs */
     if (socketpair(AF_LOCAL, SOCK_DGRAM, 0, syncfd) < 0) {
@@ -137,133 +360,162 @@ int main(int argc, char **argv)
 	exit(1);
     }
 
-    /*
-     * Create an environment variable that tells shell jobs
-     * such as myspin which descriptor to synchronize on.
-     */
-    sprintf(buf, "SYNCFD=%d", syncfd[1]);
-    if (putenv(buf) < 0) {
-	perror("putenv");
-	exit(1);
-    }
-
-    if (verbose) {
-	printf("Created environment variable %s\n", buf);
-    }
-
-
-    /************************* 
-     * Child code runs a shell
-     *************************/ 
-    if ((child_pid  = fork()) == 0) {  
-
-	/* Close the descriptor the child is not using */
-	close(datafd[0]);
+    /* Jobs of a session recorded live (NOSYNC) run on their own */
+    if (!nosync) {
+	/*
+	 * Create an environment variable that tells shell jobs
+	 * such as myspin which descriptor to synchronize on.
+	 */
+	sprintf(buf, "SYNCFD=%d", syncfd[1]);
+	if (putenv(buf) < 0) {
+	    perror("putenv");
+	    exit(1);
+	}
 
-	/* Redirect stdin and stdout to the domain socket */
-	dup2(datafd[1], 0);
-	dup2(datafd[1], 1);
-	
-	/* Create the shell command line arguments */
-	shellargv[0] = shellprog;
 	if (verbose) {
-	    shellargv[1] = "-v";
-	    shellargv[2] = '\0';
-	}
-	else {
-	    shellargv[1] = '\0';
+	    printf("Created environment variable %s\n", buf);
 	}
 
-	/* Modify the environment if sandboxing is enabled */
-	if (sandboxing) {
-	    strcpy(line, "LD_PRELOAD=/usr/lib/libdl.so ./sandbox.so");
-	    putenv(line);
+	/*
+	 * Also offer the shared-memory channel. Jobs that find SYNCSHM
+	 * use it instead of the socket, so both ends skip the syscalls.
+	 */
+	if (!sockets_only && (syncsh = sync_create(&n)) != NULL) {
+	    sprintf(shmenv, "SYNCSHM=%d", n);
+	    if (putenv(shmenv) < 0) {
+		perror("putenv");
+		exit(1);
+	    }
+	    if (verbose)
+		printf("Created environment variable %s\n", shmenv);
 	}
+    }
 
-	/* Now go ahead and run the shell */
-	if (execve(shellprog, shellargv, environ) < 0) {
-	    perror("execve");
-	    exit(1);
-	}
+    /* Speed up the clocks of the shell and its jobs (-w) */
+    if (warp != 1.0)
+	vtime_setup();
+
+
+    /* The load generator runs its own shells */
+    if (nshells) {
+	atexit(clean);
+	load_run();
+	exit(0);
+    }
+
+    /* Or the user drives the shell and we write down what happens */
+    if (recordfile) {
+	atexit(clean);
+	record_session();
+	exit(0);
     }
 
+    /* Start the shell */
+    child_pid = launch_shell(datafd);
+    out.fd = datafd[0];
+
     /******************************************************** 
      * Parent code sends trace-driven commands to child shell
      *******************************************************/
+    shell_pid = child_pid;
 
-    /* Close the descriptor the parent is not using */
-    close(datafd[1]); 
+    /* However we exit from here on, take the shell and its jobs along */
+    atexit(clean);
+
+    load_history();
 
-    /* Read the initial prompt from the shell */
-    if (readable(datafd[0], DRIVER_TIMEOUT) == 0) {
+    /* Read the initial prompt from the shell (line 0 of the history) */
+    start = now_us();
+    deadline = start + step_timeout(0, timeout_ms) * 1000LL;
+    n = 1;
+    while (out.len < strlen(PROMPT) && (n = stream_fill(&out, deadline)) > 0)
+	;
+    if (n == 0) {
 	fprintf(stderr, "%s: Runtrace timed out waiting for initial shell prompt\n", tracefile);
     }     
     else {
-	bzero(buf, MAXBUF);
-	n = recv(datafd[0], buf, MAXBUF, 0);
-	if (strcmp(buf, PROMPT)) {
+	record_latency(0, now_us() - start);
+	if (out.len < strlen(PROMPT) || memcmp(out.data, PROMPT, strlen(PROMPT))) {
 	    fprintf(stderr,"You try to copy. so you are invaild and you will get F grade\n");
 		send_msg(0);
 		//fprintf(stderr, "%s: Runtrace expected initial shell prompt but got '%s' instead.\n", tracefile, buf);
 	    exit(1);
 	}
+	stream_drop(&out, strlen(PROMPT));
     }
 
     /* 
-     * Parent reads trace file and sends commands to the shell 
+     * Parent runs the compiled trace, sending commands to the shell 
      */
-    while (fgets(line, MAXBUF, tracefp)) {
+    for (pc = 0; pc < nops; pc++) {
+	op = &ops[pc];
+	lineno = op->line;
+	ms = op->arg > 0 ? op->arg : timeout_ms;
 
-	/* Delete newline character */
-	line[strlen(line)-1] = '\0';
-
-	/* Ignore blank lines */
-	if (blankline(line)) { 
-	    if (verbose) 
-		printf("runtrace: Ignoring blank line\n");
-	    continue;
-	}
+	switch (op->type) {
 
 	/* Echo comment lines */ 
-	if (line[0] == '#') {
-	    printf("%s\n", line);
-	    continue;
-	}
+	case OP_COMMENT:
+	    printf("%s\n", op->text);
+	    break;
+
+	/* TIMEOUT command sets the timeout for the steps that follow */
+	case OP_TIMEOUT:
+	    timeout_ms = op->arg;
+	    break;
 
-	/* Parse the command line */
-	sscanf(line, "%s", command);
-	if (verbose)
-	    printf("runtrace: command=%s line=%s\n", command, line);
-	
 	/* WAIT command */
-	if (!strcmp(command, "WAIT")) {
-	    if (readable(syncfd[0], DRIVER_TIMEOUT) == 0) {
+	case OP_WAIT:
+	    start = now_us();
+	    if (syncsh) {
+		if (!sync_until(&syncsh->arrived, waited, 
+				step_timeout(lineno, ms))) {
+		    printf("%s: Runtrace timed out waiting for sync from job\n", 
+			   tracefile);
+		    exit(1);
+		}
+		last_us = now_us() - start;
+		record_latency(lineno, last_us);
+		if (verbose)
+		    printf("runtrace: received sync from job %d\n", 
+			   sync_pid(syncsh, waited));
+		waited++;
+		break;
+	    }
+	    if (readable(syncfd[0], step_timeout(lineno, ms)) == 0) {
 		printf("%s: Runtrace timed out waiting for sync from job\n", 
 		       tracefile);
 		exit(1);
 	    }
-	    else {
-		bzero(buf, MAXBUF);
-		if ((recv(syncfd[0], buf, MAXBUF, 0)) < 0) {
-		    perror("recv syncfd");
-		    exit(1);
-		}
-		if (verbose)
-		    printf("runtrace: received sync from job\n");
-		continue;
+	    bzero(buf, MAXBUF);
+	    if ((recv(syncfd[0], buf, MAXBUF, 0)) < 0) {
+		perror("recv syncfd");
+		exit(1);
 	    }
-	}
-
+	    last_us = now_us() - start;
+	    record_latency(lineno, last_us);
+	    if (verbose)
+		printf("runtrace: received sync from job\n");
+	    break;
 
-	/* NEXT command */
-	else if (!strcmp(command, "NEXT")) {
-	    if (next_prompt() == 0) 
+	/* NEXT command, or the prompts owed by a PARALLEL block */
+	case OP_NEXT:
+	    if ((n = next_prompt(ms, op->jump)) == 0) 
 		exit(0);
-	    continue;
-	}
+	    if (n < 0)        /* the shell quit: go wait for it */
+		pc = nops;
+	    break;
 
 	/* SIGNAL command */
-	else if (!strcmp(command, "SIGNAL")) {
+	case OP_SIGNAL:
+	    if (reaping)
+		nsignalled = children(child_pid, &signalled, &maxsignalled);
+	    if (syncsh) {
+		sync_signal(syncsh);
+		if (verbose)
+		    printf("runtrace: sent sync to shell job\n");
+		break;
+	    }
 	    bufp = "signal";
 	    if ((send(syncfd[0], bufp, strlen(bufp), 0)) < 0) {
 		perror("send syncfd");
@@ -271,65 +523,273 @@ int main(int argc, char **argv)
 	    }
 	    if (verbose)
 		printf("runtrace: sent sync to shell job\n");
-	    continue;
-	}
+	    break;
+
+	/* REAP command: wait until the job the last SIGNAL let go is reaped */
+	case OP_REAP:
+	    start = now_us();
+	    if (!reaped(child_pid, step_timeout(lineno, ms))) {
+		printf("%s: Runtrace timed out waiting for the shell to reap a job\n",
+		       tracefile);
+		exit(1);
+	    }
+	    last_us = now_us() - start;
+	    record_latency(lineno, last_us);
+	    break;
 
 	/* SIGINT command */
-	else if (!strcmp(command, "SIGINT")) {
+	case OP_SIGINT:
 	    if (kill(child_pid, SIGINT) < 0) {
 		perror("kill SIGINT");
 		exit(1);
 	    }
 	    if (verbose)
 		printf("Runtrace sent SIGINT to process %d\n", child_pid);
-	    continue;
-	}
+	    break;
 
 	/* SIGTSTP command */
-	else if (!strcmp(command, "SIGTSTP")) {
+	case OP_SIGTSTP:
 	    if (kill(child_pid, SIGTSTP) < 0) {
 		perror("kill SIGTSTP");
 		exit(1);
 	    }
 	    if (verbose)
 		printf("Runtrace sent SIGTSTP to process %d\n", child_pid);
-	    continue;
-	}
+	    break;
+
+	/* LOOP n ... END */
+	case OP_LOOP:
+	    op->left = op->arg;
+	    if (op->left <= 0)
+		pc = op->jump;
+	    break;
+
+	case OP_END:
+	    if (--ops[op->jump].left > 0)
+		pc = op->jump;
+	    break;
+
+	/* SLEEPMS command */
+	case OP_SLEEPMS:
+	    fflush(stdout);
+	    usleep((useconds_t)(op->arg * 1000 / warp));
+	    break;
+
+	/* 
+	 * PAUSEMS command: a recorded pause, skipped unless -r. One
+	 * right before a signal is always kept, since it decides where
+	 * the signal finds the job.
+	 */
+	case OP_PAUSEMS:
+	    if (realtime || op->jump) {
+		fflush(stdout);
+		usleep((useconds_t)(op->arg * 1000 / warp));
+	    }
+	    break;
+
+	/* EXPECT /regex/ on the output of the last NEXT */
+	case OP_EXPECT:
+	    if (regexec(&op->re, seen ? seen : "", 0, NULL, 0) != 0) {
+		printf("%s: line %d: EXPECT /%s/ did not match\n", 
+		       tracefile, lineno, op->text);
+		exit(1);
+	    }
+	    break;
+
+	/* ASSERT_LATENCY_MS on the last WAIT or NEXT */
+	case OP_LATENCY:
+	    if (last_us * warp > op->arg * 1000.0) {
+		printf("%s: line %d: step took %lld ms, limit is %d ms\n",
+		       tracefile, lineno, (long long)(last_us * warp) / 1000, 
+		       op->arg);
+		exit(1);
+	    }
+	    break;
 
 	/* Pass the command line on to the shell */
-	else {
+	default:
 	    if (verbose) {
-		printf("runtrace: Sending '%s' to shell\n", line);
+		printf("runtrace: Sending '%s' to shell\n", op->text);
 	    }
-	    strcat(line, "\n");
-	    if ((send(datafd[0], line, strlen(line), 0)) < 0) {
+	    if ((send(datafd[0], op->text, strlen(op->text), 0)) < 0) {
 		perror("send datafd[0]");
 		exit(1);
 	    }
 	}
-
-    } /* while loop */
+    }
 
     /* Signal EOF to the shell */
-    bufp = "";
-    send(datafd[0], bufp, 0, 0);
+    shutdown(datafd[0], SHUT_WR);
+
+    /* 
+     * Wait for the shell to terminate. Its pidfd becomes readable
+     * when it exits; the line after the last one keys the history.
+     */
+    lineno = nlines + 1;
+    start = now_us();
+    if ((pidfd = syscall(SYS_pidfd_open, child_pid, 0)) < 0) {
+	perror("pidfd_open");
+	exit(1);
+    }
+    if (readable(pidfd, step_timeout(lineno, timeout_ms)) == 0) {
+	printf("%s: Runtrace timed out while waiting for shell to terminate.\n",
+	       tracefile);
+	exit(1);
+    }
+    wait4(child_pid, NULL, 0, &ru);
+    record_latency(lineno, now_us() - start);
+    save_history();
+
+    /* The shell's resource usage, including the jobs it reaped */
+    if (perffp) {
+	fprintf(perffp, "rusage %lld %lld %ld %ld %ld %ld %ld\n",
+		ru.ru_utime.tv_sec * 1000000LL + ru.ru_utime.tv_usec,
+		ru.ru_stime.tv_sec * 1000000LL + ru.ru_stime.tv_usec,
+		ru.ru_maxrss, ru.ru_minflt, ru.ru_majflt, 
+		ru.ru_nvcsw, ru.ru_nivcsw);
+    }
 
-    /* Wait for the shell to terminate */
-    alarm(DRIVER_TIMEOUT);
-    state = "waiting for shell to terminate";
-    waitpid(child_pid, NULL, 0);
+    /* What the shell asked the kernel for, if it ran in the sandbox */
+    if (sandboxing) {
+	sandbox_stop();
+	if (perffp)
+	    sandbox_report(perffp);
+	else if (verbose)
+	    sandbox_report(stdout);
+    }
+    if (perffp)
+	fclose(perffp);
 
-    /* Kill any of our stray shells and jobs */
-    clean();
+    /* Kill any of our stray shells and jobs (via atexit) */
     exit(0);
 }
 
 
 /*
  * clean - clean up any stray jobs or shells 
+ *
+ * Kills exactly the processes this runtrace started: the shell and
+ * every process below it, including jobs it orphaned. Since we are
+ * the subreaper, killing our children hands their children to us, so
+ * each round kills and reaps the current children and the next round
+ * finds the level below. A child we have not reaped keeps its PID, so
+ * a recycled PID is never hit, and other runtraces on the same host
+ * are left alone.
  */
 void clean() {
-    system("/bin/kill tsh tshref mytstpp mytstps mycat myenv myintp myints myspin1 myspin2 mysplit > /dev/null 2>&1");
+    pid_t *pids = NULL;
+    int i, n, max = 0, round;
+
+    for (round = 0; round < CLEAN_ROUNDS; round++) {
+	if ((n = children(getpid(), &pids, &max)) == 0)
+	    break;
+	for (i = 0; i < n; i++)
+	    kill(pids[i], SIGKILL);
+	for (i = 0; i < n; i++)
+	    while (waitpid(pids[i], NULL, 0) < 0 && errno == EINTR)
+		;
+    }
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+	;
+    free(pids);
+}
+
+/*
+ * children - Find the live and unreaped children of process parent
+ *     (runtrace or the shell). Reads the kernel's per-thread children
+ *     lists, or scans /proc for parent's PID as the parent if the
+ *     kernel doesn't keep them. Stores the PIDs in *pids, which holds
+ *     *max and is grown with realloc, and returns how many.
+ */
+int children(pid_t parent, pid_t **pids, int *max)
+{
+    char path[64], stat[MAXBUF];
+    struct dirent *de;
+    DIR *dp;
+    FILE *fp;
+    char *p, state;
+    int n = 0, lists = 0, pid, ppid;
+
+    sprintf(path, "/proc/%d/task", (int)parent);
+    if ((dp = opendir(path)) != NULL) {
+	while ((de = readdir(dp)) != NULL) {
+	    if (!isdigit(de->d_name[0]))
+		continue;
+	    sprintf(path, "/proc/%d/task/%.20s/children", (int)parent, de->d_name);
+	    if ((fp = fopen(path, "r")) == NULL)
+		continue;
+	    lists++;
+	    while (fscanf(fp, "%d", &pid) == 1) {
+		add_pid(pids, max, n++, pid);
+	    }
+	    fclose(fp);
+	}
+	closedir(dp);
+    }
+    if (lists > 0 || (dp = opendir("/proc")) == NULL)
+	return n;
+
+    while ((de = readdir(dp)) != NULL) {
+	if (!isdigit(de->d_name[0]))
+	    continue;
+	sprintf(path, "/proc/%.20s/stat", de->d_name);
+	if ((fp = fopen(path, "r")) == NULL)
+	    continue;
+	if (fgets(stat, MAXBUF, fp) && (p = strrchr(stat, ')')) != NULL
+	    && sscanf(p + 1, " %c %d", &state, &ppid) == 2 
+	    && ppid == parent) {
+	    add_pid(pids, max, n++, atoi(de->d_name));
+	}
+	fclose(fp);
+    }
+    closedir(dp);
+    return n;
+}
+
+/*
+ * reaped - Wait up to ms milliseconds for one of the shell's children
+ *     at the last SIGNAL to leave its children list, which happens
+ *     only once the shell has reaped it. Since the shell reaps in its
+ *     SIGCHLD handler, it has also updated its job list by the time it
+ *     reads the next command. Returns 0 on timeout.
+ */
+int reaped(pid_t shell, int ms)
+{
+    static pid_t *pids = NULL;
+    static int max = 0;
+    long long end = now_us() + ms * 1000LL;
+    int i, k, n;
+
+    if (nsignalled == 0)
+	return 1;
+    while (1) {
+	n = children(shell, &pids, &max);
+	for (i = 0; i < nsignalled; i++) {
+	    for (k = 0; k < n; k++)
+		if (pids[k] == signalled[i])
+		    break;
+	    if (k == n)
+		return 1;
+	}
+	if (now_us() >= end)
+	    return 0;
+	usleep(1000);
+    }
+}
+
+/*
+ * add_pid - Store pid at index n of *pids, growing it if it is full
+ */
+void add_pid(pid_t **pids, int *max, int n, pid_t pid)
+{
+    if (n == *max) {
+	*max = *max ? 2 * *max : 64;
+	if ((*pids = realloc(*pids, *max * sizeof(pid_t))) == NULL) {
+	    perror("realloc");
+	    exit(1);
+	}
+    }
+    (*pids)[n] = pid;
 }
 
 /*
@@ -338,11 +798,31 @@ void clean() {
 void usage(char *msg)
 {
     printf("%s\n", msg);
-    printf("Usage: runtrace -f <file> -s <shellprog> [-hV]\n");
+    printf("Usage: runtrace -f <file> -s <shellprog> [-hVSrx] [-T <ms>] [-w <factor>]\n");
+    printf("                [-a <hist>] [-p <file>]\n");
+    printf("       runtrace -c <n> [-d <time>] [-f <file>] [-s <shellprog>]\n");
+    printf("       runtrace -R <file> [-s <shellprog>]\n");
     printf("Options:\n");
     printf("  -h            Print this message\n");
     printf("  -s <shell>    Shell program to test (default ./tsh)\n");
     printf("  -f <file>     Trace file\n");
+    printf("  -T <ms>       Timeout for each trace step (default %d)\n", 
+	   DRIVER_TIMEOUT * 1000);
+    printf("  -a <hist>     Adapt timeouts to latencies recorded in <hist>\n");
+    printf("  -p <file>     Write step latencies and shell rusage to <file>\n");
+    printf("  -S            Sync with jobs over the SYNCFD socket only\n");
+    printf("  -w <factor>   Run the clocks of the shell and its jobs <factor>\n");
+    printf("                times faster (preloads ./vtime.so); timeouts\n");
+    printf("                and SLEEPMS are in the shell's time\n");
+    printf("  -x            Run the shell in a seccomp sandbox that counts its\n");
+    printf("                system calls (reported with -p, or -V)\n");
+    printf("  -c <n>        Load generator: drive n shells with the trace's\n");
+    printf("                command lines (or a built-in mix) in a closed loop\n");
+    printf("  -d <time>     Load generator run time, e.g. 500ms, 60s, 2m (default 10s)\n");
+    printf("  -R <file>     Run the shell interactively and record the session,\n");
+    printf("                with its pauses and output, as a trace in <file>\n");
+    printf("  -r            Replay the trace's PAUSEMS pauses (1x speed); without\n");
+    printf("                -r only those right before a signal are kept\n");
     printf("  -V            Be more verbose\n");
 
     exit(0);
@@ -370,7 +850,7 @@ void print_child_status()
     pid_t pid; 
     int status;
 
-    pid = waitpid(-1, &status, WNOHANG);
+    pid = waitpid(shell_pid, &status, WNOHANG);
 
     if (pid > 0) {
 	if (WIFEXITED(status)) {
@@ -409,76 +889,1155 @@ void print_child_status()
 }
 
 /*
- * next_prompt - Print the shell response until the next prompt or EOF
- *               Returns 1 if OK, 0 on EOF or timeout
+ * vtime_setup - Preload vtime.so, found next to runtrace, into the 
+ *     shell and its jobs. VTIME tells it the factor and where virtual
+ *     time starts, so every process in the tree reads the same clocks.
  */
-int next_prompt(void)
+void vtime_setup(void)
 {
-    int n;
-    
-    bzero(buf, MAXBUF);
-    if (readable(datafd[0], DRIVER_TIMEOUT) == 0) {
-	printf("%s: Runtrace timed out waiting for next shell prompt\n", 
-	       tracefile);
-	print_child_status();
-	return 0;
+    char path[MAXBUF], *old;
+    struct timespec mono, real;
+    ssize_t n;
+
+    if ((n = readlink("/proc/self/exe", path, MAXBUF - 16)) < 0) {
+	perror("readlink /proc/self/exe");
+	exit(1);
     }
-    else {
-	if ((n = recv(datafd[0], buf, MAXBUF, 0)) < 0) {
-	    perror("next_prompt:recv1");
-	    exit(1);
-	}
-	else if (n == 0) { /* EOF */
-	    return 0;
-	} 
+    path[n] = '\0';
+    strcpy(strrchr(path, '/') + 1, "vtime.so");
+    if (access(path, R_OK) < 0) {
+	fprintf(stderr, "%s: File not found\n", path);
+	exit(1);
     }
+    if (!vtime_check(shellprog, path))
+	exit(1);
 
-    while(strcmp(buf, PROMPT)) {
-	printf("%s", buf);
-
-	bzero(buf, MAXBUF);
-	if (readable(datafd[0], DRIVER_TIMEOUT) == 0) {
-	    printf("%s: Runtrace timed out waiting for next shell prompt\n", 
-		   tracefile);
-	    print_child_status();
-	    return 0;
-	}
-	else {
-	    if ((n = recv(datafd[0], buf, MAXBUF, 0)) < 0) {
-		perror("next_prompt:recv1");
-		exit(1);
-	    }
-	    else if (n == 0) { /* EOF */
-		return 0;
-	    } 
-	}
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    sprintf(vtimeenv, "VTIME=%g %lld %lld", warp,
+	    mono.tv_sec * 1000000000LL + mono.tv_nsec,
+	    real.tv_sec * 1000000000LL + real.tv_nsec);
+    old = getenv("LD_PRELOAD");
+    snprintf(preloadenv, sizeof(preloadenv), "LD_PRELOAD=%s%s%s", path, 
+	     old ? ":" : "", old ? old : "");
+    if (putenv(vtimeenv) < 0 || putenv(preloadenv) < 0) {
+	perror("putenv");
+	exit(1);
     }
-    return 1;
+    if (verbose)
+	printf("Created environment variables %s and %s\n", 
+	       vtimeenv, preloadenv);
 }
 
 /*
- * readable - Wait secs seconds for descriptor fd to become readable
- *            Return > 0 if fd is readable, 0 if timeout.
+ * launch_shell - Start the shell in its own session, talking to us over
+ *     a new stream socket pair fd. The shell's output is framed by 
+ *     finding PROMPT in the stream, so it may arrive in pieces of any
+ *     size. Returns the shell's PID; fd[0] is our end.
  */
-int readable(int fd, int secs) 
+pid_t launch_shell(int *fd)
 {
-    int n;
-
-    fd_set rset;
-    struct timeval tv;
-
-    FD_ZERO(&rset);
-    FD_SET(fd, &rset);
+    char *shellargv[MAXARGS];
+    pid_t child_pid;
+    int sandboxfd[2];
 
-    tv.tv_sec = secs;
-    tv.tv_usec = 0;
-    
-    if ((n = select(fd+1, &rset, NULL, NULL, &tv)) < 0) {
-	perror("select");
+    if (socketpair(AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0, fd) < 0) {
+	perror("socketpair datafd");
+	exit(1);
+    }
+    if (sandboxing && pipe2(sandboxfd, O_CLOEXEC) < 0) {
+	perror("pipe2");
 	exit(1);
     }
 
-    return n;
+    /************************* 
+     * Child code runs a shell
+     *************************/ 
+    if ((child_pid  = fork()) == 0) {  
+
+	/* Run the shell in its own session, apart from other runtraces */
+	setsid();
+
+	/* Close the descriptor the child is not using */
+	close(fd[0]);
+
+	/* Redirect stdin and stdout to the domain socket */
+	dup2(fd[1], 0);
+	dup2(fd[1], 1);
+	
+	/* Create the shell command line arguments */
+	shellargv[0] = shellprog;
+	if (verbose) {
+	    shellargv[1] = "-v";
+	    shellargv[2] = '\0';
+	}
+	else {
+	    shellargv[1] = '\0';
+	}
+
+	/* Run under the seccomp sandbox if enabled */
+	if (sandboxing) {
+	    close(sandboxfd[0]);
+	    sandbox_child(sandboxfd[1]);
+	}
+
+	/* Now go ahead and run the shell */
+	if (execve(shellprog, shellargv, environ) < 0) {
+	    perror("execve");
+	    exit(1);
+	}
+    }
+    if (child_pid < 0) {
+	perror("fork");
+	exit(1);
+    }
+
+    /* Count and police the shell's system calls from here on */
+    if (sandboxing) {
+	close(sandboxfd[1]);
+	sandbox_start(child_pid, sandboxfd[0]);
+    }
+
+    /* Close the descriptor the parent is not using */
+    close(fd[1]); 
+    return child_pid;
+}
+
+/*
+ * next_prompt - Print the shell response until the count'th prompt or
+ *               EOF, keeping a copy in seen for EXPECT. The whole step
+ *               must finish within ms milliseconds (or the adaptive 
+ *               deadline for this line, if shorter).
+ *               Returns 1 if OK, 0 on timeout, -1 on EOF
+ */
+int next_prompt(int ms, int count)
+{
+    int n;
+    long long start = now_us();
+    long long deadline = start + step_timeout(lineno, ms) * 1000LL;
+
+    seen_len = 0;
+    if (seen)
+	seen[0] = '\0';
+    while (count-- > 0) {
+	if ((n = stream_prompt(&out, deadline)) == 0) {
+	    printf("%s: Runtrace timed out waiting for next shell prompt\n", 
+		   tracefile);
+	    print_child_status();
+	    return 0;
+	}
+	else if (n < 0) { /* EOF */
+	    return -1;
+	}
+    }
+    last_us = now_us() - start;
+    record_latency(lineno, last_us);
+    return 1;
+}
+
+/*
+ * compile_trace - Translate the trace file into ops. Besides the
+ *     classic WAIT, NEXT, SIGNAL, SIGINT and SIGTSTP, traces may use
+ *
+ *     TIMEOUT ms            default timeout for the steps that follow
+ *     LOOP n ... END        run the enclosed lines n times (nestable)
+ *     PARALLEL k            send the next k command lines back to back,
+ *                           then wait for all k prompts
+ *     SLEEPMS ms            pause
+ *     PAUSEMS ms            pause only when replaying in real time (-r),
+ *                           or before a signal; runtrace -R records
+ *                           the time between events this way
+ *     NOSYNC                jobs run on their own rather than waiting
+ *                           for SIGNAL, as in a session runtrace -R
+ *                           recorded
+ *     EXPECT /regex/        the last NEXT's output must match regex
+ *     ASSERT_LATENCY_MS ms  the last NEXT or WAIT must take at most ms
+ *     REAP                  wait until the shell has reaped one of the
+ *                           jobs it had at the last SIGNAL, so that a
+ *                           job SIGNAL let finish is off its job list
+ *
+ *     WAIT, NEXT and REAP take an optional timeout in ms for that step
+ *     only.
+ */
+void compile_trace(FILE *fp)
+{
+    int loops[MAXNEST];
+    int nest = 0, parallel = 0, width = 0;
+    int arg;
+    char *p, *q;
+    struct op_t *op;
+
+    while (fgets(line, MAXBUF, fp)) {
+	lineno = ++nlines;
+
+	/* Delete newline character */
+	line[strcspn(line, "\n")] = '\0';
+
+	/* Ignore blank lines */
+	if (blankline(line)) { 
+	    if (verbose) 
+		printf("runtrace: Ignoring blank line\n");
+	    continue;
+	}
+
+	/* Comment lines */
+	if (line[0] == '#') {
+	    add_op(OP_COMMENT, -1, line);
+	    continue;
+	}
+
+	/* Parse the command line */
+	sscanf(line, "%s", command);
+	arg = -1;
+	sscanf(line, "%*s %d", &arg);
+	if (verbose)
+	    printf("runtrace: command=%s line=%s\n", command, line);
+
+	if (parallel > 0 && (!strcmp(command, "WAIT") 
+			     || !strcmp(command, "NEXT")
+			     || !strcmp(command, "LOOP") 
+			     || !strcmp(command, "END")
+			     || !strcmp(command, "PARALLEL")))
+	    compile_error("PARALLEL block needs more command lines");
+
+	if (!strcmp(command, "WAIT"))
+	    add_op(OP_WAIT, arg, NULL);
+	else if (!strcmp(command, "NEXT"))
+	    add_op(OP_NEXT, arg, NULL)->jump = 1;
+	else if (!strcmp(command, "SIGNAL"))
+	    add_op(OP_SIGNAL, -1, NULL);
+	else if (!strcmp(command, "REAP")) {
+	    add_op(OP_REAP, arg, NULL);
+	    reaping = 1;
+	}
+	else if (!strcmp(command, "SIGINT") || !strcmp(command, "SIGTSTP")) {
+	    if (nops > 0 && ops[nops - 1].type == OP_PAUSEMS)
+		ops[nops - 1].jump = 1;
+	    add_op(command[3] == 'I' ? OP_SIGINT : OP_SIGTSTP, -1, NULL);
+	}
+	else if (!strcmp(command, "TIMEOUT")) {
+	    if (arg <= 0)
+		compile_error("TIMEOUT needs a positive number of ms");
+	    add_op(OP_TIMEOUT, arg, NULL);
+	}
+	else if (!strcmp(command, "LOOP")) {
+	    if (arg < 0)
+		compile_error("LOOP needs a count");
+	    if (nest == MAXNEST)
+		compile_error("LOOPs nested too deeply");
+	    loops[nest++] = nops;
+	    add_op(OP_LOOP, arg, NULL);
+	}
+	else if (!strcmp(command, "END")) {
+	    if (nest == 0)
+		compile_error("END without LOOP");
+	    op = add_op(OP_END, -1, NULL);
+	    op->jump = loops[--nest];
+	    ops[op->jump].jump = nops - 1;
+	}
+	else if (!strcmp(command, "PARALLEL")) {
+	    if (arg <= 0)
+		compile_error("PARALLEL needs a positive count");
+	    parallel = width = arg;
+	}
+	else if (!strcmp(command, "SLEEPMS")) {
+	    if (arg < 0)
+		compile_error("SLEEPMS needs a number of ms");
+	    add_op(OP_SLEEPMS, arg, NULL);
+	}
+	else if (!strcmp(command, "NOSYNC"))
+	    nosync = 1;
+	else if (!strcmp(command, "PAUSEMS")) {
+	    if (arg < 0)
+		compile_error("PAUSEMS needs a number of ms");
+	    add_op(OP_PAUSEMS, arg, NULL);
+	}
+	else if (!strcmp(command, "EXPECT")) {
+	    if ((p = strchr(line, '/')) == NULL 
+		|| (q = strrchr(line, '/')) == p)
+		compile_error("EXPECT needs a /regex/");
+	    *q = '\0';
+	    op = add_op(OP_EXPECT, -1, p + 1);
+	    if (regcomp(&op->re, op->text, 
+			REG_EXTENDED | REG_NOSUB | REG_NEWLINE) != 0)
+		compile_error("EXPECT has a bad regex");
+	}
+	else if (!strcmp(command, "ASSERT_LATENCY_MS")) {
+	    if (arg < 0)
+		compile_error("ASSERT_LATENCY_MS needs a number of ms");
+	    add_op(OP_LATENCY, arg, NULL);
+	}
+
+	/* A command line for the shell */
+	else {
+	    strcat(line, "\n");
+	    add_op(OP_COMMAND, -1, line);
+	    if (parallel > 0 && --parallel == 0)
+		add_op(OP_NEXT, -1, NULL)->jump = width;
+	}
+    }
+
+    lineno = nlines;
+    if (parallel > 0)
+	compile_error("PARALLEL block needs more command lines");
+    if (nest > 0)
+	compile_error("LOOP without END");
+    lineno = 0;
+}
+
+/*
+ * add_op - Append an op for the current trace line
+ */
+struct op_t *add_op(int type, int arg, char *text)
+{
+    static int maxops = 0;
+    struct op_t *op;
+
+    if (nops == maxops) {
+	maxops = maxops ? maxops * 2 : 64;
+	if ((ops = realloc(ops, maxops * sizeof(struct op_t))) == NULL) {
+	    perror("realloc");
+	    exit(1);
+	}
+    }
+    op = &ops[nops++];
+    bzero(op, sizeof(struct op_t));
+    op->type = type;
+    op->line = lineno;
+    op->arg = arg;
+    if (text && (op->text = strdup(text)) == NULL) {
+	perror("strdup");
+	exit(1);
+    }
+    return op;
+}
+
+/*
+ * compile_error - Report a bad trace line and give up
+ */
+void compile_error(char *msg)
+{
+    fprintf(stderr, "%s:%d: %s\n", tracefile, lineno, msg);
+    exit(1);
+}
+
+/*
+ * stream_recv - Receive whatever the shell has written into s without
+ *     waiting. Returns the number of bytes added, 0 if there was 
+ *     nothing to read, or -1 on EOF.
+ */
+int stream_recv(struct stream_t *s)
+{
+    ssize_t n;
+
+    if (s->cap - s->len < CHUNK) {
+	s->cap = s->cap ? s->cap * 2 : 2 * CHUNK;
+	if ((s->data = realloc(s->data, s->cap)) == NULL) {
+	    perror("realloc");
+	    exit(1);
+	}
+    }
+    while ((n = recv(s->fd, s->data + s->len, s->cap - s->len, 
+		     MSG_DONTWAIT)) < 0) {
+	if (errno == EAGAIN || errno == EWOULDBLOCK)
+	    return 0;
+	if (errno != EINTR) {
+	    perror("stream_recv:recv");
+	    exit(1);
+	}
+    }
+    if (n == 0)
+	return -1;
+    s->len += n;
+    return n;
+}
+
+/*
+ * stream_fill - Receive whatever the shell has written, waiting until
+ *     deadline for it. Returns the number of bytes added to s, 0 on
+ *     timeout, or -1 on EOF.
+ */
+int stream_fill(struct stream_t *s, long long deadline)
+{
+    int n;
+
+    do {
+	if (readable(s->fd, remaining(deadline)) == 0)
+	    return 0;
+    } while ((n = stream_recv(s)) == 0);
+    return n;
+}
+
+/*
+ * stream_forward - Copy the first n bytes of s to our stdout in one
+ *     write, append them to seen, and drop them
+ */
+void stream_forward(struct stream_t *s, size_t n)
+{
+    size_t done = 0;
+    ssize_t k;
+
+    if (seen_len + n + 1 > seen_cap) {
+	seen_cap = 2 * (seen_len + n + 1);
+	if ((seen = realloc(seen, seen_cap)) == NULL) {
+	    perror("realloc");
+	    exit(1);
+	}
+    }
+    memcpy(seen + seen_len, s->data, n);
+    seen_len += n;
+    seen[seen_len] = '\0';
+
+    fflush(stdout);
+    while (done < n) {
+	if ((k = write(STDOUT_FILENO, s->data + done, n - done)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    perror("stream_forward:write");
+	    exit(1);
+	}
+	done += k;
+    }
+    stream_drop(s, n);
+}
+
+/*
+ * stream_drop - Discard the first n bytes of s
+ */
+void stream_drop(struct stream_t *s, size_t n)
+{
+    memmove(s->data, s->data + n, s->len - n);
+    s->len -= n;
+    s->scan = s->scan > n ? s->scan - n : 0;
+}
+
+/*
+ * stream_scan - Feed the bytes of s not yet seen to the prompt matcher.
+ *     It resumes where it left off, so a prompt split across reads is
+ *     still found. Returns the offset just past the first complete
+ *     PROMPT, or 0 if there is none yet.
+ */
+size_t stream_scan(struct stream_t *s)
+{
+    int plen = strlen(PROMPT);
+    char c;
+
+    while (s->scan < s->len) {
+	c = s->data[s->scan++];
+	while (s->match > 0 && PROMPT[s->match] != c)
+	    s->match = prompt_fail[s->match - 1];
+	if (PROMPT[s->match] == c)
+	    s->match++;
+	if (s->match == plen) {
+	    s->match = 0;
+	    return s->scan;
+	}
+    }
+    return 0;
+}
+
+/*
+ * stream_prompt - Forward shell output up to the next PROMPT in the
+ *     stream and consume the prompt. Anything after the prompt stays
+ *     buffered for the next step. Output is forwarded once the prompt
+ *     is found, or in CHUNK-sized batches while a long-running command
+ *     keeps writing. Returns 1 when the prompt was found, 0 on timeout
+ *     and -1 on EOF; in the last two cases everything received so far
+ *     is forwarded.
+ */
+int stream_prompt(struct stream_t *s, long long deadline)
+{
+    int plen = strlen(PROMPT);
+    size_t end;
+    int n;
+
+    for (;;) {
+	if ((end = stream_scan(s)) > 0) {
+	    stream_forward(s, end - plen);
+	    stream_drop(s, plen);
+	    return 1;
+	}
+
+	/* Hand on all but a possible prompt prefix when the batch is full */
+	if (s->len - s->match >= CHUNK)
+	    stream_forward(s, s->len - s->match);
+
+	if ((n = stream_fill(s, deadline)) <= 0) {
+	    s->match = 0;
+	    stream_forward(s, s->len);
+	    return n;
+	}
+    }
+}
+
+/*
+ * prompt_init - Build the KMP failure function for PROMPT
+ */
+void prompt_init(void)
+{
+    int k, n, plen = strlen(PROMPT);
+
+    for (k = 0, n = 1; n < plen; n++) {
+	while (k > 0 && PROMPT[n] != PROMPT[k])
+	    k = prompt_fail[k - 1];
+	if (PROMPT[n] == PROMPT[k])
+	    k++;
+	prompt_fail[n] = k;
+    }
+}
+
+/*
+ * parse_duration - Convert "250ms", "60s", "2m" or a bare number of
+ *     seconds to microseconds. Returns -1 if str is not a duration.
+ */
+long long parse_duration(char *str)
+{
+    char *end;
+    double v = strtod(str, &end);
+
+    if (end == str || v < 0)
+	return -1;
+    if (*end == '\0' || !strcmp(end, "s"))
+	return v * 1000000;
+    if (!strcmp(end, "ms"))
+	return v * 1000;
+    if (!strcmp(end, "m"))
+	return v * 60000000;
+    return -1;
+}
+
+/*
+ * load_run - Drive nshells shells in a closed loop for duration_us.
+ *     Each shell gets the next command of the mix as soon as its 
+ *     previous one returns a prompt; all of them are served by one
+ *     epoll loop. The mix is the trace's command lines (LOOPs unrolled,
+ *     other directives skipped) or default_mix. Output is discarded,
+ *     and syncs from jobs are drained so they never block. Reports 
+ *     commands per second and command-to-prompt latency percentiles.
+ */
+void load_run(void)
+{
+    struct shell_t *sh, *p;
+    struct epoll_event ev, events[64];
+    char **mix = default_mix;
+    long long *lat = NULL, t, begin, end, next;
+    size_t nlat = 0, maxlat = 0, k;
+    int i, n, nmix, pc, lfd, active, errors = 0;
+    int iters[MAXNEST], depth = 0;
+
+    /* Flatten the trace into its command lines */
+    if (tracefile) {
+	nmix = 0;
+	if ((mix = malloc(sizeof(char *))) == NULL) {
+	    perror("malloc");
+	    exit(1);
+	}
+	for (pc = 0; pc < nops; pc++) {
+	    if (ops[pc].type == OP_LOOP) {
+		if (ops[pc].arg <= 0)
+		    pc = ops[pc].jump;
+		else
+		    iters[depth++] = ops[pc].arg;
+	    }
+	    else if (ops[pc].type == OP_END) {
+		if (--iters[depth - 1] > 0)
+		    pc = ops[pc].jump;
+		else
+		    depth--;
+	    }
+	    else if (ops[pc].type == OP_COMMAND) {
+		if ((mix = realloc(mix, (nmix + 2) * sizeof(char *))) == NULL) {
+		    perror("realloc");
+		    exit(1);
+		}
+		mix[nmix++] = ops[pc].text;
+	    }
+	}
+	mix[nmix] = NULL;
+	if (nmix == 0) {
+	    fprintf(stderr, "%s: No command lines to drive\n", tracefile);
+	    exit(1);
+	}
+    }
+    for (nmix = 0; mix[nmix]; nmix++)
+	;
+
+    if ((lfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+	perror("epoll_create1");
+	exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(lfd, EPOLL_CTL_ADD, syncfd[0], &ev) < 0) {
+	perror("epoll_ctl syncfd");
+	exit(1);
+    }
+
+    /* Start the shells; each one's first command waits for its prompt */
+    if ((sh = calloc(nshells, sizeof(struct shell_t))) == NULL) {
+	perror("calloc");
+	exit(1);
+    }
+    for (i = 0; i < nshells; i++) {
+	sh[i].pid = launch_shell(sh[i].fd);
+	sh[i].s.fd = sh[i].fd[0];
+	sh[i].next = i % nmix;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &sh[i];
+	if (epoll_ctl(lfd, EPOLL_CTL_ADD, sh[i].s.fd, &ev) < 0) {
+	    perror("epoll_ctl");
+	    exit(1);
+	}
+    }
+    shell_pid = sh[0].pid;
+
+    begin = now_us();
+    end = begin + duration_us;
+    active = nshells;
+    while (active > 0) {
+
+	/* Sleep until the run ends or the oldest command times out */
+	t = now_us();
+	next = end;
+	for (i = 0; i < nshells; i++) {
+	    if (sh[i].done)
+		continue;
+	    if (sh[i].sent == 0 && t >= end) {
+		sh[i].done = 1;
+		active--;
+		epoll_ctl(lfd, EPOLL_CTL_DEL, sh[i].s.fd, NULL);
+	    }
+	    else if (sh[i].sent && sh[i].sent + real_ms(timeout_ms) * 1000LL <= t) {
+		fprintf(stderr, "runtrace: shell %d timed out\n", sh[i].pid);
+		errors++;
+		sh[i].done = 1;
+		active--;
+		epoll_ctl(lfd, EPOLL_CTL_DEL, sh[i].s.fd, NULL);
+	    }
+	    else if (sh[i].sent && sh[i].sent + real_ms(timeout_ms) * 1000LL < next)
+		next = sh[i].sent + real_ms(timeout_ms) * 1000LL;
+	}
+	if (active == 0)
+	    break;
+	n = epoll_wait(lfd, events, 64, next > t ? (next - t + 999) / 1000 : 0);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    perror("epoll_wait");
+	    exit(1);
+	}
+
+	for (i = 0; i < n; i++) {
+	    p = events[i].data.ptr;
+
+	    /* A job's sync message */
+	    if (p == NULL) {
+		while (recv(syncfd[0], buf, MAXBUF, MSG_DONTWAIT) > 0)
+		    ;
+		continue;
+	    }
+	    if (p->done)
+		continue;
+
+	    if (stream_recv(&p->s) < 0) {
+		fprintf(stderr, "runtrace: shell %d exited\n", p->pid);
+		errors++;
+		p->done = 1;
+		active--;
+		epoll_ctl(lfd, EPOLL_CTL_DEL, p->s.fd, NULL);
+		continue;
+	    }
+
+	    /* Every prompt completes the outstanding command */
+	    while ((k = stream_scan(&p->s)) > 0) {
+		stream_drop(&p->s, k);
+		t = now_us();
+		if (p->sent) {
+		    if (nlat == maxlat) {
+			maxlat = maxlat ? 2 * maxlat : 4096;
+			if ((lat = realloc(lat, maxlat * sizeof(long long))) == NULL) {
+			    perror("realloc");
+			    exit(1);
+			}
+		    }
+		    lat[nlat++] = t - p->sent;
+		    p->sent = 0;
+		}
+		if (t < end) {
+		    if (send(p->s.fd, mix[p->next], strlen(mix[p->next]), 0) < 0) {
+			perror("send");
+			exit(1);
+		    }
+		    p->sent = t;
+		    p->next = (p->next + 1) % nmix;
+		}
+	    }
+
+	    /* Output is not kept, only a possible prompt prefix */
+	    stream_drop(&p->s, p->s.scan - p->s.match);
+	}
+    }
+    t = now_us() - begin;
+
+    /* Report */
+    printf("runtrace: %d shells, %.1f s, %lu commands, %.1f commands/s", 
+	   nshells, t / 1e6, (unsigned long)nlat, nlat / (t / 1e6));
+    if (errors)
+	printf(", %d shells failed", errors);
+    printf("\n");
+    if (nlat > 0) {
+	qsort(lat, nlat, sizeof(long long), cmp_ll);
+	printf("runtrace: latency p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+	       lat[(nlat - 1) * 50 / 100] / 1e3, lat[(nlat - 1) * 99 / 100] / 1e3,
+	       lat[(nlat - 1) * 999 / 1000] / 1e3, lat[nlat - 1] / 1e3);
+    }
+    fflush(stdout);
+    free(lat);
+    free(sh);
+}
+
+/*
+ * record_session - Run the shell on the user's terminal (-R) and write
+ *     the session to recordfile as a trace. Each command line typed at
+ *     a prompt is labeled with an echo like the lab's traces; lines
+ *     typed ahead while a job holds the prompt are sent bare. Ctrl-C
+ *     and Ctrl-Z reach runtrace rather than the shell, which runs in
+ *     its own session, so they are forwarded and recorded as SIGINT
+ *     and SIGTSTP. Every prompt becomes a NEXT, followed by an EXPECT
+ *     for each line the shell printed since the command. The time
+ *     between events is kept as PAUSEMS, which a replay honors with
+ *     -r and skips otherwise.
+ */
+void record_session(void)
+{
+    char input[MAXBUF], date[64];
+    struct sigaction sa;
+    struct pollfd pfd[2];
+    sigset_t mask, prev;
+    size_t inlen = 0, end, plen = strlen(PROMPT);
+    long long last;
+    int n, pending = 0, reading = 1;
+    char *nl;
+    time_t t;
+    FILE *fp;
+
+    if ((fp = fopen(recordfile, "w")) == NULL) {
+	perror(recordfile);
+	exit(1);
+    }
+    t = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&t));
+    fprintf(fp, "#\n# %s - Session with %s recorded by runtrace -R on %s\n#\n",
+	    recordfile, shellprog, date);
+    fprintf(fp, "NOSYNC\n");
+
+    /* Catch the keys, and only take them between polls */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = record_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTSTP, &sa, NULL);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+
+    shell_pid = launch_shell(datafd);
+    out.fd = datafd[0];
+
+    /* The initial prompt is not part of the trace */
+    if (stream_prompt(&out, now_us() + timeout_ms * 1000LL) <= 0) {
+	fprintf(stderr, "%s: Runtrace timed out waiting for initial shell prompt\n", 
+		shellprog);
+	exit(1);
+    }
+    if (write(STDOUT_FILENO, PROMPT, plen) < 0)
+	;
+    seen_len = 0;
+    if (seen)
+	seen[0] = '\0';
+    last = now_us();
+
+    for (;;) {
+	if (rec_sigint || rec_sigtstp) {
+	    record_pause(fp, &last);
+	    fprintf(fp, "%s\n", rec_sigint ? "SIGINT" : "SIGTSTP");
+	    if (kill(shell_pid, rec_sigint ? SIGINT : SIGTSTP) < 0) {
+		perror("kill");
+		exit(1);
+	    }
+	    if (rec_sigint)
+		rec_sigint = 0;
+	    else
+		rec_sigtstp = 0;
+	    continue;
+	}
+
+	/* Hand each complete input line to the shell */
+	while ((nl = memchr(input, '\n', inlen)) != NULL) {
+	    *nl = '\0';
+	    if (blankline(input)) {
+		if (pending == 0 && write(STDOUT_FILENO, PROMPT, plen) < 0)
+		    ;
+	    }
+	    else {
+		record_pause(fp, &last);
+		if (pending == 0) {
+		    /* What a job printed in the background goes unchecked */
+		    echo_cmd(fp, input);
+		    seen_len = 0;
+		    if (seen)
+			seen[0] = '\0';
+		}
+		fprintf(fp, "%s\n", input);
+		*nl = '\n';
+		if (send(out.fd, input, nl - input + 1, 0) < 0) {
+		    perror("send datafd[0]");
+		    exit(1);
+		}
+		pending++;
+	    }
+	    inlen -= nl + 1 - input;
+	    memmove(input, nl + 1, inlen);
+	}
+
+	pfd[0].fd = out.fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = reading ? STDIN_FILENO : -1;
+	pfd[1].events = POLLIN;
+	if (ppoll(pfd, 2, NULL, &prev) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    perror("ppoll");
+	    exit(1);
+	}
+
+	if (pfd[1].revents) {
+	    if (inlen == sizeof(input) - 1)
+		inlen = 0;    /* a line too long for a trace */
+	    if ((n = read(STDIN_FILENO, input + inlen, 
+			  sizeof(input) - 1 - inlen)) > 0)
+		inlen += n;
+	    else if (n == 0 || errno != EINTR) {
+		/* End of input: the shell sees EOF too, as after a trace */
+		reading = 0;
+		shutdown(out.fd, SHUT_WR);
+	    }
+	}
+
+	if (pfd[0].revents) {
+	    if (stream_recv(&out) < 0)
+		break;
+	    while ((end = stream_scan(&out)) > 0) {
+		stream_forward(&out, end - plen);
+		stream_drop(&out, plen);
+		if (write(STDOUT_FILENO, PROMPT, plen) < 0)
+		    ;
+		if (pending > 0) {
+		    /* The NEXT waits as long as the shell did */
+		    pending--;
+		    fprintf(fp, "NEXT\n");
+		    record_expect(fp, seen);
+		    last = now_us();
+		}
+		seen_len = 0;
+		seen[0] = '\0';
+	    }
+	    stream_forward(&out, out.len - out.match);
+	}
+    }
+
+    /* The shell quit (or saw EOF): the trace ends here */
+    stream_forward(&out, out.len);
+    waitpid(shell_pid, NULL, 0);
+    fclose(fp);
+    printf("\nruntrace: session recorded in %s\n", recordfile);
+    fflush(stdout);
+}
+
+/*
+ * record_handler - SIGINT and SIGTSTP handler while recording. The
+ *     main loop forwards the signal to the shell and records it.
+ */
+void record_handler(int sig)
+{
+    if (sig == SIGINT)
+	rec_sigint = 1;
+    else
+	rec_sigtstp = 1;
+}
+
+/*
+ * record_pause - Write the time since *last, in the shell's ms, as a
+ *     PAUSEMS line, and restart the clock
+ */
+void record_pause(FILE *fp, long long *last)
+{
+    long long t = now_us();
+    int ms = (int)((t - *last) * warp / 1000);
+
+    if (ms > 0)
+	fprintf(fp, "PAUSEMS %d\n", ms);
+    *last = t;
+}
+
+/*
+ * record_expect - Write an EXPECT for each non-blank line of out. The
+ *     lines are matched literally, except that runs of three or more
+ *     digits (process IDs) match any number. Lines too long for a
+ *     trace are left out.
+ */
+void record_expect(FILE *fp, char *out)
+{
+    char re[MAXBUF / 2];
+    size_t len, k;
+    char *p, *eol;
+
+    for (p = out; *p; p = *eol ? eol + 1 : eol) {
+	eol = p + strcspn(p, "\n");
+	if (eol == p)
+	    continue;
+	len = 0;
+	while (p < eol && len < sizeof(re) - 8) {
+	    k = strspn(p, "0123456789");
+	    if (k >= 3) {
+		strcpy(re + len, "[0-9]+");
+		len += 6;
+		p += k;
+		continue;
+	    }
+	    if (strchr(".[]()*+?{}|^$\\", *p))
+		re[len++] = '\\';
+	    re[len++] = *p++;
+	}
+	if (p == eol)
+	    fprintf(fp, "EXPECT /^%.*s$/\n", (int)len, re);
+    }
+}
+
+/*
+ * readable - Wait up to ms milliseconds for descriptor fd to become
+ *            readable. The deadline is a timerfd in the same epoll set
+ *            as fd. Return > 0 if fd is readable, 0 if timeout.
+ */
+int readable(int fd, int ms) 
+{
+    struct epoll_event ev, events[2];
+    struct itimerspec its;
+    uint64_t ticks;
+    int i, n, ready = 0, expired = 0;
+
+    if (epfd < 0) {
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+	    perror("epoll_create1");
+	    exit(1);
+	}
+	if ((timerfd = timerfd_create(CLOCK_MONOTONIC, 
+				      TFD_CLOEXEC | TFD_NONBLOCK)) < 0) {
+	    perror("timerfd_create");
+	    exit(1);
+	}
+	ev.events = EPOLLIN;
+	ev.data.fd = timerfd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd, &ev) < 0) {
+	    perror("epoll_ctl timerfd");
+	    exit(1);
+	}
+    }
+    if (ms <= 0)
+	return 0;
+
+    bzero(&its, sizeof(its));
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+    if (timerfd_settime(timerfd, 0, &its, NULL) < 0) {
+	perror("timerfd_settime");
+	exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+	perror("epoll_ctl");
+	exit(1);
+    }
+
+    while (!ready && !expired) {
+	if ((n = epoll_wait(epfd, events, 2, -1)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    perror("epoll_wait");
+	    exit(1);
+	}
+	for (i = 0; i < n; i++) {
+	    if (events[i].data.fd == fd)
+		ready = 1;
+	    else
+		expired = 1;
+	}
+    }
+
+    /* Disarm the timer and drain any expiration it left behind */
+    bzero(&its, sizeof(its));
+    timerfd_settime(timerfd, 0, &its, NULL);
+    while (read(timerfd, &ticks, sizeof(ticks)) > 0)
+	;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+
+    return ready;
+}
+
+/*
+ * now_us - Monotonic time in microseconds
+ */
+long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+ * remaining - Milliseconds left until deadline (in now_us() time),
+ *             rounded up so that a pending deadline never reads as 0.
+ */
+int remaining(long long deadline)
+{
+    long long left = deadline - now_us();
+
+    return left > 0 ? (int)((left + 999) / 1000) : 0;
+}
+
+/*
+ * cmp_ll - qsort comparator for latencies
+ */
+int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * step_timeout - Deadline in ms for trace line step, given its
+ *     configured timeout ms (of the shell's time, under -w). With -a,
+ *     a line that has enough history gets HISTFACTOR times its p99 
+ *     latency instead, bounded below by MIN_TIMEOUT and above by ms.
+ */
+int step_timeout(int step, int ms)
+{
+    long long sorted[HISTKEEP], p99;
+    struct hist_t *h;
+    int adapt;
+
+    ms = real_ms(ms);
+    if (!histfile || step < 0 || step >= MAXSTEPS)
+	return ms;
+    h = &hist[step];
+    if (h->n < HISTMIN)
+	return ms;
+
+    memcpy(sorted, h->us, h->n * sizeof(long long));
+    qsort(sorted, h->n, sizeof(long long), cmp_ll);
+    p99 = sorted[(h->n * 99 + 99) / 100 - 1];
+
+    adapt = (int)((p99 * HISTFACTOR + 999) / 1000);
+    if (adapt < MIN_TIMEOUT)
+	adapt = MIN_TIMEOUT;
+    if (verbose)
+	printf("runtrace: line %d p99 %lldus, deadline %dms\n", 
+	       step, p99, adapt < ms ? adapt : ms);
+    return adapt < ms ? adapt : ms;
+}
+
+/*
+ * real_ms - Real milliseconds that pass while the shell's clocks move
+ *     ms ahead under -w, rounded up so a timeout never becomes 0
+ */
+int real_ms(int ms)
+{
+    int r = (int)(ms / warp);
+
+    return r < ms / warp ? r + 1 : r;
+}
+
+/*
+ * record_latency - Note how long trace line step took in this run,
+ *     for the history (-a) and as a "step <line> <usecs>" record (-p)
+ */
+void record_latency(int step, long long us)
+{
+    if (perffp)
+	fprintf(perffp, "step %d %lld\n", step, us);
+    if (histfile && step >= 0 && step < MAXSTEPS)
+	hist[step].run = us;
+}
+
+/*
+ * load_history - Read the samples for this shell and trace from the
+ *     history file. Each line is "<shell> <trace> <line> <usecs>".
+ */
+void load_history(void)
+{
+    char shell[MAXBUF], trace[MAXBUF];
+    struct hist_t *h;
+    long long us;
+    int i, step;
+    FILE *fp;
+
+    for (i = 0; i < MAXSTEPS; i++) {
+	hist[i].n = hist[i].next = 0;
+	hist[i].run = -1;
+    }
+    if (!histfile || (fp = fopen(histfile, "r")) == NULL)
+	return;
+
+    while (fgets(buf, MAXBUF, fp)) {
+	if (sscanf(buf, "%s %s %d %lld", shell, trace, &step, &us) != 4)
+	    continue;
+	if (strcmp(shell, shellprog) || strcmp(trace, tracefile)
+	    || step < 0 || step >= MAXSTEPS)
+	    continue;
+	h = &hist[step];
+	h->us[h->next] = us;
+	h->next = (h->next + 1) % HISTKEEP;
+	if (h->n < HISTKEEP)
+	    h->n++;
+    }
+    fclose(fp);
+}
+
+/*
+ * save_history - Append this run's samples to the history file. It is
+ *     one O_APPEND write, so concurrent runtraces do not interleave.
+ */
+void save_history(void)
+{
+    char *out;
+    int i, fd;
+    size_t len = 0, cap = MAXBUF;
+
+    if (!histfile)
+	return;
+    if ((out = malloc(cap)) == NULL)
+	return;
+    for (i = 0; i < MAXSTEPS; i++) {
+	if (hist[i].run < 0)
+	    continue;
+	if (cap - len < MAXBUF && (out = realloc(out, cap *= 2)) == NULL)
+	    return;
+	len += snprintf(out + len, cap - len, "%s %s %d %lld\n", 
+			shellprog, tracefile, i, hist[i].run);
+    }
+    if ((fd = open(histfile, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+	perror(histfile);
+	free(out);
+	return;
+    }
+    if (write(fd, out, len) < 0)
+	perror("write history");
+    close(fd);
+    free(out);
 }
 
 void send_msg(int defused)
@@ -0,0 +1,986 @@
+/*
+ * sandbox.c - Seccomp sandbox and system call counter for runtrace -x
+ *
+ * The shell runs under a seccomp-bpf filter that hands every system
+ * call it or its jobs make to runtrace (SECCOMP_RET_USER_NOTIF). A
+ * thread in runtrace counts each one by process and syscall number,
+ * refuses the calls a shell has no business making, and lets the
+ * rest continue. No ptrace is involved, so the shell and its jobs
+ * keep their normal parent/child and signal behavior.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include "sandbox.h"
+
+/* Highest syscall number counted, per architecture */
+#define MAXSYSCALL 512
+
+/* 
+ * Calls from other ABIs are counted apart. On x86-64 that is i386, so
+ * 32-bit shells (like the shipped tshref) have their own name and deny
+ * tables, and calls from any other ABI are refused.
+ */
+#if defined(__x86_64__)
+#define NATIVE_ARCH AUDIT_ARCH_X86_64
+#define COMPAT_ARCH AUDIT_ARCH_I386
+#elif defined(__i386__)
+#define NATIVE_ARCH AUDIT_ARCH_I386
+#elif defined(__aarch64__)
+#define NATIVE_ARCH AUDIT_ARCH_AARCH64
+#else
+#error "sandbox.c: unknown architecture"
+#endif
+
+/* The child announces the listener on a descriptor at least this high */
+#define ANNOUNCE_FD 512
+
+/* 
+ * Counts by [arch][nr], arch 0 native and 1 compat. Only the monitor
+ * thread writes them, and only after it has been joined are they read.
+ */
+static unsigned long shell_calls[2][MAXSYSCALL];
+static unsigned long job_calls[2][MAXSYSCALL];
+static unsigned long denied;
+
+static pid_t shell_pid;
+static int listener = -1;
+static int stopfd = -1;
+static pthread_t monitor;
+
+/* System calls the sandbox refuses with EPERM (native numbers) */
+static int deny[] = {
+#ifdef SYS_ptrace
+    SYS_ptrace,
+#endif
+#ifdef SYS_mount
+    SYS_mount,
+#endif
+#ifdef SYS_umount2
+    SYS_umount2,
+#endif
+#ifdef SYS_reboot
+    SYS_reboot,
+#endif
+#ifdef SYS_kexec_load
+    SYS_kexec_load,
+#endif
+#ifdef SYS_init_module
+    SYS_init_module,
+#endif
+#ifdef SYS_finit_module
+    SYS_finit_module,
+#endif
+#ifdef SYS_delete_module
+    SYS_delete_module,
+#endif
+#ifdef SYS_swapon
+    SYS_swapon,
+#endif
+#ifdef SYS_swapoff
+    SYS_swapoff,
+#endif
+#ifdef SYS_pivot_root
+    SYS_pivot_root,
+#endif
+#ifdef SYS_chroot
+    SYS_chroot,
+#endif
+#ifdef SYS_setns
+    SYS_setns,
+#endif
+#ifdef SYS_unshare
+    SYS_unshare,
+#endif
+#ifdef SYS_socket
+    SYS_socket,
+#endif
+#ifdef SYS_connect
+    SYS_connect,
+#endif
+#ifdef SYS_bind
+    SYS_bind,
+#endif
+#ifdef SYS_listen
+    SYS_listen,
+#endif
+    -1
+};
+
+/* Names of the native system calls a shell is likely to make */
+static struct {
+    int nr;
+    char *name;
+} sysnames[] = {
+#ifdef SYS_read
+    { SYS_read, "read" },
+#endif
+#ifdef SYS_write
+    { SYS_write, "write" },
+#endif
+#ifdef SYS_open
+    { SYS_open, "open" },
+#endif
+#ifdef SYS_openat
+    { SYS_openat, "openat" },
+#endif
+#ifdef SYS_openat2
+    { SYS_openat2, "openat2" },
+#endif
+#ifdef SYS_close
+    { SYS_close, "close" },
+#endif
+#ifdef SYS_stat
+    { SYS_stat, "stat" },
+#endif
+#ifdef SYS_fstat
+    { SYS_fstat, "fstat" },
+#endif
+#ifdef SYS_lstat
+    { SYS_lstat, "lstat" },
+#endif
+#ifdef SYS_newfstatat
+    { SYS_newfstatat, "newfstatat" },
+#endif
+#ifdef SYS_statx
+    { SYS_statx, "statx" },
+#endif
+#ifdef SYS_poll
+    { SYS_poll, "poll" },
+#endif
+#ifdef SYS_ppoll
+    { SYS_ppoll, "ppoll" },
+#endif
+#ifdef SYS_lseek
+    { SYS_lseek, "lseek" },
+#endif
+#ifdef SYS_mmap
+    { SYS_mmap, "mmap" },
+#endif
+#ifdef SYS_mprotect
+    { SYS_mprotect, "mprotect" },
+#endif
+#ifdef SYS_munmap
+    { SYS_munmap, "munmap" },
+#endif
+#ifdef SYS_brk
+    { SYS_brk, "brk" },
+#endif
+#ifdef SYS_rt_sigaction
+    { SYS_rt_sigaction, "rt_sigaction" },
+#endif
+#ifdef SYS_rt_sigprocmask
+    { SYS_rt_sigprocmask, "rt_sigprocmask" },
+#endif
+#ifdef SYS_rt_sigreturn
+    { SYS_rt_sigreturn, "rt_sigreturn" },
+#endif
+#ifdef SYS_rt_sigsuspend
+    { SYS_rt_sigsuspend, "rt_sigsuspend" },
+#endif
+#ifdef SYS_rt_sigpending
+    { SYS_rt_sigpending, "rt_sigpending" },
+#endif
+#ifdef SYS_rt_sigtimedwait
+    { SYS_rt_sigtimedwait, "rt_sigtimedwait" },
+#endif
+#ifdef SYS_sigaltstack
+    { SYS_sigaltstack, "sigaltstack" },
+#endif
+#ifdef SYS_ioctl
+    { SYS_ioctl, "ioctl" },
+#endif
+#ifdef SYS_pread64
+    { SYS_pread64, "pread64" },
+#endif
+#ifdef SYS_pwrite64
+    { SYS_pwrite64, "pwrite64" },
+#endif
+#ifdef SYS_readv
+    { SYS_readv, "readv" },
+#endif
+#ifdef SYS_writev
+    { SYS_writev, "writev" },
+#endif
+#ifdef SYS_access
+    { SYS_access, "access" },
+#endif
+#ifdef SYS_faccessat
+    { SYS_faccessat, "faccessat" },
+#endif
+#ifdef SYS_faccessat2
+    { SYS_faccessat2, "faccessat2" },
+#endif
+#ifdef SYS_pipe
+    { SYS_pipe, "pipe" },
+#endif
+#ifdef SYS_pipe2
+    { SYS_pipe2, "pipe2" },
+#endif
+#ifdef SYS_select
+    { SYS_select, "select" },
+#endif
+#ifdef SYS_pselect6
+    { SYS_pselect6, "pselect6" },
+#endif
+#ifdef SYS_sched_yield
+    { SYS_sched_yield, "sched_yield" },
+#endif
+#ifdef SYS_mremap
+    { SYS_mremap, "mremap" },
+#endif
+#ifdef SYS_madvise
+    { SYS_madvise, "madvise" },
+#endif
+#ifdef SYS_dup
+    { SYS_dup, "dup" },
+#endif
+#ifdef SYS_dup2
+    { SYS_dup2, "dup2" },
+#endif
+#ifdef SYS_dup3
+    { SYS_dup3, "dup3" },
+#endif
+#ifdef SYS_nanosleep
+    { SYS_nanosleep, "nanosleep" },
+#endif
+#ifdef SYS_clock_nanosleep
+    { SYS_clock_nanosleep, "clock_nanosleep" },
+#endif
+#ifdef SYS_clock_gettime
+    { SYS_clock_gettime, "clock_gettime" },
+#endif
+#ifdef SYS_gettimeofday
+    { SYS_gettimeofday, "gettimeofday" },
+#endif
+#ifdef SYS_getpid
+    { SYS_getpid, "getpid" },
+#endif
+#ifdef SYS_getppid
+    { SYS_getppid, "getppid" },
+#endif
+#ifdef SYS_gettid
+    { SYS_gettid, "gettid" },
+#endif
+#ifdef SYS_socket
+    { SYS_socket, "socket" },
+#endif
+#ifdef SYS_socketpair
+    { SYS_socketpair, "socketpair" },
+#endif
+#ifdef SYS_connect
+    { SYS_connect, "connect" },
+#endif
+#ifdef SYS_accept
+    { SYS_accept, "accept" },
+#endif
+#ifdef SYS_accept4
+    { SYS_accept4, "accept4" },
+#endif
+#ifdef SYS_bind
+    { SYS_bind, "bind" },
+#endif
+#ifdef SYS_listen
+    { SYS_listen, "listen" },
+#endif
+#ifdef SYS_sendto
+    { SYS_sendto, "sendto" },
+#endif
+#ifdef SYS_recvfrom
+    { SYS_recvfrom, "recvfrom" },
+#endif
+#ifdef SYS_sendmsg
+    { SYS_sendmsg, "sendmsg" },
+#endif
+#ifdef SYS_recvmsg
+    { SYS_recvmsg, "recvmsg" },
+#endif
+#ifdef SYS_shutdown
+    { SYS_shutdown, "shutdown" },
+#endif
+#ifdef SYS_clone
+    { SYS_clone, "clone" },
+#endif
+#ifdef SYS_clone3
+    { SYS_clone3, "clone3" },
+#endif
+#ifdef SYS_fork
+    { SYS_fork, "fork" },
+#endif
+#ifdef SYS_vfork
+    { SYS_vfork, "vfork" },
+#endif
+#ifdef SYS_execve
+    { SYS_execve, "execve" },
+#endif
+#ifdef SYS_execveat
+    { SYS_execveat, "execveat" },
+#endif
+#ifdef SYS_exit
+    { SYS_exit, "exit" },
+#endif
+#ifdef SYS_exit_group
+    { SYS_exit_group, "exit_group" },
+#endif
+#ifdef SYS_wait4
+    { SYS_wait4, "wait4" },
+#endif
+#ifdef SYS_waitid
+    { SYS_waitid, "waitid" },
+#endif
+#ifdef SYS_kill
+    { SYS_kill, "kill" },
+#endif
+#ifdef SYS_tkill
+    { SYS_tkill, "tkill" },
+#endif
+#ifdef SYS_tgkill
+    { SYS_tgkill, "tgkill" },
+#endif
+#ifdef SYS_uname
+    { SYS_uname, "uname" },
+#endif
+#ifdef SYS_fcntl
+    { SYS_fcntl, "fcntl" },
+#endif
+#ifdef SYS_flock
+    { SYS_flock, "flock" },
+#endif
+#ifdef SYS_fsync
+    { SYS_fsync, "fsync" },
+#endif
+#ifdef SYS_truncate
+    { SYS_truncate, "truncate" },
+#endif
+#ifdef SYS_ftruncate
+    { SYS_ftruncate, "ftruncate" },
+#endif
+#ifdef SYS_getcwd
+    { SYS_getcwd, "getcwd" },
+#endif
+#ifdef SYS_chdir
+    { SYS_chdir, "chdir" },
+#endif
+#ifdef SYS_fchdir
+    { SYS_fchdir, "fchdir" },
+#endif
+#ifdef SYS_rename
+    { SYS_rename, "rename" },
+#endif
+#ifdef SYS_renameat
+    { SYS_renameat, "renameat" },
+#endif
+#ifdef SYS_renameat2
+    { SYS_renameat2, "renameat2" },
+#endif
+#ifdef SYS_mkdir
+    { SYS_mkdir, "mkdir" },
+#endif
+#ifdef SYS_mkdirat
+    { SYS_mkdirat, "mkdirat" },
+#endif
+#ifdef SYS_rmdir
+    { SYS_rmdir, "rmdir" },
+#endif
+#ifdef SYS_unlink
+    { SYS_unlink, "unlink" },
+#endif
+#ifdef SYS_unlinkat
+    { SYS_unlinkat, "unlinkat" },
+#endif
+#ifdef SYS_readlink
+    { SYS_readlink, "readlink" },
+#endif
+#ifdef SYS_readlinkat
+    { SYS_readlinkat, "readlinkat" },
+#endif
+#ifdef SYS_getdents
+    { SYS_getdents, "getdents" },
+#endif
+#ifdef SYS_getdents64
+    { SYS_getdents64, "getdents64" },
+#endif
+#ifdef SYS_setpgid
+    { SYS_setpgid, "setpgid" },
+#endif
+#ifdef SYS_getpgrp
+    { SYS_getpgrp, "getpgrp" },
+#endif
+#ifdef SYS_getpgid
+    { SYS_getpgid, "getpgid" },
+#endif
+#ifdef SYS_setsid
+    { SYS_setsid, "setsid" },
+#endif
+#ifdef SYS_getsid
+    { SYS_getsid, "getsid" },
+#endif
+#ifdef SYS_alarm
+    { SYS_alarm, "alarm" },
+#endif
+#ifdef SYS_pause
+    { SYS_pause, "pause" },
+#endif
+#ifdef SYS_getrusage
+    { SYS_getrusage, "getrusage" },
+#endif
+#ifdef SYS_sysinfo
+    { SYS_sysinfo, "sysinfo" },
+#endif
+#ifdef SYS_times
+    { SYS_times, "times" },
+#endif
+#ifdef SYS_getuid
+    { SYS_getuid, "getuid" },
+#endif
+#ifdef SYS_getgid
+    { SYS_getgid, "getgid" },
+#endif
+#ifdef SYS_geteuid
+    { SYS_geteuid, "geteuid" },
+#endif
+#ifdef SYS_getegid
+    { SYS_getegid, "getegid" },
+#endif
+#ifdef SYS_arch_prctl
+    { SYS_arch_prctl, "arch_prctl" },
+#endif
+#ifdef SYS_prctl
+    { SYS_prctl, "prctl" },
+#endif
+#ifdef SYS_prlimit64
+    { SYS_prlimit64, "prlimit64" },
+#endif
+#ifdef SYS_getrlimit
+    { SYS_getrlimit, "getrlimit" },
+#endif
+#ifdef SYS_set_tid_address
+    { SYS_set_tid_address, "set_tid_address" },
+#endif
+#ifdef SYS_set_robust_list
+    { SYS_set_robust_list, "set_robust_list" },
+#endif
+#ifdef SYS_futex
+    { SYS_futex, "futex" },
+#endif
+#ifdef SYS_getrandom
+    { SYS_getrandom, "getrandom" },
+#endif
+#ifdef SYS_rseq
+    { SYS_rseq, "rseq" },
+#endif
+#ifdef SYS_memfd_create
+    { SYS_memfd_create, "memfd_create" },
+#endif
+#ifdef SYS_pidfd_open
+    { SYS_pidfd_open, "pidfd_open" },
+#endif
+#ifdef SYS_pidfd_send_signal
+    { SYS_pidfd_send_signal, "pidfd_send_signal" },
+#endif
+#ifdef SYS_epoll_create1
+    { SYS_epoll_create1, "epoll_create1" },
+#endif
+#ifdef SYS_epoll_ctl
+    { SYS_epoll_ctl, "epoll_ctl" },
+#endif
+#ifdef SYS_epoll_wait
+    { SYS_epoll_wait, "epoll_wait" },
+#endif
+#ifdef SYS_epoll_pwait
+    { SYS_epoll_pwait, "epoll_pwait" },
+#endif
+#ifdef SYS_timerfd_create
+    { SYS_timerfd_create, "timerfd_create" },
+#endif
+#ifdef SYS_timerfd_settime
+    { SYS_timerfd_settime, "timerfd_settime" },
+#endif
+#ifdef SYS_eventfd2
+    { SYS_eventfd2, "eventfd2" },
+#endif
+#ifdef SYS_signalfd4
+    { SYS_signalfd4, "signalfd4" },
+#endif
+#ifdef SYS_mount
+    { SYS_mount, "mount" },
+#endif
+#ifdef SYS_umount2
+    { SYS_umount2, "umount2" },
+#endif
+#ifdef SYS_ptrace
+    { SYS_ptrace, "ptrace" },
+#endif
+#ifdef SYS_reboot
+    { SYS_reboot, "reboot" },
+#endif
+#ifdef SYS_kexec_load
+    { SYS_kexec_load, "kexec_load" },
+#endif
+#ifdef SYS_init_module
+    { SYS_init_module, "init_module" },
+#endif
+#ifdef SYS_finit_module
+    { SYS_finit_module, "finit_module" },
+#endif
+#ifdef SYS_delete_module
+    { SYS_delete_module, "delete_module" },
+#endif
+#ifdef SYS_swapon
+    { SYS_swapon, "swapon" },
+#endif
+#ifdef SYS_swapoff
+    { SYS_swapoff, "swapoff" },
+#endif
+#ifdef SYS_pivot_root
+    { SYS_pivot_root, "pivot_root" },
+#endif
+#ifdef SYS_chroot
+    { SYS_chroot, "chroot" },
+#endif
+#ifdef SYS_setns
+    { SYS_setns, "setns" },
+#endif
+#ifdef SYS_unshare
+    { SYS_unshare, "unshare" },
+#endif
+    { -1, NULL }
+};
+
+#ifdef COMPAT_ARCH
+/* 
+ * The same for i386, whose numbers differ. These are literal, since
+ * <sys/syscall.h> only has the native ones. socket, connect, bind
+ * and listen may also come through socketcall, which is checked by
+ * its first argument.
+ */
+static int deny_i386[] = {
+    26, 21, 52, 88, 283, 128, 350, 129, 87,   /* ptrace ... swapon */
+    115, 217, 61, 346, 310,                   /* swapoff ... unshare */
+    359, 362, 361, 363,                       /* socket, connect, bind, listen */
+    -1
+};
+#define I386_SOCKETCALL 102
+#define SOCKETCALL_LISTEN 4   /* socketcall 1-4: socket, bind, connect, listen */
+
+static struct {
+    int nr;
+    char *name;
+} i386names[] = {
+    { 3, "read" },
+    { 4, "write" },
+    { 5, "open" },
+    { 295, "openat" },
+    { 437, "openat2" },
+    { 6, "close" },
+    { 106, "stat" },
+    { 108, "fstat" },
+    { 107, "lstat" },
+    { 383, "statx" },
+    { 168, "poll" },
+    { 309, "ppoll" },
+    { 19, "lseek" },
+    { 90, "mmap" },
+    { 125, "mprotect" },
+    { 91, "munmap" },
+    { 45, "brk" },
+    { 174, "rt_sigaction" },
+    { 175, "rt_sigprocmask" },
+    { 173, "rt_sigreturn" },
+    { 179, "rt_sigsuspend" },
+    { 176, "rt_sigpending" },
+    { 177, "rt_sigtimedwait" },
+    { 186, "sigaltstack" },
+    { 54, "ioctl" },
+    { 180, "pread64" },
+    { 181, "pwrite64" },
+    { 145, "readv" },
+    { 146, "writev" },
+    { 33, "access" },
+    { 307, "faccessat" },
+    { 439, "faccessat2" },
+    { 42, "pipe" },
+    { 331, "pipe2" },
+    { 82, "select" },
+    { 308, "pselect6" },
+    { 158, "sched_yield" },
+    { 163, "mremap" },
+    { 219, "madvise" },
+    { 41, "dup" },
+    { 63, "dup2" },
+    { 330, "dup3" },
+    { 162, "nanosleep" },
+    { 267, "clock_nanosleep" },
+    { 265, "clock_gettime" },
+    { 78, "gettimeofday" },
+    { 20, "getpid" },
+    { 64, "getppid" },
+    { 224, "gettid" },
+    { 359, "socket" },
+    { 360, "socketpair" },
+    { 362, "connect" },
+    { 364, "accept4" },
+    { 361, "bind" },
+    { 363, "listen" },
+    { 369, "sendto" },
+    { 371, "recvfrom" },
+    { 370, "sendmsg" },
+    { 372, "recvmsg" },
+    { 373, "shutdown" },
+    { 120, "clone" },
+    { 435, "clone3" },
+    { 2, "fork" },
+    { 190, "vfork" },
+    { 11, "execve" },
+    { 358, "execveat" },
+    { 1, "exit" },
+    { 252, "exit_group" },
+    { 114, "wait4" },
+    { 284, "waitid" },
+    { 37, "kill" },
+    { 238, "tkill" },
+    { 270, "tgkill" },
+    { 122, "uname" },
+    { 55, "fcntl" },
+    { 143, "flock" },
+    { 118, "fsync" },
+    { 92, "truncate" },
+    { 93, "ftruncate" },
+    { 183, "getcwd" },
+    { 12, "chdir" },
+    { 133, "fchdir" },
+    { 38, "rename" },
+    { 302, "renameat" },
+    { 353, "renameat2" },
+    { 39, "mkdir" },
+    { 296, "mkdirat" },
+    { 40, "rmdir" },
+    { 10, "unlink" },
+    { 301, "unlinkat" },
+    { 85, "readlink" },
+    { 305, "readlinkat" },
+    { 141, "getdents" },
+    { 220, "getdents64" },
+    { 57, "setpgid" },
+    { 65, "getpgrp" },
+    { 132, "getpgid" },
+    { 66, "setsid" },
+    { 147, "getsid" },
+    { 27, "alarm" },
+    { 29, "pause" },
+    { 77, "getrusage" },
+    { 116, "sysinfo" },
+    { 43, "times" },
+    { 24, "getuid" },
+    { 47, "getgid" },
+    { 49, "geteuid" },
+    { 50, "getegid" },
+    { 172, "prctl" },
+    { 340, "prlimit64" },
+    { 76, "getrlimit" },
+    { 258, "set_tid_address" },
+    { 311, "set_robust_list" },
+    { 240, "futex" },
+    { 355, "getrandom" },
+    { 386, "rseq" },
+    { 356, "memfd_create" },
+    { 434, "pidfd_open" },
+    { 424, "pidfd_send_signal" },
+    { 329, "epoll_create1" },
+    { 255, "epoll_ctl" },
+    { 256, "epoll_wait" },
+    { 319, "epoll_pwait" },
+    { 322, "timerfd_create" },
+    { 325, "timerfd_settime" },
+    { 328, "eventfd2" },
+    { 327, "signalfd4" },
+    { 21, "mount" },
+    { 52, "umount2" },
+    { 26, "ptrace" },
+    { 88, "reboot" },
+    { 283, "kexec_load" },
+    { 128, "init_module" },
+    { 350, "finit_module" },
+    { 129, "delete_module" },
+    { 87, "swapon" },
+    { 115, "swapoff" },
+    { 217, "pivot_root" },
+    { 61, "chroot" },
+    { 346, "setns" },
+    { 310, "unshare" },
+    { 102, "socketcall" },
+    { 140, "_llseek" },
+    { 192, "mmap2" },
+    { 197, "fstat64" },
+    { 195, "stat64" },
+    { 196, "lstat64" },
+    { 300, "fstatat64" },
+    { 221, "fcntl64" },
+    { 7, "waitpid" },
+    { 119, "sigreturn" },
+    { 67, "sigaction" },
+    { 126, "sigprocmask" },
+    { 72, "sigsuspend" },
+    { 191, "ugetrlimit" },
+    { 199, "getuid32" },
+    { 200, "getgid32" },
+    { 201, "geteuid32" },
+    { 202, "getegid32" },
+    { 243, "set_thread_area" },
+    { 403, "clock_gettime64" },
+    { 407, "clock_nanosleep_time64" },
+    { 414, "ppoll_time64" },
+    { 413, "pselect6_time64" },
+    { 142, "_newselect" },
+    { 193, "truncate64" },
+    { 194, "ftruncate64" },
+    { 422, "futex_time64" },
+    { 411, "timerfd_settime64" },
+    { 421, "rt_sigtimedwait_time64" },
+    { 268, "statfs64" },
+    { -1, NULL }
+};
+#endif
+
+static void *monitor_main(void *arg);
+static char *sysname(int arch, int nr, char *buf);
+
+/*
+ * sandbox_child - Install the filter in the shell's process (after the
+ *     fork, before execve) and pass the listener descriptor to
+ *     runtrace through fd. The only call the filter lets through
+ *     unseen is a native write to the announcing descriptor, which
+ *     is moved out of the way first; everything else, starting with
+ *     its close, waits for runtrace's monitor.
+ */
+void sandbox_child(int fd)
+{
+    struct sock_filter filter[] = {
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, NATIVE_ARCH, 0, 5),
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_write, 0, 3),
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, args[0])),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ANNOUNCE_FD, 0, 1),
+	BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+	BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_USER_NOTIF),
+    };
+    struct sock_fprog prog = { 
+	sizeof(filter) / sizeof(filter[0]), filter 
+    };
+    int lfd;
+
+    if (dup2(fd, ANNOUNCE_FD) < 0) {
+	perror("dup2");
+	_exit(1);
+    }
+    close(fd);
+    fd = ANNOUNCE_FD;
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0) {
+	perror("prctl PR_SET_NO_NEW_PRIVS");
+	_exit(1);
+    }
+    if ((lfd = syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, 
+		       SECCOMP_FILTER_FLAG_NEW_LISTENER, &prog)) < 0) {
+	perror("seccomp");
+	_exit(1);
+    }
+    if (write(fd, &lfd, sizeof(lfd)) != sizeof(lfd))
+	_exit(1);
+    close(fd);
+    close(lfd);
+}
+
+/*
+ * sandbox_start - Fetch the listener from the shell's process through
+ *     fd and start the monitor thread
+ */
+void sandbox_start(pid_t shell, int fd)
+{
+    int lfd, pidfd;
+
+    shell_pid = shell;
+    if (read(fd, &lfd, sizeof(lfd)) != sizeof(lfd)) {
+	fprintf(stderr, "sandbox: shell did not install the filter\n");
+	exit(1);
+    }
+    close(fd);
+    if ((pidfd = syscall(SYS_pidfd_open, shell, 0)) < 0
+	|| (listener = syscall(SYS_pidfd_getfd, pidfd, lfd, 0)) < 0) {
+	perror("sandbox: pidfd_getfd");
+	exit(1);
+    }
+    close(pidfd);
+    fcntl(listener, F_SETFD, FD_CLOEXEC);
+    if ((stopfd = eventfd(0, EFD_CLOEXEC)) < 0) {
+	perror("sandbox: eventfd");
+	exit(1);
+    }
+    if ((errno = pthread_create(&monitor, NULL, monitor_main, NULL)) != 0) {
+	perror("sandbox: pthread_create");
+	exit(1);
+    }
+}
+
+/*
+ * sandbox_stop - Stop the monitor. Jobs still alive after this block
+ *     in their next system call until runtrace kills them.
+ */
+void sandbox_stop(void)
+{
+    uint64_t one = 1;
+
+    if (stopfd < 0)
+	return;
+    if (write(stopfd, &one, sizeof(one)) < 0)
+	perror("sandbox: write");
+    pthread_join(monitor, NULL);
+    close(stopfd);
+    stopfd = -1;
+}
+
+/*
+ * monitor_main - Answer the filter's notifications until told to stop
+ *     or until no process is left under the filter
+ */
+static void *monitor_main(void *arg)
+{
+    struct seccomp_notif_sizes sizes;
+    struct seccomp_notif *req;
+    struct seccomp_notif_resp *resp;
+    struct pollfd pfds[2];
+    int a, i, nr, *list;
+
+    if (syscall(SYS_seccomp, SECCOMP_GET_NOTIF_SIZES, 0, &sizes) < 0) {
+	perror("sandbox: SECCOMP_GET_NOTIF_SIZES");
+	exit(1);
+    }
+    if ((req = malloc(sizes.seccomp_notif)) == NULL
+	|| (resp = malloc(sizes.seccomp_notif_resp)) == NULL) {
+	perror("malloc");
+	exit(1);
+    }
+
+    pfds[0].fd = listener;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = stopfd;
+    pfds[1].events = POLLIN;
+    for (;;) {
+	if (poll(pfds, 2, -1) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    perror("sandbox: poll");
+	    exit(1);
+	}
+	if (pfds[1].revents)
+	    break;
+	if (pfds[0].revents & (POLLHUP | POLLERR))
+	    break;
+
+	memset(req, 0, sizes.seccomp_notif);
+	if (ioctl(listener, SECCOMP_IOCTL_NOTIF_RECV, req) < 0) {
+	    if (errno == EINTR || errno == ENOENT)
+		continue;
+	    break;
+	}
+	nr = req->data.nr;
+	a = req->data.arch == NATIVE_ARCH ? 0 : 1;
+	if (nr >= 0 && nr < MAXSYSCALL) {
+	    if ((pid_t)req->pid == shell_pid)
+		shell_calls[a][nr]++;
+	    else
+		job_calls[a][nr]++;
+	}
+
+	/* Look nr up in its own ABI's deny list */
+	list = NULL;
+	if (a == 0) {
+	    list = deny;
+#ifdef __X32_SYSCALL_BIT
+	    nr &= ~__X32_SYSCALL_BIT;
+#endif
+	}
+#ifdef COMPAT_ARCH
+	else if (req->data.arch == COMPAT_ARCH)
+	    list = deny_i386;
+#endif
+	for (i = 0; list && list[i] >= 0 && list[i] != nr; i++)
+	    ;
+
+	memset(resp, 0, sizes.seccomp_notif_resp);
+	resp->id = req->id;
+	resp->flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+	if (!list || list[i] >= 0
+#ifdef COMPAT_ARCH
+	    || (list == deny_i386 && nr == I386_SOCKETCALL 
+		&& req->data.args[0] >= 1 && req->data.args[0] <= SOCKETCALL_LISTEN)
+#endif
+	    ) {
+	    resp->flags = 0;
+	    resp->error = -EPERM;
+	    denied++;
+	}
+
+	/* ENOENT: the caller died while we looked */
+	ioctl(listener, SECCOMP_IOCTL_NOTIF_SEND, resp);
+    }
+    free(req);
+    free(resp);
+    return NULL;
+}
+
+/*
+ * sandbox_report - Write the counts of every system call made by the
+ *     shell or its jobs, one "syscall <name> <shell> <jobs>" per line,
+ *     then "denied <n>" if the sandbox refused any
+ */
+void sandbox_report(FILE *fp)
+{
+    char buf[32];
+    int a, nr;
+
+    for (a = 0; a < 2; a++)
+	for (nr = 0; nr < MAXSYSCALL; nr++)
+	    if (shell_calls[a][nr] || job_calls[a][nr])
+		fprintf(fp, "syscall %s %lu %lu\n", sysname(a, nr, buf),
+			shell_calls[a][nr], job_calls[a][nr]);
+    if (denied)
+	fprintf(fp, "denied %lu\n", denied);
+}
+
+/*
+ * sysname - Name of system call nr, or "<arch>_<nr>" if unknown. The
+ *     i386 names are the same as the native ones where the call is,
+ *     so sdriver -X lines the two shells up by name.
+ */
+static char *sysname(int arch, int nr, char *buf)
+{
+    int i;
+
+    if (arch == 0)
+	for (i = 0; sysnames[i].name; i++)
+	    if (sysnames[i].nr == nr)
+		return sysnames[i].name;
+#ifdef COMPAT_ARCH
+    if (arch == 1)
+	for (i = 0; i386names[i].name; i++)
+	    if (i386names[i].nr == nr)
+		return i386names[i].name;
+#endif
+    sprintf(buf, "%s_%d", arch == 0 ? "sys" : "compat", nr);
+    return buf;
+}
@@ -0,0 +1,22 @@
+/*
+ * sandbox.h - Seccomp sandbox and system call counter for runtrace -x
+ */
+#ifndef __SANDBOX_H__
+#define __SANDBOX_H__
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/* In the shell's child process, before execve: install the filter */
+void sandbox_child(int fd);
+
+/* In runtrace, right after the fork: start answering the filter */
+void sandbox_start(pid_t shell, int fd);
+
+/* Stop counting once the shell has exited */
+void sandbox_stop(void);
+
+/* Write "syscall <name> <shell count> <jobs count>" records to fp */
+void sandbox_report(FILE *fp);
+
+#endif /* __SANDBOX_H__ */
@@ -12,31 +12,188 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <ctype.h>
+#include <math.h>
 #include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <dirent.h>
 
 #include "config.h"
+#include "vtime.h"
+
+/* A runtrace process whose stdout is being captured */
+struct run_t {
+    pid_t pid;        /* runtrace process */
+    int fd;           /* read end of its stdout pipe, -1 at EOF */
+    char *out;        /* captured output, null-terminated */
+    int len, cap;     /* bytes captured and allocated */
+    int status;       /* wait status */
+    char cmd[MAXBUF]; /* equivalent command line, for messages */
+    char perf[64];    /* runtrace -p file, or empty */
+    long long start;  /* when it started, us */
+    long long end;    /* when it closed its pipe, us */
+};
+
+/* How one iteration of one trace went */
+struct result_t {
+    int state;        /* RESULT_NONE (not run), RESULT_PASS, RESULT_FAIL */
+    double ms;        /* the test shell's wall time */
+};
+
+#define RESULT_NONE 0
+#define RESULT_PASS 1
+#define RESULT_FAIL 2
+
+/* What the results of one trace add up to; times in ms */
+struct tstats_t {
+    int runs, passed;
+    double min, median, p90, max, mean, sd;
+};
+
+/* Running sums for one measured quantity of one shell */
+struct sample_t {
+    int n;
+    double sum, sumsq;
+};
+
+/* How often the test (0) and reference (1) shell made one system call */
+struct calls_t {
+    char name[32];
+    unsigned long shell[2];
+};
+
+/* Per-run quantities compared by -P, besides the individual steps */
+#define USAGE_TOTAL 0   /* sum of the step latencies, ms */
+#define USAGE_CPU   1   /* user + system time from rusage, ms */
+#define USAGE_RSS   2   /* max resident set, KB */
+#define USAGE_CSW   3   /* voluntary + involuntary context switches */
+#define NUSAGE      4
+
+/* What the --stress workers have done so far, shared with the parent */
+struct stress_t {
+    unsigned long runs;      /* generated traces run */
+    unsigned long failures;  /* of those, how many tsh got wrong */
+    unsigned long rejected;  /* how many tshref couldn't run */
+};
 
 /* Prototypes */
 void usage(void);
 int runtrace(char *tracefile);
-void delete_tmpfiles(void);
-void emit_file(char *filename);
+int runiters(int t, char *tracefile);
+int runiter(int t, char *tracefile, int j);
+int perftrace(char *tracefile);
+int explore(char *tracefile);
+int sched_run(char *tracefile, char *sched, unsigned long long seed, 
+	      int nforks, int iter);
+void syscalltrace(char *tracefile);
+void stress(void);
+void stress_worker(int w, struct stress_t *st, FILE *log);
+int stress_run(unsigned long long seed, int nsteps, char *drops, 
+	       char *trace, char *report);
+int stress_minimize(unsigned long long seed, char *trace, char *report,
+		    char *drops);
+void gen_trace(char *trace, unsigned long long seed, int nsteps, char *drops);
+long long parse_duration(char *str);
+long long now_us(void);
+int cmpcalls(const void *a, const void *b);
+int read_perf(struct run_t *run, int shell, struct sample_t (**stepsp)[2],
+	      int **linesp, int *nstepsp, struct sample_t usage[][2]);
+void add_sample(struct sample_t *s, double x);
+int perf_row(char *name, struct sample_t *test, struct sample_t *ref, 
+	     double floor);
+double tcrit95(double df);
+void run_parallel(char **tracefiles, int num_tracefiles, int *order, 
+		  int stream);
+void alloc_results(int num_tracefiles);
+void trace_stats(int t, struct tstats_t *st);
+void print_stats(char **tracefiles, int num_tracefiles);
+void write_json(char *filename, char **tracefiles, int num_tracefiles);
+void write_junit(char *filename, char **tracefiles, int num_tracefiles);
+void fput_escaped(FILE *fp, char *str, int xml);
+int cmpdouble(const void *a, const void *b);
+void store_run(char *tracefile, int ok);
+void read_steps(char *perffile);
+int compare(char **tracefiles, int num_tracefiles, int *correct);
+char *store_setup(void);
+unsigned long long file_hash(char *filename);
+void watch(char **tracefiles, int num_tracefiles);
+void store_history(char **tracefiles, int num_tracefiles, int *failed,
+		   double *ms);
+int build_shell(void);
+void wait_change(int fd);
+void start_run(struct run_t *run, char *shell, char *tracefile, int sandbox,
+	       int perf);
+void finish_runs(struct run_t *runs, int n);
+void save_output(char *tracefile, char *suffix, char *text);
+char *read_file(char *filename, long *lenp);
+unsigned long long hash_bytes(unsigned long long h, const void *buf, long len);
+unsigned long long ref_key(char *tracefile);
+int load_variants(unsigned long long key, char ***variantsp);
+void add_variant(unsigned long long key, char *ref_out);
+int split_lines(char *text, char ***linesp);
+int filter_output(char *raw, char ***linesp);
+int same_output(char *test, char *ref);
+void emit_diff(char *test, char *ref);
+void free_lines(char **lines, int n);
+int cmpline(const void *a, const void *b);
+
+/* Lines of context around each hunk of a unified diff */
+#define DIFF_CONTEXT 3
 
 /* 
- * Perl program that filters a shell output file:
- *
- * (1) Elides all whitespace. 
- * (2) Converts PIDs of the form "(12345)" to "(PID)". 
- *
- * These transformations allow us to do diffs on the outputs of 
- * different runs of different shells.  
+ * -P runs each shell PERF_ITERS times per trace (unless -i says
+ * otherwise). tsh fails a trace if its total step latency or its CPU
+ * time is higher than tshref's with 95% confidence, by more than 
+ * PERF_SLACK of tshref's mean and more than PERF_FLOOR. Single steps
+ * are flagged too but, being many and noisy, don't fail the trace.
+ */
+#define PERF_ITERS      10
+#define PERF_SLACK      0.25
+#define PERF_FLOOR      1.0   /* ms */
+
+/* -e exhaustive tries both orders at no more than this many forks */
+#define SCHED_MAXFORKS  8
+
+/*
+ * --stress runs traces from tracegen with STRESS_STEPS steps, prints
+ * progress every STRESS_REPORT seconds, and spends no more than
+ * STRESS_MINRUNS runs minimizing each failing trace.
+ */
+#define OPT_STRESS      256   /* getopt_long values for --stress, */
+#define OPT_JSON        257   /* --json, */
+#define OPT_JUNIT       258   /* --junit, */
+#define OPT_STORE       259   /* --store, */
+#define OPT_NOSTORE     260   /* --no-store, */
+#define OPT_COMPARE     261   /* --compare, */
+#define OPT_WATCH       262   /* and --watch */
+#define STRESS_STEPS    12
+#define STRESS_REPORT   10
+#define STRESS_MINRUNS  32
+
+/*
+ * Every plain iteration is appended to the store as a line
+ *   <shell hash> <time> <setup> <trace> <pass> <wall us> <line>:<us> ...
+ * with one <line>:<us> per step that runtrace -p timed. The setup is
+ * "w<warp>-j<workers>", since either changes the timings. --compare
+ * weighs this build's runs against those of the COMPARE_BASELINES
+ * builds tested before it, with the -P test, slack and floor.
  */
-#define PERLPROG "while(<>){chomp; s/\\s+//g; s/\\(\\d+\\)/\\(PID\\)/g; print \"$_\\n\"}"
+#define COMPARE_BASELINES 3
+#define STORE_MAXLINE     256  /* trace lines whose steps are compared */
+
+/* --watch waits for WATCH_QUIET ms without changes before it rebuilds */
+#define WATCH_QUIET       300
 
 /********************
  * Global variables
@@ -46,6 +203,45 @@ char *shellprog = "./tsh";  /* Name of test shell (-s) */
 int sandboxing = 0;         /* Enable sandboxing (-x) */
 int autograded = 0;         /* Set only on the Autolab server (-A) */
 int num_iters=ITERS;        /* How many times to test each trace file */
+int num_workers = 1;        /* How many traces to run at once (-j) */
+char *outdir = NULL;        /* Save raw shell outputs in this directory (-o) */
+char *refcache = ".refcache"; /* Reference output cache, NULL if off (-c, -C) */
+int refresh = 0;            /* Run tshref even if its output is cached (-r) */
+int perfmode = 0;           /* Compare performance against tshref (-P) */
+int syscallmode = 0;        /* Compare system call counts with tshref (-X) */
+char *warp = NULL;          /* Run the shells' clocks this much faster (-w) */
+char *schedmode = NULL;     /* Explore fork schedules: random, pct, exhaustive (-e) */
+unsigned long long schedseed; /* First seed for -e, --stress (-S) */
+long long stress_us = 0;    /* Run generated traces for this long (--stress) */
+long long stress_end;       /* When the --stress workers stop */
+char *stressdir = "stress"; /* Where they keep failing traces (-o) */
+int stressing = 0;          /* In a --stress worker: tolerate tshref failures */
+char *jsonfile = NULL;      /* Write per-trace statistics here as JSON (--json) */
+char *junitfile = NULL;     /* ... and here as JUnit XML (--junit) */
+struct result_t *results;   /* num_iters per trace, shared with the workers */
+double last_ms;             /* wall time of runtrace's last test shell run */
+int brief = 0;              /* runtrace: a repeated failure, skip the diff */
+char *store = ".results";   /* Append-only store of run timings, NULL if off */
+int compare_n = 0;          /* Builds to compare this one with (--compare) */
+unsigned long long shell_hash; /* Hash of the test shell, keys the store */
+int recording = 0;          /* runtrace: time the test shell's steps */
+char last_steps[4 * MAXBUF]; /* ... as " <line>:<us>" for each step */
+int watching = 0;           /* Rebuild and rerun on every change (--watch) */
+
+/* The sources --watch watches */
+static char *watch_files[] = {"tsh.c", "fork.c", NULL};
+
+/* Options with no one-letter form */
+static struct option longopts[] = {
+    {"stress", required_argument, NULL, OPT_STRESS},
+    {"json", required_argument, NULL, OPT_JSON},
+    {"junit", required_argument, NULL, OPT_JUNIT},
+    {"store", required_argument, NULL, OPT_STORE},
+    {"no-store", no_argument, NULL, OPT_NOSTORE},
+    {"compare", optional_argument, NULL, OPT_COMPARE},
+    {"watch", no_argument, NULL, OPT_WATCH},
+    {NULL, 0, NULL, 0}
+};
 
 /* Null-terminated list of trace files */
 static char *default_tracefiles[] = {TRACEFILES, NULL};
@@ -54,26 +250,17 @@ static char *default_tracefiles[] = {TRACEFILES, NULL};
 char autoresult[MAXBUF]; /* Autolab autoresult string */  
 char status[MAXBUF];
 
-/* Temp filenames for unfiltered shell output */
-char ref_raw_outfile[MAXBUF];
-char test_raw_outfile[MAXBUF];
-char diff_raw_outfile[MAXBUF];
-
-/* Temp filenames for filtered shell output */
-char ref_filtered_outfile[MAXBUF];
-char test_filtered_outfile[MAXBUF];
-char diff_filtered_outfile[MAXBUF];
-
 /**************
  * Main routine
  **************/
 int main(int argc, char **argv)
 {
-    int i, j;
-    char c;
+    int i, c;
 
     int correct[MAXTRACES];    /* True if trace i is correct */
     int num_correct;           /* Number of correct traces */ 
+    int expected;              /* Results recorded per trace */
+    struct tstats_t st;
 
     char **tracefiles = NULL;  /* Null-terminated array of trace file names */
     int num_tracefiles = 0;    /* The number of traces in that array */
@@ -81,6 +268,8 @@ int main(int argc, char **argv)
     int singletrace = 0;       /* Are we testing one trace or all? (-t) */
 
     struct stat statbuf;
+    int iters_set = 0;         /* Was -i given? */
+    int seed_set = 0;          /* Was -S given? */
 
     /* Set up the default list of tracefiles */
     tracefiles = default_tracefiles;
@@ -89,7 +278,8 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "Ai:t:s:hVx")) != EOF) {
+    while ((c = getopt_long(argc, argv, "Ai:j:o:c:CrPXt:s:w:e:S:hVx", 
+			    longopts, NULL)) != EOF) {
         switch (c) {
 
 	case 'A': /* hidden Autolab driver argument */
@@ -102,6 +292,96 @@ int main(int argc, char **argv)
 		printf("Error: Invalid number of iters (-i)\n");
 		usage();
 	    }
+	    iters_set = 1;
+	    break;
+
+	case 'j': /* number of traces to run in parallel */
+	    num_workers = atoi(optarg);
+	    if (num_workers < 1) {
+		printf("Error: Invalid number of workers (-j)\n");
+		usage();
+	    }
+	    break;
+
+	case 'o': /* directory to save raw shell outputs in */
+	    outdir = strdup(optarg);
+	    break;
+
+	case 'c': /* reference output cache directory */
+	    refcache = strdup(optarg);
+	    break;
+
+	case 'C': /* always run the reference shell, don't cache */
+	    refcache = NULL;
+	    break;
+
+	case 'r': /* rerun the reference shell and record new variants */
+	    refresh = 1;
+	    break;
+
+	case 'P': /* compare step latencies and rusage with tshref */
+	    perfmode = 1;
+	    break;
+
+	case 'X': /* compare system call histograms with tshref */
+	    syscallmode = 1;
+	    break;
+
+	case 'w': /* virtual time: passed on to runtrace */
+	    warp = strdup(optarg);
+	    if (atof(warp) <= 0) {
+		printf("Error: Invalid warp factor (-w)\n");
+		usage();
+	    }
+	    break;
+
+	case 'e': /* explore fork schedules (see fork.c) */
+	    schedmode = strdup(optarg);
+	    if (strcmp(schedmode, "random") && strcmp(schedmode, "exhaustive")
+		&& strcmp(schedmode, "pct") && strncmp(schedmode, "pct:", 4)) {
+		printf("Error: Invalid schedule strategy (-e)\n");
+		usage();
+	    }
+	    break;
+
+	case 'S': /* first schedule seed */
+	    schedseed = strtoull(optarg, NULL, 0);
+	    seed_set = 1;
+	    break;
+
+	case OPT_STRESS: /* run generated traces for a while */
+	    if ((stress_us = parse_duration(optarg)) <= 0) {
+		printf("Error: Invalid duration (--stress)\n");
+		usage();
+	    }
+	    break;
+
+	case OPT_JSON: /* per-trace statistics as JSON */
+	    jsonfile = strdup(optarg);
+	    break;
+
+	case OPT_JUNIT: /* per-trace statistics as JUnit XML */
+	    junitfile = strdup(optarg);
+	    break;
+
+	case OPT_STORE: /* results store */
+	    store = strdup(optarg);
+	    break;
+
+	case OPT_NOSTORE: /* don't record results */
+	    store = NULL;
+	    break;
+
+	case OPT_COMPARE: /* compare with earlier builds */
+	    compare_n = optarg ? atoi(optarg) : COMPARE_BASELINES;
+	    if (compare_n < 1) {
+		printf("Error: Invalid number of builds (--compare)\n");
+		usage();
+	    }
+	    break;
+
+	case OPT_WATCH: /* rebuild and rerun on every change */
+	    watching = 1;
 	    break;
 
 	case 's':  /* The name of the test shell (default ./tsh) */
@@ -136,6 +416,15 @@ int main(int argc, char **argv)
         }
     }
 	
+    /* --watch builds the shell itself, and then never returns */
+    if (watching) {
+	if (perfmode || schedmode || singletrace || stress_us || compare_n) {
+	    printf("Error: --watch can't be used with -e, -P, -t, --stress or --compare\n");
+	    usage();
+	}
+	watch(tracefiles, num_tracefiles);
+    }
+
     /* Make sure the requested shell is executable */
     if (stat(shellprog, &statbuf) < 0) {
 	fprintf(stderr, "%s: File not found\n", shellprog);
@@ -146,185 +435,2142 @@ int main(int argc, char **argv)
 	exit(1);
     } 
 
-    if (singletrace && autograded) {
-	printf("Warning: -A flag is ignored when testing single traces\n");
+    /* vtime.so must be able to warp both shells */
+    if (warp && (!vtime_check(shellprog, "./vtime.so")
+		 || !vtime_check("./tshref", "./vtime.so")))
+	exit(1);
+
+    if (perfmode && !iters_set)
+	num_iters = PERF_ITERS;
+
+    if (compare_n && (!store || perfmode || schedmode || singletrace)) {
+	printf("Error: --compare needs the store, and can't be used with -e, -P or -t\n");
+	usage();
+    }
+    if (store)
+	shell_hash = file_hash(shellprog);
+
+    if (schedmode && perfmode) {
+	printf("Error: -e and -P can't be used together\n");
+	usage();
     }
+    if (!seed_set)
+	schedseed = (unsigned long long)time(NULL) * 1000 + getpid() % 1000;
 
-    /* Generate some unique filenames in /usr/tmp */
-    sprintf(test_raw_outfile, 
-	    "../test_raw_outfile.%d", getpid());
-    sprintf(ref_raw_outfile, 
-	    "../ref_raw_outfile.%d", getpid());
-    sprintf(diff_raw_outfile, 
-	    "../diff_raw_outfile.%d", getpid());
+    if (stress_us) {
+	if (schedmode || perfmode || singletrace) {
+	    printf("Error: --stress can't be used with -e, -P or -t\n");
+	    usage();
+	}
+	stress();
+    }
+
+    if (schedmode) {
+	printf("Exploring %s schedules", schedmode);
+	if (strcmp(schedmode, "exhaustive"))
+	    printf(", seeds %llu..%llu", schedseed, 
+		   schedseed + num_iters - 1);
+	printf("\n");
+    }
 
-    sprintf(test_filtered_outfile, 
-	    "../test_filtered_outfile.%d", getpid());
-    sprintf(ref_filtered_outfile, 
-	    "../ref_filtered_outfile.%d", getpid());
-    sprintf(diff_filtered_outfile, 
-	    "../diff_filtered_outfile.%d", getpid());
+    if (singletrace && autograded) {
+	printf("Warning: -A flag is ignored when testing single traces\n");
+    }
 
     /* Evaluate a single tracefile */
     if (singletrace) {
 	printf("Running %s...\n", tracefiles[tracenum]);
 	fflush(stdout);
-	runtrace(tracefiles[tracenum]);
+	if (schedmode ? explore(tracefiles[tracenum]) 
+	    : runtrace(tracefiles[tracenum])) {
+	    if (perfmode)
+		perftrace(tracefiles[tracenum]);
+	    if (syscallmode)
+		syscalltrace(tracefiles[tracenum]);
+	}
     }
 
     /* Evaluate all trace files */
     else {
-	num_correct = 0;
+	alloc_results(num_tracefiles);
+	if (num_workers > 1)
+	    run_parallel(tracefiles, num_tracefiles, NULL, 0);
+	else
+	    for (i = 0; i < num_tracefiles; i++)
+		runiters(i, tracefiles[i]);
+
+	/* 
+	 * A trace is correct if all of its iterations were; a worker
+	 * that died leaves one unrecorded. -P and -e record one result.
+	 */
+	expected = perfmode || schedmode ? 1 : num_iters;
 	for (i = 0; i < num_tracefiles; i++) {
-	    if (num_iters > 1) 
-		printf("Running %d iters of %s\n", num_iters, tracefiles[i]);
-	    for (j = 0; j < num_iters; j++) {
-		if (num_iters > 1) 
-		    printf("%d. Running %s...\n", j+1, tracefiles[i]);
-		else
-		    printf("Running %s...\n", tracefiles[i]);
+	    trace_stats(i, &st);
+	    correct[i] = st.runs == expected && st.passed == expected;
+	}
 
-		/* Run the trace interpreter on trace i */
-		correct[i] = runtrace(tracefiles[i]);
-		if (!correct[i]) {
-		    break;
-		}
-	    }
-	    
+	if (expected > 1)
+	    print_stats(tracefiles, num_tracefiles);
+	if (compare_n)
+	    compare(tracefiles, num_tracefiles, correct);
+	if (jsonfile)
+	    write_json(jsonfile, tracefiles, num_tracefiles);
+	if (junitfile)
+	    write_junit(junitfile, tracefiles, num_tracefiles);
+
+	num_correct = 0;
+	for (i = 0; i < num_tracefiles; i++)
 	    if (correct[i])
 		num_correct++;
-	}
 
 	printf("\n");
 	printf("Summary: %d/%d correct traces\n", num_correct, num_tracefiles);
     }
 
-    /* Clean up */
-    delete_tmpfiles();
     exit(0);
 }
 
 /*
- * runtrace - Run trace file on test and reference shells
- *            Return 0 if results are different, 1 if identical
-  */
-int runtrace(char *tracefile)
-{ 
-    int status;
-    char buf[MAXBUF];
-    struct stat statbuf;
+ * runiters - Run trace file t num_iters times, recording every
+ *            iteration in results. Return 1 if all were correct.
+ */
+int runiters(int t, char *tracefile)
+{
+    struct result_t *r = &results[t * num_iters];
+    long long start = now_us();
+    int j, ok;
 
-    if (stat(tracefile, &statbuf) < 0) {
-	printf("%s: trace file not found", tracefile);
-	exit(1);
+    /* 
+     * With -P the iterations are spent on timing instead, and with -e
+     * each one gets its own schedule. Either way the trace is recorded
+     * as a single result.
+     */
+    if (perfmode || schedmode) {
+	if (perfmode) {
+	    printf("Running %s...\n", tracefile);
+	    ok = runtrace(tracefile) && perftrace(tracefile);
+	}
+	else
+	    ok = explore(tracefile);
+	if (ok && syscallmode)
+	    syscalltrace(tracefile);
+	r[0].ms = (now_us() - start) / 1000.0;
+	r[0].state = ok ? RESULT_PASS : RESULT_FAIL;
+	return ok;
     }
 
-    /* Run the student's test shell */
-    if (sandboxing)
-	sprintf(buf, "./runtrace -x -s %s -f %s > %s\n", 
-		shellprog, tracefile, test_raw_outfile);
+    ok = 1;
+    for (j = 0; j < num_iters; j++)
+	if (!runiter(t, tracefile, j))
+	    ok = 0;
+    if (ok && syscallmode)
+	syscalltrace(tracefile);
+    return ok;
+}
+
+/*
+ * runiter - Run iteration j of trace file t and record the outcome.
+ *     Once a failure of the trace is recorded, later ones skip the
+ *     diff, unless -V.
+ */
+int runiter(int t, char *tracefile, int j)
+{
+    struct result_t *r = &results[t * num_iters];
+    int k, ok;
+
+    if (num_iters > 1) {
+	if (j == 0)
+	    printf("Running %d iters of %s\n", num_iters, tracefile);
+	printf("%d. Running %s...\n", j+1, tracefile);
+    }
     else
-	sprintf(buf, "./runtrace -s %s -f %s > %s\n", 
-		shellprog, tracefile, test_raw_outfile);
+	printf("Running %s...\n", tracefile);
+
+    brief = 0;
+    for (k = 0; k < num_iters && !verbose; k++)
+	if (r[k].state == RESULT_FAIL)
+	    brief = 1;
+
+    recording = store != NULL;
+    last_steps[0] = '\0';
+    ok = runtrace(tracefile);
+    recording = 0;
+    r[j].ms = last_ms;
+    r[j].state = ok ? RESULT_PASS : RESULT_FAIL;
+    if (store)
+	store_run(tracefile, ok);
+    return ok;
+}
+
+/*
+ * explore - Run a trace under the fork schedules -e asks for (see 
+ *     fork.c), stopping at the first failure. The first run lets the
+ *     parent go first at every fork and counts the forks. Then random
+ *     and pct try num_iters seeds from -S on, while exhaustive tries
+ *     every order of the first SCHED_MAXFORKS forks. Return 1 if 
+ *     every schedule was correct.
+ */
+int explore(char *tracefile)
+{
+    char order[SCHED_MAXFORKS + 16];
+    int j, k, mask, nforks;
 
-    if (system(buf) != 0) {
-	printf("sdriver unable to run %s\n", buf);
+    if ((nforks = sched_run(tracefile, "order:", 0, 0, 0)) < 0)
+	return 0;
+
+    if (!strcmp(schedmode, "exhaustive")) {
+	k = nforks < SCHED_MAXFORKS ? nforks : SCHED_MAXFORKS;
+	if (k < nforks)
+	    printf("%s forks %d times; exploring the first %d forks only\n",
+		   tracefile, nforks, k);
+	for (mask = 1; mask < (1 << k); mask++) {
+	    strcpy(order, "order:");
+	    for (j = 0; j < k; j++)
+		order[6 + j] = (mask >> j) & 1 ? 'c' : 'p';
+	    order[6 + k] = '\0';
+	    if (sched_run(tracefile, order, 0, nforks, mask) < 0)
+		return 0;
+	}
+	return 1;
     }
-    
-    /* Run the reference shell */
-    sprintf(buf, "./runtrace -s ./tshref -f %s > %s\n", 
-	    tracefile, ref_raw_outfile);
-    if (system(buf) != 0) {
-	emit_file(ref_raw_outfile);
-	printf("sdriver unable to run %s\n", buf);
-	delete_tmpfiles();
+
+    for (j = 0; j < num_iters; j++)
+	if (sched_run(tracefile, schedmode, schedseed + j, nforks, j + 1) < 0)
+	    return 0;
+    return 1;
+}
+
+/*
+ * sched_run - Run a trace once with the test shell under schedule
+ *     sched (and seed, for random and pct), telling pct how many 
+ *     forks to spread its change points over. Return the number of
+ *     forks the shell made, or -1 if the output was wrong, in which
+ *     case print the environment that replays the schedule.
+ */
+int sched_run(char *tracefile, char *sched, unsigned long long seed, 
+	      int nforks, int iter)
+{
+    char logfile[64], replay[MAXBUF], buf[32];
+    char *text;
+    long len, i;
+    int fd, ok, forks = 0;
+
+    strcpy(logfile, "/tmp/sdriver.sched.XXXXXX");
+    if ((fd = mkstemp(logfile)) < 0) {
+	perror("mkstemp");
 	exit(1);
     }
-    
-    /* Filter the test and reference outputs */
-    sprintf(buf, "perl -e '%s' < %s | sort > %s", 
-	    PERLPROG, test_raw_outfile, test_filtered_outfile);
-    system(buf);
-    
-    sprintf(buf, "perl -e '%s' < %s | sort > %s", 
-	    PERLPROG, ref_raw_outfile, ref_filtered_outfile);
-    system(buf);
-    
-    /* Diff the filtered output files */
-    sprintf(buf, "diff %s %s > %s\n", 
-	    test_filtered_outfile, ref_filtered_outfile, diff_filtered_outfile);
-    status = system(buf);
-    
-    /* Filtered output files were different */
-    if (status != 0) {
-	sprintf(buf, "diff %s %s > %s\n", 
-		test_raw_outfile, ref_raw_outfile, diff_raw_outfile);
-	system(buf);
+    close(fd);
 
-	printf("Oops: test and reference outputs for %s differed.\n", 
+    /* start_run passes these on to the test shell only */
+    setenv("TSH_SCHED", sched, 1);
+    setenv("TSH_SCHED_LOG", logfile, 1);
+    sprintf(replay, "TSH_SCHED=%s", sched);
+    if (strncmp(sched, "order:", 6)) {
+	sprintf(buf, "%llu", seed);
+	setenv("TSH_SCHED_SEED", buf, 1);
+	sprintf(replay + strlen(replay), " TSH_SCHED_SEED=%s", buf);
+	if (nforks > 0) {
+	    sprintf(buf, "%d", nforks);
+	    setenv("TSH_SCHED_FORKS", buf, 1);
+	    sprintf(replay + strlen(replay), " TSH_SCHED_FORKS=%s", buf);
+	}
+    }
+
+    printf("%d. Running %s (%s)...\n", iter, tracefile, replay);
+    ok = runtrace(tracefile);
+
+    unsetenv("TSH_SCHED");
+    unsetenv("TSH_SCHED_SEED");
+    unsetenv("TSH_SCHED_FORKS");
+    unsetenv("TSH_SCHED_LOG");
+    if ((text = read_file(logfile, &len)) != NULL) {
+	for (i = 0; i < len; i++)
+	    if (text[i] == '\n')
+		forks++;
+	free(text);
+    }
+    unlink(logfile);
+
+    if (!ok) {
+	printf("Failing schedule for %s; replay it with\n", tracefile);
+	printf("    %s ./runtrace -s %s -f %s\n\n", replay, shellprog, 
 	       tracefile);
-	printf("\n");
+	return -1;
+    }
+    return forks;
+}
 
-	printf("Test output:\n");
-	emit_file(test_raw_outfile);
-	printf("\n");
+/*
+ * stress - Run traces from tracegen in num_workers processes until
+ *     stress_us has passed (--stress), and report how many failed.
+ *     Worker w runs seeds schedseed + w, + w + num_workers, and so on,
+ *     so a seed names its trace no matter how many workers there were.
+ *     Each failing trace is saved, with sdriver's report, along with
+ *     a minimized version of it (see stress_minimize).
+ */
+void stress(void)
+{
+    struct stress_t *st;
+    FILE *log;
+    pid_t pid;
+    long long start, next;
+    int w, status;
 
-	printf("Reference output:\n");
-	emit_file(ref_raw_outfile);
-	printf("\n");
+    if (outdir)
+	stressdir = outdir;
+    outdir = NULL;       /* runtrace's -o naming doesn't fit temp traces */
+    refcache = NULL;     /* every trace is new, so nothing to reuse */
+    if (mkdir(stressdir, 0755) < 0 && errno != EEXIST) {
+	perror(stressdir);
+	exit(1);
+    }
+    st = mmap(NULL, sizeof(struct stress_t), PROT_READ | PROT_WRITE,
+	      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (st == MAP_FAILED) {
+	perror("mmap");
+	exit(1);
+    }
+    memset(st, 0, sizeof(*st));
 
-	printf("Output of 'diff test reference':\n");
-	emit_file(diff_raw_outfile);
-	printf("\n");
+    start = now_us();
+    stress_end = start + stress_us;
+    printf("Stress testing %s for %.0fs with %d workers, seeds from %llu\n", 
+	   shellprog, stress_us / 1e6, num_workers, schedseed);
+    printf("Failing traces go in %s/\n", stressdir);
+    fflush(stdout);
 
-	return 0;
+    for (w = 0; w < num_workers; w++) {
+	if ((pid = fork()) < 0) {
+	    perror("fork");
+	    exit(1);
+	}
+	if (pid == 0) {
+	    if ((log = fdopen(dup(1), "w")) == NULL) {
+		perror("fdopen");
+		exit(1);
+	    }
+	    stressing = 1;
+	    stress_worker(w, st, log);
+	    exit(0);
+	}
     }
-    
-    /* Filtered output files were identical */
-    if (verbose) {
-	printf("Success: The test and reference outputs for %s matched!\n", tracefile);
+
+    /* Report progress until the workers are all done */
+    next = start + STRESS_REPORT * 1000000LL;
+    for (;;) {
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+	    ;
+	if (pid < 0 && errno == ECHILD)
+	    break;
+	usleep(100000);
+	if (now_us() >= next) {
+	    printf("%4.0fs: %lu traces, %lu failed, %lu rejected by tshref\n",
+		   (now_us() - start) / 1e6, st->runs, st->failures, 
+		   st->rejected);
+	    fflush(stdout);
+	    next += STRESS_REPORT * 1000000LL;
+	}
     }
-    if (verbose > 1) {
-	printf("Test output:\n");
-	emit_file(test_raw_outfile);
-	printf("\n");
-	printf("Reference output:\n");
-	fflush(stdout);
-	emit_file(ref_raw_outfile);
-	printf("\n");
+
+    printf("\nStress summary: %lu traces in %.0fs, %lu failed, "
+	   "%lu rejected by tshref\n", st->runs, (now_us() - start) / 1e6, 
+	   st->failures, st->rejected);
+    exit(st->failures ? 1 : 0);
+}
+
+/*
+ * stress_worker - Body of --stress worker w: run generated traces
+ *     until stress_end, counting them in st. Failures are announced on
+ *     log, since stdout holds the report of the trace being run.
+ */
+void stress_worker(int w, struct stress_t *st, FILE *log)
+{
+    char trace[MAXBUF], report[MAXBUF], saved[MAXBUF], drops[MAXBUF];
+    unsigned long long seed;
+    int k, ok, nsteps;
+
+    snprintf(trace, MAXBUF, "%s/.w%d.txt", stressdir, w);
+    snprintf(report, MAXBUF, "%s/.w%d.out", stressdir, w);
+
+    for (k = 0; now_us() < stress_end; k++) {
+	seed = schedseed + w + (unsigned long long)k * num_workers;
+	ok = stress_run(seed, STRESS_STEPS, "", trace, report);
+	__atomic_fetch_add(&st->runs, 1, __ATOMIC_RELAXED);
+	if (ok < 0) {
+	    __atomic_fetch_add(&st->rejected, 1, __ATOMIC_RELAXED);
+	    if (verbose)
+		fprintf(log, "seed %llu: tshref couldn't run it\n", seed);
+	    fflush(log);
+	    continue;
+	}
+	if (ok)
+	    continue;
+
+	/* Keep the trace and the report, then shrink the trace */
+	__atomic_fetch_add(&st->failures, 1, __ATOMIC_RELAXED);
+	snprintf(saved, MAXBUF, "%s/seed-%llu.txt", stressdir, seed);
+	rename(trace, saved);
+	snprintf(saved, MAXBUF, "%s/seed-%llu.out", stressdir, seed);
+	rename(report, saved);
+	fprintf(log, "seed %llu: %s failed, see %s; minimizing...\n", 
+		seed, shellprog, saved);
+	fflush(log);
+
+	nsteps = stress_minimize(seed, trace, report, drops);
+	snprintf(saved, MAXBUF, "%s/seed-%llu.min.txt", stressdir, seed);
+	gen_trace(saved, seed, nsteps, drops);
+	fprintf(log, "seed %llu: minimized to %s (tracegen -s %llu -n %d%s%s)\n",
+		seed, saved, seed, nsteps, drops[0] ? " -k " : "", drops);
+	fflush(log);
     }
+    unlink(trace);
+    unlink(report);
+}
 
-    return 1;
+/*
+ * stress_run - Generate the trace for seed into the file trace and
+ *     run it, with sdriver's report going to the file report. Return
+ *     1 if tsh got it right, 0 if not, and -1 if tshref failed.
+ */
+int stress_run(unsigned long long seed, int nsteps, char *drops, 
+	       char *trace, char *report)
+{
+    int fd, out, ok;
+
+    gen_trace(trace, seed, nsteps, drops);
+    if ((fd = open(report, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+	perror(report);
+	exit(1);
+    }
+    fflush(stdout);
+    out = dup(1);
+    dup2(fd, 1);
+    close(fd);
+    ok = runtrace(trace);
+    fflush(stdout);
+    dup2(out, 1);
+    close(out);
+    return ok;
 }
 
 /*
- * emit_file - prints an ascii file to stdout
+ * stress_minimize - Shrink seed's failing trace, whose STRESS_STEPS
+ *     steps tracegen can leave out one by one: find the shortest
+ *     failing prefix by bisection, then drop every step whose removal
+ *     keeps it failing. A race that doesn't fail every time may leave
+ *     steps in that aren't needed. Stops after STRESS_MINRUNS runs.
+ *     Returns the prefix length, with the dropped steps in drops as
+ *     tracegen's -k wants them.
  */
-void emit_file(char *filename) 
+int stress_minimize(unsigned long long seed, char *trace, char *report,
+		    char *drops)
 {
-    FILE *fp;
-    char buf[MAXBUF];
+    char try[MAXBUF];
+    int lo = 1, hi = STRESS_STEPS, mid, k, runs = 0;
 
-    if ((fp = fopen(filename, "r")) == NULL) {
-	printf("fopen error: Unable to open file %s\n", filename);
+    /* hi always fails; the prefixes shorter than lo pass */
+    drops[0] = '\0';
+    while (lo < hi && runs++ < STRESS_MINRUNS) {
+	mid = (lo + hi) / 2;
+	if (stress_run(seed, mid, "", trace, report) == 0)
+	    hi = mid;
+	else
+	    lo = mid + 1;
+    }
+
+    for (k = hi - 2; k >= 0 && runs++ < STRESS_MINRUNS; k--) {
+	snprintf(try, MAXBUF, "%d%s%s", k, drops[0] ? "," : "", drops);
+	if (stress_run(seed, hi, try, trace, report) == 0)
+	    strcpy(drops, try);
+    }
+    return hi;
+}
+
+/*
+ * gen_trace - Run ./tracegen to write the trace for seed to the file
+ *     trace, with nsteps steps minus the ones listed in drops
+ */
+void gen_trace(char *trace, unsigned long long seed, int nsteps, char *drops)
+{
+    char seedarg[32], nstepsarg[32];
+    char *argv[8];
+    int fd, argc = 0, status;
+    pid_t pid;
+
+    sprintf(seedarg, "%llu", seed);
+    sprintf(nstepsarg, "%d", nsteps);
+    argv[argc++] = "./tracegen";
+    argv[argc++] = "-s";
+    argv[argc++] = seedarg;
+    argv[argc++] = "-n";
+    argv[argc++] = nstepsarg;
+    if (drops[0]) {
+	argv[argc++] = "-k";
+	argv[argc++] = drops;
+    }
+    argv[argc] = NULL;
+
+    if ((fd = open(trace, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+	perror(trace);
+	exit(1);
+    }
+    fflush(stdout);
+    if ((pid = fork()) < 0) {
+	perror("fork");
 	exit(1);
     }
-    while(fgets(buf, MAXBUF, fp)) {
-	printf("%s", buf);
+    if (pid == 0) {
+	dup2(fd, 1);
+	execv(argv[0], argv);
+	perror("execv ./tracegen");
+	exit(1);
     }
-    fclose(fp);
+    close(fd);
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) 
+	|| WEXITSTATUS(status) != 0) {
+	printf("sdriver unable to run ./tracegen -s %s\n", seedarg);
+	exit(1);
+    }
+}
+
+/*
+ * run_parallel - Run the trace files in up to num_workers worker
+ *     processes at once, in the order given by order (or as listed,
+ *     if it is NULL). Plain iterations are spread over the workers
+ *     one at a time; with -P, -e or -X a worker runs a whole trace.
+ *     Each worker writes its report to its own tmpfile, and its
+ *     outcome to the shared results. The reports are copied to stdout
+ *     in order as soon as they and all the reports before them are
+ *     done. If stream is set, only failures' reports are copied, as
+ *     soon as they are done, and each trace gets a line once its 
+ *     iterations are all done.
+ */
+void run_parallel(char **tracefiles, int num_tracefiles, int *order, 
+		  int stream)
+{
+    FILE **out;
+    pid_t *pids;
+    char *done;
+    int *left;
+    int per = perfmode || schedmode || syscallmode ? 1 : num_iters;
+    int nunits = num_tracefiles * per;
+    int next = 0, running = 0, printed = 0;
+    int i, c, t, status;
+    struct tstats_t st;
+    pid_t pid;
+
+    out = malloc(nunits * sizeof(FILE *));
+    pids = malloc(nunits * sizeof(pid_t));
+    done = malloc(nunits);
+    left = malloc(num_tracefiles * sizeof(int));
+    if (!out || !pids || !done || !left) {
+	perror("malloc");
+	exit(1);
+    }
+    for (t = 0; t < num_tracefiles; t++)
+	left[t] = per;
+
+    while (printed < nunits) {
+
+	/* Keep num_workers units running */
+	while (running < num_workers && next < nunits) {
+	    if ((out[next] = tmpfile()) == NULL) {
+		perror("tmpfile");
+		exit(1);
+	    }
+	    fflush(stdout);
+	    if ((pids[next] = fork()) < 0) {
+		perror("fork");
+		exit(1);
+	    }
+	    if (pids[next] == 0) {
+		dup2(fileno(out[next]), 1);
+		t = order ? order[next / per] : next / per;
+		if (per == 1)
+		    status = runiters(t, tracefiles[t]);
+		else
+		    status = runiter(t, tracefiles[t], next % per);
+		exit(status ? 0 : 1);
+	    }
+	    done[next] = 0;
+	    running++;
+	    next++;
+	}
+
+	/* Collect a finished worker */
+	if ((pid = wait(&status)) < 0) {
+	    perror("wait");
+	    exit(1);
+	}
+	for (i = 0; i < next; i++) {
+	    if (pids[i] != pid || done[i])
+		continue;
+	    done[i] = 1;
+	    running--;
+	    if (!stream)
+		continue;
+
+	    /* Streaming: the report if it failed, the trace if it's done */
+	    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		rewind(out[i]);
+		while ((c = getc(out[i])) != EOF)
+		    putchar(c);
+	    }
+	    t = order ? order[i / per] : i / per;
+	    if (--left[t] == 0) {
+		trace_stats(t, &st);
+		printf("%s %-14s %3d/%-3d %8.1f ms\n", 
+		       st.runs && st.passed == st.runs ? "ok  " : "FAIL",
+		       tracefiles[t], st.passed, st.runs, st.median);
+	    }
+	}
+
+	/* Print every report whose predecessors are all printed */
+	while (printed < next && done[printed]) {
+	    rewind(out[printed]);
+	    while (!stream && (c = getc(out[printed])) != EOF)
+		putchar(c);
+	    fclose(out[printed]);
+	    printed++;
+	}
+	fflush(stdout);
+    }
+    free(out);
+    free(pids);
+    free(done);
+    free(left);
+}
+
+/*
+ * alloc_results - Make the results array, shared with the workers
+ */
+void alloc_results(int num_tracefiles)
+{
+    results = mmap(NULL, num_tracefiles * num_iters * sizeof(struct result_t),
+		   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+	perror("mmap");
+	exit(1);
+    }
+    memset(results, 0, num_tracefiles * num_iters * sizeof(struct result_t));
 }
 
 /*
- * delete_tmpfiles - Clean up the temp files we created during testing
+ * trace_stats - Sum up the recorded results of trace file t
  */
-void delete_tmpfiles()
+void trace_stats(int t, struct tstats_t *st)
 {
-    char buf[MAXBUF];
-    sprintf(buf, "rm -rf %s %s %s %s %s %s",
-	    test_raw_outfile, ref_raw_outfile, diff_raw_outfile,
-	    test_filtered_outfile, ref_filtered_outfile, diff_filtered_outfile);
-    system(buf);
+    struct result_t *r = &results[t * num_iters];
+    double ms[num_iters], var;
+    int j, n = 0;
+
+    memset(st, 0, sizeof(*st));
+    for (j = 0; j < num_iters; j++) {
+	if (r[j].state == RESULT_NONE)
+	    continue;
+	if (r[j].state == RESULT_PASS)
+	    st->passed++;
+	ms[n++] = r[j].ms;
+	st->mean += r[j].ms;
+    }
+    if ((st->runs = n) == 0)
+	return;
+
+    qsort(ms, n, sizeof(double), cmpdouble);
+    st->min = ms[0];
+    st->max = ms[n - 1];
+    st->median = n % 2 ? ms[n / 2] : (ms[n / 2 - 1] + ms[n / 2]) / 2;
+    st->p90 = ms[(int)ceil(0.9 * n) - 1];
+    st->mean /= n;
+    for (var = 0, j = 0; j < n; j++)
+	var += (ms[j] - st->mean) * (ms[j] - st->mean);
+    st->sd = n > 1 ? sqrt(var / (n - 1)) : 0;
+}
+
+/*
+ * print_stats - Print each trace's pass rate and the distribution of
+ *     its wall times. A trace is flaky if it both passed and failed.
+ */
+void print_stats(char **tracefiles, int num_tracefiles)
+{
+    struct tstats_t st;
+    int t, flaky = 0;
+
+    printf("\nPer-trace results (wall time of the test shell, ms):\n");
+    printf("%-14s %9s %6s %6s %8s %8s %8s %8s\n", "trace", "passed", "rate",
+	   "", "min", "median", "p90", "max");
+    for (t = 0; t < num_tracefiles; t++) {
+	trace_stats(t, &st);
+	if (st.runs == 0) {
+	    printf("%-14s %9s\n", tracefiles[t], "not run");
+	    continue;
+	}
+	if (st.passed > 0 && st.passed < st.runs)
+	    flaky++;
+	printf("%-14s %5d/%-3d %5.0f%% %6s %8.1f %8.1f %8.1f %8.1f\n", 
+	       tracefiles[t], st.passed, st.runs, 100.0 * st.passed / st.runs,
+	       st.passed > 0 && st.passed < st.runs ? "flaky" : "",
+	       st.min, st.median, st.p90, st.max);
+    }
+    printf("%d flaky trace%s\n", flaky, flaky == 1 ? "" : "s");
+}
+
+/*
+ * write_json - Write every trace's statistics, and the iterations
+ *     that failed, to filename as JSON
+ */
+void write_json(char *filename, char **tracefiles, int num_tracefiles)
+{
+    struct tstats_t st;
+    FILE *fp;
+    int t, j, first;
+
+    if ((fp = fopen(filename, "w")) == NULL) {
+	perror(filename);
+	return;
+    }
+    fprintf(fp, "{\n  \"shell\": \"");
+    fput_escaped(fp, shellprog, 0);
+    fprintf(fp, "\",\n  \"iterations\": %d,\n  \"traces\": [\n", num_iters);
+    for (t = 0; t < num_tracefiles; t++) {
+	trace_stats(t, &st);
+	fprintf(fp, "    {\"name\": \"");
+	fput_escaped(fp, tracefiles[t], 0);
+	fprintf(fp, "\", \"runs\": %d, \"passed\": %d, \"pass_rate\": %.4f, "
+		"\"flaky\": %s,\n", st.runs, st.passed, 
+		st.runs ? (double)st.passed / st.runs : 0.0,
+		st.passed > 0 && st.passed < st.runs ? "true" : "false");
+	fprintf(fp, "     \"wall_ms\": {\"min\": %.3f, \"median\": %.3f, "
+		"\"p90\": %.3f, \"max\": %.3f, \"mean\": %.3f, \"sd\": %.3f},\n",
+		st.min, st.median, st.p90, st.max, st.mean, st.sd);
+	fprintf(fp, "     \"failed_iterations\": [");
+	for (first = 1, j = 0; j < num_iters; j++) {
+	    if (results[t * num_iters + j].state != RESULT_FAIL)
+		continue;
+	    fprintf(fp, "%s%d", first ? "" : ", ", j + 1);
+	    first = 0;
+	}
+	fprintf(fp, "]}%s\n", t < num_tracefiles - 1 ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+}
+
+/*
+ * write_junit - Write the results to filename as a JUnit test suite
+ *     with one test case per trace, failed unless every iteration passed
+ */
+void write_junit(char *filename, char **tracefiles, int num_tracefiles)
+{
+    struct tstats_t st;
+    FILE *fp;
+    double total = 0;
+    int t, failures = 0;
+
+    if ((fp = fopen(filename, "w")) == NULL) {
+	perror(filename);
+	return;
+    }
+    for (t = 0; t < num_tracefiles; t++) {
+	trace_stats(t, &st);
+	total += st.mean * st.runs;
+	if (st.runs == 0 || st.passed < st.runs)
+	    failures++;
+    }
+
+    fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    fprintf(fp, "<testsuite name=\"sdriver\" tests=\"%d\" failures=\"%d\" "
+	    "time=\"%.3f\">\n", num_tracefiles, failures, total / 1000);
+    for (t = 0; t < num_tracefiles; t++) {
+	trace_stats(t, &st);
+	fprintf(fp, "  <testcase classname=\"tshlab\" name=\"");
+	fput_escaped(fp, tracefiles[t], 1);
+	fprintf(fp, "\" time=\"%.3f\">\n", st.mean * st.runs / 1000);
+	if (st.runs == 0)
+	    fprintf(fp, "    <failure message=\"not run\"/>\n");
+	else if (st.passed < st.runs)
+	    fprintf(fp, "    <failure message=\"%d of %d iterations failed%s\"/>\n",
+		    st.runs - st.passed, st.runs, st.passed ? " (flaky)" : "");
+	fprintf(fp, "    <system-out>passed %d/%d, wall ms min %.1f median %.1f "
+		"p90 %.1f max %.1f</system-out>\n", st.passed, st.runs, 
+		st.min, st.median, st.p90, st.max);
+	fprintf(fp, "  </testcase>\n");
+    }
+    fprintf(fp, "</testsuite>\n");
+    fclose(fp);
+}
+
+/*
+ * fput_escaped - Write str to fp as the contents of a JSON string,
+ *     or (if xml is set) of an XML attribute
+ */
+void fput_escaped(FILE *fp, char *str, int xml)
+{
+    for (; *str; str++) {
+	if (xml && *str == '<')
+	    fputs("&lt;", fp);
+	else if (xml && *str == '>')
+	    fputs("&gt;", fp);
+	else if (xml && *str == '&')
+	    fputs("&amp;", fp);
+	else if (*str == '"')
+	    fputs(xml ? "&quot;" : "\\\"", fp);
+	else if (!xml && *str == '\\')
+	    fputs("\\\\", fp);
+	else if ((unsigned char)*str < ' ')
+	    fprintf(fp, xml ? "&#%d;" : "\\u%04x", *str);
+	else
+	    putc(*str, fp);
+    }
+}
+
+/*
+ * store_run - Append the iteration runtrace just ran to the store
+ *     (see COMPARE_BASELINES). One write, so that workers appending at
+ *     the same time don't interleave.
+ */
+void store_run(char *tracefile, int ok)
+{
+    char rec[sizeof(last_steps) + MAXBUF];
+    int fd, len;
+
+    len = snprintf(rec, MAXBUF, "%016llx %ld %s %s %d %.0f", shell_hash, 
+		   (long)time(NULL), store_setup(), tracefile, ok, 
+		   last_ms * 1000);
+    len += sprintf(rec + len, "%s\n", last_steps);
+    if ((fd = open(store, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0) {
+	perror(store);
+	return;
+    }
+    if (write(fd, rec, len) < len)
+	perror(store);
+    close(fd);
+}
+
+/*
+ * read_steps - Collect the "step <line> <us>" records of a runtrace
+ *     -p file into last_steps
+ */
+void read_steps(char *perffile)
+{
+    char *text, *p;
+    int line, len = 0;
+    long long us;
+
+    last_steps[0] = '\0';
+    if ((text = read_file(perffile, NULL)) == NULL)
+	return;
+    for (p = strtok(text, "\n"); p; p = strtok(NULL, "\n"))
+	if (sscanf(p, "step %d %lld", &line, &us) == 2 
+	    && len < (int)sizeof(last_steps) - 48)
+	    len += sprintf(last_steps + len, " %d:%lld", line, us);
+    free(text);
+}
+
+/*
+ * compare - For every trace, compare the passing runs of this build
+ *     of the shell in the store with those of the compare_n builds
+ *     that were tested before it with the same setup. A trace that is
+ *     significantly slower is marked incorrect; with -V the steps are
+ *     compared too, but they don't fail the trace. Return the number 
+ *     of slower traces.
+ */
+int compare(char **tracefiles, int num_tracefiles, int *correct)
+{
+    unsigned long long *builds = NULL, h;
+    struct sample_t total[2], (*steps)[2];
+    char setup[64], *mysetup, trace[MAXBUF], name[32], *text, *p, *q;
+    int nbuilds = 0, t, i, k, pass, line, slower = 0, n;
+    double us;
+
+    if ((text = read_file(store, NULL)) == NULL) {
+	printf("\nNo results in %s to compare with\n", store);
+	return 0;
+    }
+    mysetup = store_setup();
+
+    /* The builds tested before this one, most recent last */
+    for (p = text; *p; p = q) {
+	if ((q = strchr(p, '\n')) == NULL)
+	    q = p + strlen(p);
+	else
+	    q++;
+	if (sscanf(p, "%llx %*d %63s", &h, setup) != 2 
+	    || h == shell_hash || strcmp(setup, mysetup))
+	    continue;
+	for (i = 0; i < nbuilds && builds[i] != h; i++)
+	    ;
+	if (i < nbuilds)
+	    memmove(&builds[i], &builds[i + 1], 
+		    (nbuilds - i - 1) * sizeof(*builds));
+	else if ((builds = realloc(builds, ++nbuilds * sizeof(*builds))) == NULL) {
+	    perror("realloc");
+	    exit(1);
+	}
+	builds[nbuilds - 1] = h;
+    }
+    if (nbuilds == 0) {
+	printf("\nNo earlier builds with setup %s in %s to compare with\n",
+	       mysetup, store);
+	free(text);
+	return 0;
+    }
+    if (nbuilds > compare_n) {
+	memmove(builds, builds + nbuilds - compare_n, 
+		compare_n * sizeof(*builds));
+	nbuilds = compare_n;
+    }
+
+    if ((steps = malloc(STORE_MAXLINE * sizeof(*steps))) == NULL) {
+	perror("malloc");
+	exit(1);
+    }
+    printf("\nComparing %s (%016llx) with %d earlier build%s (wall ms):\n",
+	   shellprog, shell_hash, nbuilds, nbuilds == 1 ? "" : "s");
+    printf("%-12s %10s %10s %10s  %s\n", 
+	   "", "this", "earlier", "delta", "95% CI of delta");
+    for (t = 0; t < num_tracefiles; t++) {
+	memset(total, 0, sizeof(total));
+	memset(steps, 0, STORE_MAXLINE * sizeof(*steps));
+	for (p = text; *p; p = q) {
+	    if ((q = strchr(p, '\n')) == NULL)
+		q = p + strlen(p);
+	    else
+		q++;
+	    if (sscanf(p, "%llx %*d %63s %1023s %d %lf%n", 
+		       &h, setup, trace, &pass, &us, &n) != 5
+		|| !pass || strcmp(setup, mysetup) 
+		|| strcmp(trace, tracefiles[t]))
+		continue;
+	    if (h == shell_hash)
+		k = 0;
+	    else {
+		for (i = 0; i < nbuilds && builds[i] != h; i++)
+		    ;
+		if (i == nbuilds)
+		    continue;
+		k = 1;
+	    }
+	    add_sample(&total[k], us / 1000);
+	    for (p += n; sscanf(p, " %d:%lf%n", &line, &us, &n) == 2; p += n)
+		if (line >= 0 && line < STORE_MAXLINE)
+		    add_sample(&steps[line][k], us / 1000);
+	}
+	if (perf_row(tracefiles[t], &total[0], &total[1], PERF_FLOOR)) {
+	    correct[t] = 0;
+	    slower++;
+	}
+	for (line = 0; verbose && line < STORE_MAXLINE; line++) {
+	    if (steps[line][0].n == 0 && steps[line][1].n == 0)
+		continue;
+	    sprintf(name, "  line %d", line);
+	    perf_row(name, &steps[line][0], &steps[line][1], -1);
+	}
+    }
+    printf("%d trace%s slower\n", slower, slower == 1 ? "" : "s");
+    free(steps);
+    free(builds);
+    free(text);
+    return slower;
+}
+
+/*
+ * store_setup - The setup field of store records for this run
+ */
+char *store_setup(void)
+{
+    static char setup[64];
+
+    snprintf(setup, sizeof(setup), "w%s-j%d", warp ? warp : "1", num_workers);
+    return setup;
+}
+
+/*
+ * file_hash - FNV-1a hash of a file's contents
+ */
+unsigned long long file_hash(char *filename)
+{
+    unsigned long long h;
+    char *text;
+    long len;
+
+    if ((text = read_file(filename, &len)) == NULL) {
+	printf("fopen error: Unable to open file %s\n", filename);
+	exit(1);
+    }
+    h = hash_bytes(14695981039346656037ULL, text, len);
+    free(text);
+    return h;
+}
+
+/*
+ * watch - --watch: build the shell and run every trace, then do it
+ *     again whenever one of watch_files changes. Traces that failed
+ *     the last time go first, then the rest from the fastest, going
+ *     by the store until they have run here. Each trace's result is
+ *     printed as soon as it's in. Never returns.
+ */
+void watch(char **tracefiles, int num_tracefiles)
+{
+    int order[MAXTRACES], failed[MAXTRACES];
+    double ms[MAXTRACES];
+    struct tstats_t st;
+    int fd, pass, i, k, t, num_correct;
+    long long start;
+
+    if ((fd = inotify_init1(IN_CLOEXEC)) < 0
+	|| inotify_add_watch(fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+	perror("inotify");
+	exit(1);
+    }
+    alloc_results(num_tracefiles);
+    memset(failed, 0, sizeof(failed));
+    memset(ms, 0, sizeof(ms));
+    if (store)
+	store_history(tracefiles, num_tracefiles, failed, ms);
+
+    for (pass = 1; ; pass++) {
+	if (build_shell()) {
+	    if (store)
+		shell_hash = file_hash(shellprog);
+
+	    /* Failures first, then the fastest; insertion sort */
+	    for (i = 0; i < num_tracefiles; i++) {
+		t = i;
+		for (k = i; k > 0 && (failed[t] > failed[order[k - 1]]
+				      || (failed[t] == failed[order[k - 1]]
+					  && ms[t] < ms[order[k - 1]])); k--)
+		    order[k] = order[k - 1];
+		order[k] = t;
+	    }
+
+	    printf("\nPass %d: %d traces, %d iters each, failures first\n",
+		   pass, num_tracefiles, num_iters);
+	    fflush(stdout);
+	    memset(results, 0, num_tracefiles * num_iters * sizeof(struct result_t));
+	    start = now_us();
+	    run_parallel(tracefiles, num_tracefiles, order, 1);
+
+	    num_correct = 0;
+	    for (t = 0; t < num_tracefiles; t++) {
+		trace_stats(t, &st);
+		failed[t] = st.runs < num_iters || st.passed < st.runs;
+		if (!failed[t])
+		    num_correct++;
+		if (st.runs)
+		    ms[t] = st.mean;
+	    }
+	    printf("Pass %d: %d/%d correct traces in %.1fs\n", pass, 
+		   num_correct, num_tracefiles, (now_us() - start) / 1e6);
+	}
+	printf("Watching");
+	for (i = 0; watch_files[i]; i++)
+	    printf(" %s", watch_files[i]);
+	printf(" for changes (Ctrl-C to stop)\n");
+	fflush(stdout);
+	wait_change(fd);
+    }
+}
+
+/*
+ * store_history - From the store, each trace's mean time in this
+ *     setup (any build) and whether its last run failed
+ */
+void store_history(char **tracefiles, int num_tracefiles, int *failed,
+		   double *ms)
+{
+    char setup[64], trace[MAXBUF], *text, *p;
+    int n[MAXTRACES], t, pass;
+    double us;
+
+    if ((text = read_file(store, NULL)) == NULL)
+	return;
+    memset(n, 0, sizeof(n));
+    for (p = strtok(text, "\n"); p; p = strtok(NULL, "\n")) {
+	if (sscanf(p, "%*x %*d %63s %1023s %d %lf", setup, trace, &pass, &us) != 4
+	    || strcmp(setup, store_setup()))
+	    continue;
+	for (t = 0; t < num_tracefiles && strcmp(trace, tracefiles[t]); t++)
+	    ;
+	if (t == num_tracefiles)
+	    continue;
+	failed[t] = !pass;
+	ms[t] += us / 1000;
+	n[t]++;
+    }
+    for (t = 0; t < num_tracefiles; t++)
+	if (n[t])
+	    ms[t] /= n[t];
+    free(text);
+}
+
+/*
+ * build_shell - Run make for the test shell. Return 1 if it built.
+ */
+int build_shell(void)
+{
+    char *target = shellprog;
+    int status;
+    pid_t pid;
+
+    if (!strncmp(target, "./", 2))
+	target += 2;
+    printf("make %s\n", target);
+    fflush(stdout);
+    if ((pid = fork()) < 0) {
+	perror("fork");
+	exit(1);
+    }
+    if (pid == 0) {
+	execlp("make", "make", "-s", target, NULL);
+	perror("execlp make");
+	exit(1);
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) 
+	|| WEXITSTATUS(status) != 0) {
+	printf("Build failed\n");
+	return 0;
+    }
+    if (access(shellprog, X_OK) < 0) {
+	printf("%s: File is not executable\n", shellprog);
+	return 0;
+    }
+    return 1;
+}
+
+/*
+ * wait_change - Block until the inotify descriptor fd reports a write
+ *     to one of watch_files, then until WATCH_QUIET ms pass without
+ *     events, so that a save that takes several writes builds once
+ */
+void wait_change(int fd)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    struct pollfd pfd;
+    int changed = 0, i, n;
+    char *p;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (!changed || poll(&pfd, 1, WATCH_QUIET) > 0) {
+	if ((n = read(fd, buf, sizeof(buf))) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    perror("read inotify");
+	    exit(1);
+	}
+	for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+	    ev = (struct inotify_event *)p;
+	    for (i = 0; ev->len && watch_files[i]; i++) {
+		if (!strcmp(ev->name, watch_files[i])) {
+		    if (!changed)
+			printf("\n%s changed\n", ev->name);
+		    changed = 1;
+		}
+	    }
+	}
+    }
+}
+
+/*
+ * runtrace - Run trace file on test and reference shells
+ *            Return 0 if results are different, 1 if identical
+ *            (and, in a --stress worker, -1 if tshref failed)
+  */
+int runtrace(char *tracefile)
+{ 
+    struct run_t runs[2];   /* test shell, reference shell */
+    char *test_out, *ref_out;
+    char **variants = NULL;
+    int i, num_variants = 0;
+    unsigned long long key = 0;
+    struct stat statbuf;
+
+    if (stat(tracefile, &statbuf) < 0) {
+	printf("%s: trace file not found", tracefile);
+	exit(1);
+    }
+
+    if (refcache) {
+	key = ref_key(tracefile);
+	if (!refresh)
+	    num_variants = load_variants(key, &variants);
+    }
+
+    /* 
+     * Run the student's test shell and then the reference shell,
+     * or with -j both at the same time. If the reference output is
+     * cached, run tshref only when none of its known variants match.
+     */
+    start_run(&runs[0], shellprog, tracefile, sandboxing, recording);
+    if (num_workers == 1 || num_variants > 0)
+	finish_runs(&runs[0], 1);
+
+    ref_out = NULL;
+    for (i = 0; i < num_variants; i++) {
+	if (!ref_out && same_output(runs[0].out, variants[i]))
+	    ref_out = variants[i];
+	else
+	    free(variants[i]);
+    }
+    free(variants);
+    if (ref_out && verbose > 1)
+	printf("Using cached reference output for %s\n", tracefile);
+
+    if (!ref_out) {
+	start_run(&runs[1], "./tshref", tracefile, 0, 0);
+	if (num_workers == 1 || num_variants > 0)
+	    finish_runs(&runs[1], 1);
+	else
+	    finish_runs(runs, 2);
+	if (!WIFEXITED(runs[1].status) || WEXITSTATUS(runs[1].status) != 0) {
+	    printf("%s", runs[1].out);
+	    printf("sdriver unable to run %s\n", runs[1].cmd);
+	    if (stressing) {    /* a bad trace, not tsh's fault */
+		free(runs[0].out);
+		free(runs[1].out);
+		return -1;
+	    }
+	    exit(1);
+	}
+	ref_out = runs[1].out;
+
+	/* 
+	 * A generated trace that tshref couldn't finish in time says
+	 * more about the load than about tsh
+	 */
+	if (stressing && strstr(ref_out, "Runtrace timed out")) {
+	    free(runs[0].out);
+	    free(ref_out);
+	    return -1;
+	}
+	if (refcache)
+	    add_variant(key, ref_out);
+    }
+
+    if (!WIFEXITED(runs[0].status) || WEXITSTATUS(runs[0].status) != 0) {
+	printf("sdriver unable to run %s\n", runs[0].cmd);
+    }
+    test_out = runs[0].out;
+    last_ms = (runs[0].end - runs[0].start) / 1000.0;
+    if (runs[0].perf[0]) {
+	read_steps(runs[0].perf);
+	unlink(runs[0].perf);
+    }
+
+    if (outdir) {
+	save_output(tracefile, "test", test_out);
+	save_output(tracefile, "ref", ref_out);
+    }
+
+    /* Filtered outputs were different */
+    if (!same_output(test_out, ref_out)) {
+	printf("Oops: test and reference outputs for %s differed.\n", 
+	       tracefile);
+	printf("\n");
+	if (brief) {
+	    free(test_out);
+	    free(ref_out);
+	    return 0;
+	}
+
+	printf("Test output:\n");
+	printf("%s", test_out);
+	printf("\n");
+
+	printf("Reference output:\n");
+	printf("%s", ref_out);
+	printf("\n");
+
+	printf("Output of 'diff -u test reference':\n");
+	emit_diff(test_out, ref_out);
+	printf("\n");
+
+	free(test_out);
+	free(ref_out);
+	return 0;
+    }
+    
+    /* Filtered output files were identical */
+    if (verbose) {
+	printf("Success: The test and reference outputs for %s matched!\n", tracefile);
+    }
+    if (verbose > 1) {
+	printf("Test output:\n");
+	printf("%s", test_out);
+	printf("\n");
+	printf("Reference output:\n");
+	printf("%s", ref_out);
+	printf("\n");
+    }
+
+    free(test_out);
+    free(ref_out);
+    return 1;
+}
+
+/*
+ * perftrace - Time a trace on the test and reference shells, num_iters
+ *     runs each, alternating which shell goes first. Prints every step's
+ *     latency and the shells' rusage with the 95% confidence interval 
+ *     of the difference. Return 0 if tsh is slower, 1 otherwise.
+ */
+int perftrace(char *tracefile)
+{
+    struct run_t run;
+    struct sample_t (*steps)[2] = NULL;
+    struct sample_t usage[NUSAGE][2];
+    int *lines = NULL;
+    int nsteps = -1;
+    int i, k, shell, slower = 0;
+    char name[32];
+
+    memset(usage, 0, sizeof(usage));
+    for (i = 0; i < num_iters; i++) {
+	for (k = 0; k < 2; k++) {
+	    shell = (i + k) % 2;
+	    start_run(&run, shell ? "./tshref" : shellprog, tracefile,
+		      shell ? 0 : sandboxing, 1);
+	    finish_runs(&run, 1);
+	    if (!WIFEXITED(run.status) || WEXITSTATUS(run.status) != 0
+		|| !read_perf(&run, shell, &steps, &lines, &nsteps, usage)) {
+		printf("sdriver unable to time %s\n", run.cmd);
+		unlink(run.perf);
+		free(run.out);
+		free(steps);
+		free(lines);
+		return 0;
+	    }
+	    unlink(run.perf);
+	    free(run.out);
+	}
+    }
+
+    printf("Performance of %s (%d runs of each shell):\n", 
+	   tracefile, num_iters);
+    printf("%-12s %10s %10s %10s  %s\n", 
+	   "", "test", "reference", "delta", "95% CI of delta");
+    for (i = 0; i < nsteps; i++) {
+	sprintf(name, "line %d ms", lines[i]);
+	perf_row(name, &steps[i][0], &steps[i][1], PERF_FLOOR);
+    }
+    slower |= perf_row("total ms", &usage[USAGE_TOTAL][0], 
+		       &usage[USAGE_TOTAL][1], PERF_FLOOR);
+    slower |= perf_row("cpu ms", &usage[USAGE_CPU][0], &usage[USAGE_CPU][1], 
+		       PERF_FLOOR);
+    perf_row("maxrss KB", &usage[USAGE_RSS][0], &usage[USAGE_RSS][1], -1);
+    perf_row("ctx switches", &usage[USAGE_CSW][0], &usage[USAGE_CSW][1], -1);
+    printf("\n");
+    free(steps);
+    free(lines);
+
+    if (slower) {
+	printf("Oops: %s was slower than the reference shell on %s.\n\n",
+	       shellprog, tracefile);
+	return 0;
+    }
+    return 1;
+}
+
+/*
+ * read_perf - Add the timings runtrace recorded for a run of shell
+ *     (0 test, 1 reference) to the step and usage samples. The first
+ *     run fixes the steps; a run that took a different path through
+ *     the trace only contributes its totals. Return 0 if the record
+ *     is incomplete.
+ */
+int read_perf(struct run_t *run, int shell, struct sample_t (**stepsp)[2],
+	      int **linesp, int *nstepsp, struct sample_t usage[][2])
+{
+    char *text, *p;
+    long len;
+    int n = 0, line, got_usage = 0;
+    long long us, utime, stime, total = 0;
+    long maxrss, minflt, majflt, nvcsw, nivcsw;
+    int *lines = NULL;
+    long long *times = NULL;
+
+    if ((text = read_file(run->perf, &len)) == NULL)
+	return 0;
+    for (p = strtok(text, "\n"); p; p = strtok(NULL, "\n")) {
+	if (sscanf(p, "step %d %lld", &line, &us) == 2) {
+	    lines = realloc(lines, (n + 1) * sizeof(int));
+	    times = realloc(times, (n + 1) * sizeof(long long));
+	    if (lines == NULL || times == NULL) {
+		perror("realloc");
+		exit(1);
+	    }
+	    lines[n] = line;
+	    times[n++] = us;
+	    total += us;
+	}
+	else if (sscanf(p, "rusage %lld %lld %ld %ld %ld %ld %ld", &utime, 
+			&stime, &maxrss, &minflt, &majflt, &nvcsw, 
+			&nivcsw) == 7) {
+	    add_sample(&usage[USAGE_TOTAL][shell], total / 1e3);
+	    add_sample(&usage[USAGE_CPU][shell], (utime + stime) / 1e3);
+	    add_sample(&usage[USAGE_RSS][shell], maxrss);
+	    add_sample(&usage[USAGE_CSW][shell], nvcsw + nivcsw);
+	    got_usage = 1;
+	}
+    }
+    free(text);
+
+    if (got_usage && *nstepsp < 0) {
+	*nstepsp = n;
+	*linesp = lines;
+	lines = NULL;
+	if ((*stepsp = calloc(n ? n : 1, sizeof(**stepsp))) == NULL) {
+	    perror("calloc");
+	    exit(1);
+	}
+    }
+    if (got_usage && n == *nstepsp) {
+	for (line = 0; line < n; line++)
+	    add_sample(&(*stepsp)[line][shell], times[line] / 1e3);
+    }
+    else if (got_usage && verbose)
+	printf("%s took %d steps instead of %d; steps not timed\n", 
+	       run->cmd, n, *nstepsp);
+    free(lines);
+    free(times);
+    return got_usage;
+}
+
+/*
+ * add_sample - Add observation x to s
+ */
+void add_sample(struct sample_t *s, double x)
+{
+    s->n++;
+    s->sum += x;
+    s->sumsq += x * x;
+}
+
+/*
+ * perf_row - Print test and reference means of one quantity with the
+ *     Welch 95% confidence interval of their difference. Return 1 if
+ *     the test shell is slower beyond doubt, PERF_SLACK and floor
+ *     (a negative floor means the quantity is only reported).
+ */
+int perf_row(char *name, struct sample_t *test, struct sample_t *ref, 
+	     double floor)
+{
+    double mt, mr, vt, vr, se2, df, delta, half;
+    int slower;
+
+    if (test->n < 2 || ref->n < 2) {
+	printf("%-12s %10s\n", name, "(too few runs)");
+	return 0;
+    }
+    mt = test->sum / test->n;
+    mr = ref->sum / ref->n;
+    vt = (test->sumsq - test->n * mt * mt) / (test->n - 1);
+    vr = (ref->sumsq - ref->n * mr * mr) / (ref->n - 1);
+    if (vt < 0) 
+	vt = 0;
+    if (vr < 0)
+	vr = 0;
+    se2 = vt / test->n + vr / ref->n;
+    df = se2 * se2 / ((vt / test->n) * (vt / test->n) / (test->n - 1) 
+		      + (vr / ref->n) * (vr / ref->n) / (ref->n - 1) + DBL_MIN);
+    delta = mt - mr;
+    half = tcrit95(df) * sqrt(se2);
+
+    slower = floor >= 0 && delta - half > 0 
+	&& delta > PERF_SLACK * mr && delta > floor;
+    printf("%-12s %10.3f %10.3f %+10.3f  [%+.3f, %+.3f]%s\n", name, mt, mr,
+	   delta, delta - half, delta + half, slower ? "  SLOWER" : "");
+    return slower;
+}
+
+/*
+ * tcrit95 - Two-sided 95% critical value of Student's t with df degrees
+ *     of freedom
+ */
+double tcrit95(double df)
+{
+    static double t[] = { 
+	12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 
+	2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 
+	2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 
+	2.048, 2.045, 2.042 
+    };
+    int d = (int)df;
+
+    if (d < 1)
+	d = 1;
+    return d <= 30 ? t[d - 1] : 1.960;
+}
+
+/*
+ * syscalltrace - Run a trace once on each shell in runtrace's seccomp
+ *     sandbox and print, side by side, how often each shell made each
+ *     system call, busiest first. Calls made by jobs are only totaled.
+ */
+void syscalltrace(char *tracefile)
+{
+    struct run_t runs[2];
+    struct calls_t *calls = NULL, total[2];
+    char *text, *p, name[32];
+    unsigned long n, jobs, denied;
+    long len;
+    int i, k, ncalls = 0;
+
+    memset(total, 0, sizeof(total));
+    start_run(&runs[0], shellprog, tracefile, 1, 1);
+    start_run(&runs[1], "./tshref", tracefile, 1, 1);
+    finish_runs(runs, 2);
+
+    for (k = 0; k < 2; k++) {
+	if (!WIFEXITED(runs[k].status) || WEXITSTATUS(runs[k].status) != 0
+	    || (text = read_file(runs[k].perf, &len)) == NULL) {
+	    printf("sdriver unable to count system calls with %s\n", 
+		   runs[k].cmd);
+	    unlink(runs[0].perf);
+	    unlink(runs[1].perf);
+	    free(runs[0].out);
+	    free(runs[1].out);
+	    free(calls);
+	    return;
+	}
+	for (p = strtok(text, "\n"); p; p = strtok(NULL, "\n")) {
+	    if (sscanf(p, "syscall %31s %lu %lu", name, &n, &jobs) == 3) {
+		total[1].shell[k] += jobs;
+		if (n == 0)
+		    continue;
+		for (i = 0; i < ncalls && strcmp(calls[i].name, name); i++)
+		    ;
+		if (i == ncalls) {
+		    if ((calls = realloc(calls, (ncalls + 1) * 
+					 sizeof(struct calls_t))) == NULL) {
+			perror("realloc");
+			exit(1);
+		    }
+		    memset(&calls[i], 0, sizeof(struct calls_t));
+		    strcpy(calls[i].name, name);
+		    ncalls++;
+		}
+		calls[i].shell[k] += n;
+		total[0].shell[k] += n;
+	    }
+	    else if (sscanf(p, "denied %lu", &denied) == 1 && denied)
+		printf("Note: the sandbox refused %lu system calls under %s\n",
+		       denied, k ? "./tshref" : shellprog);
+	}
+	free(text);
+	unlink(runs[k].perf);
+	free(runs[k].out);
+    }
+
+    qsort(calls, ncalls, sizeof(struct calls_t), cmpcalls);
+    printf("System calls made by the shell in %s:\n", tracefile);
+    printf("%-20s %10s %10s %10s\n", "", "test", "reference", "delta");
+    for (i = 0; i < ncalls; i++)
+	printf("%-20s %10lu %10lu %+10ld\n", calls[i].name, calls[i].shell[0],
+	       calls[i].shell[1], 
+	       (long)calls[i].shell[0] - (long)calls[i].shell[1]);
+    printf("%-20s %10lu %10lu %+10ld\n", "total", total[0].shell[0],
+	   total[0].shell[1], (long)total[0].shell[0] - (long)total[0].shell[1]);
+    printf("%-20s %10lu %10lu %+10ld\n", "(by jobs)", total[1].shell[0],
+	   total[1].shell[1], (long)total[1].shell[0] - (long)total[1].shell[1]);
+    printf("\n");
+    free(calls);
+}
+
+/*
+ * cmpcalls - Order system calls by how often the busier shell made them
+ */
+int cmpcalls(const void *a, const void *b)
+{
+    const struct calls_t *x = a, *y = b;
+    unsigned long mx = x->shell[0] > x->shell[1] ? x->shell[0] : x->shell[1];
+    unsigned long my = y->shell[0] > y->shell[1] ? y->shell[0] : y->shell[1];
+
+    if (mx != my)
+	return mx < my ? 1 : -1;
+    return strcmp(x->name, y->name);
+}
+
+/*
+ * start_run - Fork and exec runtrace on a shell and trace file, with
+ *     its stdout going to a pipe that finish_runs reads into memory.
+ *     If perf is set, runtrace also records timings in run->perf.
+ */
+void start_run(struct run_t *run, char *shell, char *tracefile, int sandbox,
+	       int perf)
+{
+    char *argv[12];
+    int fds[2], fd, argc = 0;
+
+    argv[argc++] = "./runtrace";
+    if (sandbox)
+	argv[argc++] = "-x";
+    if (warp) {
+	argv[argc++] = "-w";
+	argv[argc++] = warp;
+    }
+    argv[argc++] = "-s";
+    argv[argc++] = shell;
+    argv[argc++] = "-f";
+    argv[argc++] = tracefile;
+    run->perf[0] = '\0';
+    if (perf) {
+	strcpy(run->perf, "/tmp/sdriver.perf.XXXXXX");
+	if ((fd = mkstemp(run->perf)) < 0) {
+	    perror("mkstemp");
+	    exit(1);
+	}
+	close(fd);
+	argv[argc++] = "-p";
+	argv[argc++] = run->perf;
+    }
+    argv[argc] = NULL;
+    sprintf(run->cmd, "./runtrace %s%s%s%s-s %s -f %s", 
+	    sandbox ? "-x " : "", warp ? "-w " : "", warp ? warp : "", 
+	    warp ? " " : "", shell, tracefile);
+
+    if (pipe(fds) < 0) {
+	perror("pipe");
+	exit(1);
+    }
+    fflush(stdout);
+    run->start = now_us();
+    run->end = 0;
+    if ((run->pid = fork()) < 0) {
+	perror("fork");
+	exit(1);
+    }
+    if (run->pid == 0) {
+	close(fds[0]);
+	dup2(fds[1], 1);
+	close(fds[1]);
+
+	/* Schedules chosen by -e are for the test shell only */
+	if (strcmp(shell, shellprog)) {
+	    unsetenv("TSH_SCHED");
+	    unsetenv("TSH_SCHED_SEED");
+	    unsetenv("TSH_SCHED_FORKS");
+	    unsetenv("TSH_SCHED_LOG");
+	}
+	execv(argv[0], argv);
+	perror("execv ./runtrace");
+	exit(1);
+    }
+    close(fds[1]);
+
+    run->fd = fds[0];
+    run->len = 0;
+    run->cap = MAXBUF;
+    if ((run->out = malloc(run->cap)) == NULL) {
+	perror("malloc");
+	exit(1);
+    }
+    run->out[0] = '\0';
+}
+
+/*
+ * finish_runs - Read the output of n started runs until they all
+ *     close their pipes, then reap them
+ */
+void finish_runs(struct run_t *runs, int n)
+{
+    struct pollfd pfds[2];
+    int i, k, open, nread;
+
+    for (open = n; open > 0; ) {
+	for (i = k = 0; i < n; i++) {
+	    if (runs[i].fd >= 0) {
+		pfds[k].fd = runs[i].fd;
+		pfds[k++].events = POLLIN;
+	    }
+	}
+	if (poll(pfds, k, -1) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    perror("poll");
+	    exit(1);
+	}
+	for (i = 0; i < n; i++) {
+	    if (runs[i].fd < 0)
+		continue;
+	    for (k = 0; pfds[k].fd != runs[i].fd; k++)
+		;
+	    if (!(pfds[k].revents & (POLLIN | POLLHUP | POLLERR)))
+		continue;
+	    if (runs[i].cap - runs[i].len < MAXBUF) {
+		runs[i].cap *= 2;
+		if ((runs[i].out = realloc(runs[i].out, runs[i].cap)) == NULL) {
+		    perror("realloc");
+		    exit(1);
+		}
+	    }
+	    nread = read(runs[i].fd, runs[i].out + runs[i].len, 
+			 runs[i].cap - runs[i].len - 1);
+	    if (nread > 0) {
+		runs[i].len += nread;
+		runs[i].out[runs[i].len] = '\0';
+	    }
+	    else if (nread == 0 || errno != EINTR) {
+		close(runs[i].fd);
+		runs[i].fd = -1;
+		runs[i].end = now_us();
+		open--;
+	    }
+	}
+    }
+
+    for (i = 0; i < n; i++) {
+	while (waitpid(runs[i].pid, &runs[i].status, 0) < 0) {
+	    if (errno != EINTR) {
+		perror("waitpid");
+		exit(1);
+	    }
+	}
+    }
+}
+
+/*
+ * save_output - Write a raw shell output to <outdir>/<tracefile>.<suffix>
+ */
+void save_output(char *tracefile, char *suffix, char *text)
+{
+    char filename[MAXBUF];
+    FILE *fp;
+
+    snprintf(filename, MAXBUF, "%s/%s.%s", outdir, tracefile, suffix);
+    if ((fp = fopen(filename, "w")) == NULL) {
+	printf("fopen error: Unable to open file %s\n", filename);
+	return;
+    }
+    fputs(text, fp);
+    fclose(fp);
+}
+
+/*
+ * read_file - Return the contents of a file as a malloc'd, null-terminated
+ *     string, or NULL if it can't be read. Sets *lenp to its length.
+ */
+char *read_file(char *filename, long *lenp)
+{
+    FILE *fp;
+    char *text;
+    long len;
+
+    if ((fp = fopen(filename, "r")) == NULL)
+	return NULL;
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    rewind(fp);
+    if ((text = malloc(len + 1)) == NULL) {
+	perror("malloc");
+	exit(1);
+    }
+    len = fread(text, 1, len, fp);
+    text[len] = '\0';
+    fclose(fp);
+    if (lenp)
+	*lenp = len;
+    return text;
+}
+
+/*
+ * parse_duration - Convert "500ms", "60s", "2m" or "60" (seconds) to
+ *     microseconds, as runtrace -d does. Returns -1 if it isn't one.
+ */
+long long parse_duration(char *str)
+{
+    char *end;
+    double v = strtod(str, &end);
+
+    if (end == str || v < 0)
+	return -1;
+    if (*end == '\0' || !strcmp(end, "s"))
+	return v * 1000000;
+    if (!strcmp(end, "ms"))
+	return v * 1000;
+    if (!strcmp(end, "m"))
+	return v * 60000000;
+    return -1;
+}
+
+/*
+ * now_us - Monotonic time in microseconds
+ */
+long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+ * hash_bytes - Continue a 64-bit FNV-1a hash over len bytes of buf
+ */
+unsigned long long hash_bytes(unsigned long long h, const void *buf, long len)
+{
+    const unsigned char *p = buf;
+
+    while (len-- > 0)
+	h = (h ^ *p++) * 1099511628211ULL;
+    return h;
+}
+
+/*
+ * ref_key - Key of a trace's reference outputs in the cache: a hash
+ *     of every binary that goes into producing them (tshref, runtrace,
+ *     the helper programs the traces run, and vtime.so under -w), the
+ *     trace file, the timeouts the driver and the jobs were built with,
+ *     and the warp factor (-w)
+ */
+unsigned long long ref_key(char *tracefile)
+{
+    static char *ref_inputs[] = {"./tshref", "./runtrace", "./myspin1",
+				 "./myspin2", "./myenv", "./myintp", "./myints",
+				 "./mytstpp", "./mytstps", "./mysplit",
+				 "./mysplitp", "./mycat", NULL};
+    static unsigned long long inputs_hash = 0;
+    unsigned long long h;
+    int timeouts[2] = {DRIVER_TIMEOUT, JOB_TIMEOUT};
+    char *text;
+    long len;
+    int i;
+
+    if (inputs_hash == 0) {
+	inputs_hash = 14695981039346656037ULL;
+	for (i = 0; ref_inputs[i] != NULL; i++) {
+	    h = file_hash(ref_inputs[i]);
+	    inputs_hash = hash_bytes(inputs_hash, &h, sizeof(h));
+	}
+	if (warp) {
+	    h = file_hash("./vtime.so");
+	    inputs_hash = hash_bytes(inputs_hash, &h, sizeof(h));
+	}
+    }
+
+    if ((text = read_file(tracefile, &len)) == NULL) {
+	printf("fopen error: Unable to open file %s\n", tracefile);
+	exit(1);
+    }
+    h = hash_bytes(inputs_hash, text, len);
+    h = hash_bytes(h, timeouts, sizeof(timeouts));
+    if (warp)
+	h = hash_bytes(h, warp, strlen(warp));
+    free(text);
+    return h;
+}
+
+/*
+ * load_variants - Read every cached reference output recorded under
+ *     key into a malloc'd array. Returns the number of variants.
+ *
+ *     The cache holds one directory per key, named by the key in hex,
+ *     and one file per distinct reference output, named by the hash 
+ *     of its filtered lines, so a nondeterministic trace accumulates
+ *     the set of outputs tshref is known to produce.
+ */
+int load_variants(unsigned long long key, char ***variantsp)
+{
+    char dirname[MAXBUF], filename[MAXBUF + 256];
+    char **variants = NULL;
+    struct dirent *de;
+    DIR *dp;
+    int n = 0;
+
+    snprintf(dirname, MAXBUF, "%s/%016llx", refcache, key);
+    if ((dp = opendir(dirname)) == NULL) {
+	*variantsp = NULL;
+	return 0;
+    }
+    while ((de = readdir(dp)) != NULL) {
+	if (de->d_name[0] == '.')
+	    continue;
+	if ((variants = realloc(variants, (n + 1) * sizeof(char *))) == NULL) {
+	    perror("realloc");
+	    exit(1);
+	}
+	snprintf(filename, sizeof(filename), "%s/%s", dirname, de->d_name);
+	if ((variants[n] = read_file(filename, NULL)) != NULL)
+	    n++;
+    }
+    closedir(dp);
+    *variantsp = variants;
+    return n;
+}
+
+/*
+ * add_variant - Record a reference output under key, unless an
+ *     equivalent output is already recorded
+ */
+void add_variant(unsigned long long key, char *ref_out)
+{
+    char dirname[MAXBUF], filename[MAXBUF + 32], tmpname[MAXBUF + 32];
+    char **lines;
+    unsigned long long h = 14695981039346656037ULL;
+    struct stat statbuf;
+    FILE *fp;
+    int i, n;
+
+    n = filter_output(ref_out, &lines);
+    for (i = 0; i < n; i++)
+	h = hash_bytes(h, lines[i], strlen(lines[i]) + 1);
+    free_lines(lines, n);
+
+    snprintf(dirname, MAXBUF, "%s/%016llx", refcache, key);
+    snprintf(filename, sizeof(filename), "%s/%016llx", dirname, h);
+    if (stat(filename, &statbuf) == 0)
+	return;
+    mkdir(refcache, 0755);
+    mkdir(dirname, 0755);
+
+    /* Write a temp file and rename it, so concurrent workers are safe */
+    snprintf(tmpname, sizeof(tmpname), "%s/.tmp.%d", dirname, getpid());
+    if ((fp = fopen(tmpname, "w")) == NULL) {
+	printf("fopen error: Unable to open file %s\n", tmpname);
+	return;
+    }
+    fputs(ref_out, fp);
+    fclose(fp);
+    rename(tmpname, filename);
+    if (verbose > 1)
+	printf("Recorded reference output variant %016llx for key %016llx\n", h, key);
+}
+
+/*
+ * split_lines - Break text into a malloc'd array of malloc'd lines,
+ *     without their newlines. A final line without a newline counts.
+ *     Returns the number of lines.
+ */
+int split_lines(char *text, char ***linesp)
+{
+    char **lines;
+    char *p, *eol;
+    int n = 0, max = 64;
+
+    if ((lines = malloc(max * sizeof(char *))) == NULL) {
+	perror("malloc");
+	exit(1);
+    }
+    for (p = text; *p; p = *eol ? eol + 1 : eol) {
+	if ((eol = strchr(p, '\n')) == NULL)
+	    eol = p + strlen(p);
+	if (n == max) {
+	    max *= 2;
+	    if ((lines = realloc(lines, max * sizeof(char *))) == NULL) {
+		perror("realloc");
+		exit(1);
+	    }
+	}
+	if ((lines[n] = malloc(eol - p + 1)) == NULL) {
+	    perror("malloc");
+	    exit(1);
+	}
+	memcpy(lines[n], p, eol - p);
+	lines[n++][eol - p] = '\0';
+    }
+    *linesp = lines;
+    return n;
+}
+
+/*
+ * filter_output - Filter the lines of a shell's output:
+ *
+ * (1) Elides all whitespace. 
+ * (2) Converts PIDs of the form "(12345)" to "(PID)". 
+ *
+ * and sort them. These transformations allow us to compare the 
+ * outputs of different runs of different shells as multisets of 
+ * lines. Returns the number of lines.
+ */
+int filter_output(char *raw, char ***linesp)
+{
+    char **lines;
+    char *src, *dst, *line, *d;
+    int i, n;
+
+    n = split_lines(raw, &lines);
+    for (i = 0; i < n; i++) {
+	/* Each "(1)" may grow into "(PID)", 5/3 of its size */
+	if ((line = malloc(2 * strlen(lines[i]) + 1)) == NULL) {
+	    perror("malloc");
+	    exit(1);
+	}
+
+	/* (1) Elide all whitespace */
+	for (src = dst = lines[i]; *src; src++)
+	    if (!isspace((unsigned char)*src))
+		*dst++ = *src;
+	*dst = '\0';
+
+	/* (2) Mask PIDs */
+	for (src = lines[i], dst = line; *src; ) {
+	    if (*src == '(' && isdigit((unsigned char)src[1])) {
+		for (d = src + 1; isdigit((unsigned char)*d); d++)
+		    ;
+		if (*d == ')') {
+		    strcpy(dst, "(PID)");
+		    dst += 5;
+		    src = d + 1;
+		    continue;
+		}
+	    }
+	    *dst++ = *src++;
+	}
+	*dst = '\0';
+
+	free(lines[i]);
+	lines[i] = line;
+    }
+    qsort(lines, n, sizeof(char *), cmpline);
+    *linesp = lines;
+    return n;
+}
+
+/*
+ * same_output - Return 1 if two raw shell outputs are the same after
+ *     filtering, regardless of the order of their lines
+ */
+int same_output(char *test, char *ref)
+{
+    char **test_lines, **ref_lines;
+    int i, n_test, n_ref, same;
+
+    n_test = filter_output(test, &test_lines);
+    n_ref = filter_output(ref, &ref_lines);
+
+    same = (n_test == n_ref);
+    for (i = 0; same && i < n_test; i++)
+	same = !strcmp(test_lines[i], ref_lines[i]);
+
+    free_lines(test_lines, n_test);
+    free_lines(ref_lines, n_ref);
+    return same;
+}
+
+/*
+ * emit_diff - Print a unified diff of two raw shell outputs, computed
+ *     from the longest common subsequence of their lines
+ */
+void emit_diff(char *test, char *ref)
+{
+    char **a, **b;
+    int na, nb, i, j, k, n, start, end, stop, ha, hb;
+    int *lcs;
+    char *ops;      /* ' ' both, '-' test only, '+' ref only */
+    int *ai, *bi;   /* line index in a and b before each op */
+
+    na = split_lines(test, &a);
+    nb = split_lines(ref, &b);
+    if ((double)(na + 1) * (nb + 1) > 16 * 1024 * 1024) {
+	printf("(outputs too large to diff: %d and %d lines)\n", na, nb);
+	free_lines(a, na);
+	free_lines(b, nb);
+	return;
+    }
+
+    /* lcs[i*(nb+1)+j] = LCS length of a[i..] and b[j..] */
+    lcs = calloc((size_t)(na + 1) * (nb + 1), sizeof(int));
+    ops = malloc(na + nb + 1);
+    ai = malloc((na + nb + 1) * sizeof(int));
+    bi = malloc((na + nb + 1) * sizeof(int));
+    if (!lcs || !ops || !ai || !bi) {
+	perror("malloc");
+	exit(1);
+    }
+    for (i = na - 1; i >= 0; i--)
+	for (j = nb - 1; j >= 0; j--)
+	    lcs[i*(nb+1)+j] = !strcmp(a[i], b[j]) ? lcs[(i+1)*(nb+1)+j+1] + 1
+		: (lcs[(i+1)*(nb+1)+j] >= lcs[i*(nb+1)+j+1] 
+		   ? lcs[(i+1)*(nb+1)+j] : lcs[i*(nb+1)+j+1]);
+
+    /* Walk the table to get the edit script */
+    for (i = j = n = 0; i < na || j < nb; n++) {
+	ai[n] = i;
+	bi[n] = j;
+	if (i < na && j < nb && !strcmp(a[i], b[j])) {
+	    ops[n] = ' ';
+	    i++, j++;
+	}
+	else if (j == nb || (i < na && lcs[(i+1)*(nb+1)+j] >= lcs[i*(nb+1)+j+1])) {
+	    ops[n] = '-';
+	    i++;
+	}
+	else {
+	    ops[n] = '+';
+	    j++;
+	}
+    }
+
+    printf("--- test\n");
+    printf("+++ reference\n");
+    for (k = 0; k < n; k = stop) {
+	/* Find the next change */
+	while (k < n && ops[k] == ' ')
+	    k++;
+	if (k == n)
+	    break;
+	start = k > DIFF_CONTEXT ? k - DIFF_CONTEXT : 0;
+
+	/* Merge following changes whose context would overlap */
+	for (end = k; ; end = i) {
+	    while (end < n && ops[end] != ' ')
+		end++;
+	    for (i = end; i < n && ops[i] == ' '; i++)
+		;
+	    if (i == n || i - end > 2 * DIFF_CONTEXT)
+		break;
+	}
+	stop = end + DIFF_CONTEXT < n ? end + DIFF_CONTEXT : n;
+
+	for (i = start, ha = hb = 0; i < stop; i++) {
+	    ha += (ops[i] != '+');
+	    hb += (ops[i] != '-');
+	}
+	printf("@@ -%d,%d +%d,%d @@\n", ai[start] + (ha > 0), ha, 
+	       bi[start] + (hb > 0), hb);
+	for (i = start; i < stop; i++)
+	    printf("%c%s\n", ops[i], ops[i] == '+' ? b[bi[i]] : a[ai[i]]);
+    }
+
+    free(lcs);
+    free(ops);
+    free(ai);
+    free(bi);
+    free_lines(a, na);
+    free_lines(b, nb);
+}
+
+/*
+ * free_lines - Free an array of lines and the lines in it
+ */
+void free_lines(char **lines, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+	free(lines[i]);
+    free(lines);
+}
+
+/*
+ * cmpline - qsort comparator for an array of lines
+ */
+int cmpline(const void *a, const void *b)
+{
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+/*
+ * cmpdouble - qsort comparison for doubles
+ */
+int cmpdouble(const void *a, const void *b)
+{
+    double x = *(double *)a, y = *(double *)b;
+
+    return x < y ? -1 : x > y;
 }
 
 /* 
@@ -332,11 +2578,47 @@ void delete_tmpfiles()
  */
 void usage(void) 
 {
-    printf("Usage: sdriver [-hV] [-s <shell> -t <tracenum> -i <iters>]\n");
+    printf("Usage: sdriver [-hV] [-s <shell> -t <tracenum> -i <iters> -j <n> -o <dir> -c <dir> -w <factor>\n");
+    printf("               -e <strategy> -S <seed> -CrPX] [--stress <duration>]\n");
+    printf("               [--json <file>] [--junit <file>] [--store <file> --no-store]\n");
+    printf("               [--compare[=<n>] --watch]\n");
     printf("Options\n");
     printf("\t-h           Print this message.\n");
-    printf("\t-i <iters>   Run each trace <iters> times (default %d)\n", 
+    printf("\t-i <iters>   Run each trace <iters> times (default %d) and report\n", 
 	   num_iters);
+    printf("\t             each one's pass rate and wall times\n");
+    printf("\t-j <n>       Run <n> traces at once (default 1)\n");
+    printf("\t-o <dir>     Save raw shell outputs in <dir>\n");
+    printf("\t-c <dir>     Reference output cache (default .refcache)\n");
+    printf("\t-C           Don't cache reference outputs\n");
+    printf("\t-r           Rerun the reference shell, recording new outputs\n");
+    printf("\t-X           Compare system call counts with tshref, using\n");
+    printf("\t             runtrace's seccomp sandbox\n");
+    printf("\t-P           Fail traces where tsh is slower than tshref\n");
+    printf("\t             (each shell runs each trace <iters> times, default %d)\n",
+	   PERF_ITERS);
+    printf("\t-w <factor>  Run the shells' clocks <factor> times faster, so\n");
+    printf("\t             sleeps and timeouts take a fraction of real time\n");
+    printf("\t-e <strat>   Explore fork schedules: random, pct[:d] (<iters> seeds\n");
+    printf("\t             each) or exhaustive, and print any that fail\n");
+    printf("\t-S <seed>    First seed for -e random and pct, and for --stress\n");
+    printf("\t             (default: clock)\n");
+    printf("\t--stress <duration>\n");
+    printf("\t             Run random traces from ./tracegen on <n> workers for\n");
+    printf("\t             <duration> (e.g. 90s, 10m); keep failing ones and\n");
+    printf("\t             minimized versions of them in <dir> (default stress)\n");
+    printf("\t--json <file>, --junit <file>\n");
+    printf("\t             Also write the per-trace results to <file>\n");
+    printf("\t--store <file>\n");
+    printf("\t             Append every iteration's timings to <file>, keyed by\n");
+    printf("\t             the test shell's hash (default .results)\n");
+    printf("\t--no-store   Don't record timings\n");
+    printf("\t--compare[=<n>]\n");
+    printf("\t             Fail traces that are slower than in the <n> builds\n");
+    printf("\t             of the shell tested before (default %d)\n", 
+	   COMPARE_BASELINES);
+    printf("\t--watch      Make the shell and run the traces, failing and fast\n");
+    printf("\t             ones first, again on every change to tsh.c or fork.c\n");
     printf("\t-s <shell>   Name of test shell (default ./tsh)\n");
     printf("\t-t <n>       Run trace <n> only (default all)\n");
     printf("\t-V           Be more verbose.\n");
@@ -0,0 +1,209 @@
+/*
+ * syncshm.h - Shared-memory sync channel for the Shell Lab
+ *
+ * runtrace keeps a struct syncshm in a memfd and advertises the
+ * descriptor in the SYNCSHM environment variable, next to SYNCFD.
+ * A job that finds it checks in with sync_arrive() and then blocks in
+ * sync_await() until a SIGNAL releases it; runtrace's WAIT waits for
+ * the arrived counter to move. Both sides spin briefly before they
+ * sleep on a futex, so a handshake between running processes costs
+ * no system call at all. Jobs fall back to the SYNCFD socket when
+ * SYNCSHM is absent.
+ *
+ * Each SIGNAL adds a token that whichever job is waiting takes, as
+ * the SYNCFD datagram goes to whichever job reads it, so both
+ * channels release the same jobs: one that checked in and was then
+ * stopped or killed does not use up a SIGNAL meant for the others.
+ */
+#ifndef __SYNCSHM_H__
+#define __SYNCSHM_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define SYNC_SLOTS 64     /* jobs whose check-in is recorded by pid */
+#define SYNC_SPIN  4000   /* polls before sleeping on the futex */
+
+#if defined(__i386__) || defined(__x86_64__)
+#define sync_relax() __builtin_ia32_pause()
+#else
+#define sync_relax() do { } while (0)
+#endif
+
+/* A checked-in job */
+struct sync_slot {
+    volatile int32_t pid;       /* 0 if the slot is free */
+    volatile uint32_t arrival;  /* its place in the arrival order */
+};
+
+struct syncshm {
+    volatile uint32_t arrived;  /* futex: jobs that have checked in */
+    volatile uint32_t released; /* futex: SIGNALs not yet taken by a job */
+    volatile uint32_t arrivals; /* next job's place in the arrival order */
+    struct sync_slot slots[SYNC_SLOTS];
+};
+
+static inline long sync_futex(volatile uint32_t *word, int op, uint32_t val,
+			      const struct timespec *ts)
+{
+    return syscall(SYS_futex, word, op, val, ts, NULL, 0);
+}
+
+/*
+ * sync_create - Make a new channel (runtrace). Returns NULL if shared
+ *     memory is not available; *fdp is the descriptor to advertise.
+ */
+static inline struct syncshm *sync_create(int *fdp)
+{
+    struct syncshm *sh;
+    int fd;
+
+    if ((fd = syscall(SYS_memfd_create, "syncshm", 0)) < 0)
+	return NULL;
+    if (ftruncate(fd, sizeof(struct syncshm)) < 0
+	|| (sh = mmap(NULL, sizeof(struct syncshm), PROT_READ | PROT_WRITE,
+		      MAP_SHARED, fd, 0)) == MAP_FAILED) {
+	close(fd);
+	return NULL;
+    }
+    *fdp = fd;
+    return sh;
+}
+
+/*
+ * sync_attach - Map the channel advertised in SYNCSHM (jobs).
+ *     Returns NULL if there is none.
+ */
+static inline struct syncshm *sync_attach(void)
+{
+    struct syncshm *sh;
+    struct stat st;
+    char *str;
+    int fd;
+
+    if ((str = getenv("SYNCSHM")) == NULL)
+	return NULL;
+    fd = atoi(str);
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct syncshm))
+	return NULL;
+    sh = mmap(NULL, sizeof(struct syncshm), PROT_READ | PROT_WRITE,
+	      MAP_SHARED, fd, 0);
+    return sh == MAP_FAILED ? NULL : sh;
+}
+
+/*
+ * sync_until - Wait until *word differs from old, for at most ms
+ *     milliseconds (forever if ms < 0). Returns 0 on timeout.
+ */
+static inline int sync_until(volatile uint32_t *word, uint32_t old, int ms)
+{
+    struct timespec end, now, ts;
+    long long left;
+    int i;
+
+    for (i = 0; i < SYNC_SPIN; i++) {
+	if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != old)
+	    return 1;
+	sync_relax();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += ms / 1000;
+    end.tv_nsec += (ms % 1000) * 1000000L;
+    while (__atomic_load_n(word, __ATOMIC_ACQUIRE) == old) {
+	if (ms < 0) {
+	    sync_futex(word, FUTEX_WAIT, old, NULL);
+	    continue;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left = (end.tv_sec - now.tv_sec) * 1000000000LL
+	    + (end.tv_nsec - now.tv_nsec);
+	if (left <= 0)
+	    return 0;
+	ts.tv_sec = left / 1000000000LL;
+	ts.tv_nsec = left % 1000000000LL;
+	sync_futex(word, FUTEX_WAIT, old, &ts);
+    }
+    return 1;
+}
+
+/*
+ * sync_arrive - Check in with runtrace (the job side of WAIT)
+ */
+static inline void sync_arrive(struct syncshm *sh)
+{
+    uint32_t arrival = __atomic_fetch_add(&sh->arrivals, 1, __ATOMIC_SEQ_CST);
+    int32_t free_pid = 0, pid = getpid();
+    int i;
+
+    for (i = 0; i < SYNC_SLOTS; i++) {
+	if (__atomic_compare_exchange_n(&sh->slots[i].pid, &free_pid, pid,
+					0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+	    sh->slots[i].arrival = arrival;
+	    break;
+	}
+	free_pid = 0;
+    }
+    __atomic_fetch_add(&sh->arrived, 1, __ATOMIC_RELEASE);
+    sync_futex(&sh->arrived, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+/*
+ * sync_await - Block until a SIGNAL is there to take, take it, then
+ *     give up the job's slot (the job side of SIGNAL)
+ */
+static inline void sync_await(struct syncshm *sh)
+{
+    int32_t pid = getpid();
+    uint32_t r;
+    int i;
+
+    r = __atomic_load_n(&sh->released, __ATOMIC_ACQUIRE);
+    for (;;) {
+	if (r == 0) {
+	    sync_until(&sh->released, 0, -1);
+	    r = __atomic_load_n(&sh->released, __ATOMIC_ACQUIRE);
+	} else if (__atomic_compare_exchange_n(&sh->released, &r, r - 1, 0,
+					       __ATOMIC_ACQ_REL,
+					       __ATOMIC_ACQUIRE))
+	    break;
+    }
+
+    for (i = 0; i < SYNC_SLOTS; i++)
+	if (sh->slots[i].pid == pid)
+	    sh->slots[i].pid = 0;
+}
+
+/*
+ * sync_signal - Release one waiting job, or the next one to wait
+ *     (runtrace's SIGNAL)
+ */
+static inline void sync_signal(struct syncshm *sh)
+{
+    __atomic_fetch_add(&sh->released, 1, __ATOMIC_RELEASE);
+    sync_futex(&sh->released, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+/*
+ * sync_pid - PID of the job that checked in arrival-th (from 0), or 0
+ *     if it has no slot
+ */
+static inline int sync_pid(struct syncshm *sh, uint32_t arrival)
+{
+    int i;
+
+    for (i = 0; i < SYNC_SLOTS; i++)
+	if (sh->slots[i].pid && sh->slots[i].arrival == arrival)
+	    return sh->slots[i].pid;
+    return 0;
+}
+
+#endif /* __SYNCSHM_H__ */
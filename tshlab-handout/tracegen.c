@@ -0,0 +1,432 @@
+/*
+ * tracegen.c - Random trace generator for the Shell Lab
+ *
+ * Writes a random but valid trace to stdout: background and
+ * foreground jobs built from the lab's helpers (myspin, mysplit,
+ * mytstp, myint), the jobs, fg and bg builtins, SIGINT and SIGTSTP,
+ * and WAIT/SIGNAL synchronization. A model of the shell's job list
+ * decides which steps make sense next (a job to fg has to exist, a
+ * SIGNAL has to release the job the trace means to release) and
+ * predicts what jobs prints, which the trace checks with EXPECT.
+ *
+ * Each step draws its random numbers from the seed and its own index
+ * alone, so sdriver can drop steps (-k) while minimizing a failing
+ * trace, and the steps that remain adapt to the model's new state.
+ *
+ * The model follows the reference shell: a new job takes the first
+ * free slot and the next job ID, deleting a job makes the next ID one
+ * more than the highest in use, and jobs lists slots in order. A
+ * SIGNAL releases whichever job is waiting for one, so the generator
+ * only sends it when a single running job waits.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "labutil.h"
+
+#define MAXJOBS     16   /* the shell's job list */
+#define MAXLIVE     6    /* most jobs the generator keeps at once */
+#define MAXSTEPS    256
+#define DEFSTEPS    8
+
+/* Job kinds */
+#define KIND_SYNC   0    /* myspin1, myspin2, mysplit: wait for SIGNAL */
+#define KIND_TSTP   1    /* mytstpp, mytstps: stop themselves at once */
+#define KIND_INT    2    /* myintp, myints: interrupt themselves at once */
+
+/* Job states, as jobs prints them */
+#define UNDEF       0
+#define BG          1
+#define ST          2
+
+/* The model's view of one slot of the shell's job list */
+struct mjob_t {
+    int state;
+    int jid;
+    int kind;
+    char cmd[MAXBUF];     /* command line as the shell stores it */
+};
+
+/*
+ * Global variables
+ */
+struct mjob_t jobs[MAXJOBS];
+int nextjid = 1;
+unsigned long long rng;   /* the current step's random state */
+int verbose = 0;
+
+/* Prototypes */
+void usage(char *msg);
+int pick(int n);
+void step(int k);
+void send_cmd(char *cmd, int next);
+int addjob(int state, int kind, char *cmd);
+void deletejob(int slot);
+int findjid(int jid);
+int njobs(void);
+int releasable(int slot);
+int nwaiting(void);
+void finish_fg(int slot);
+void expect_jobs(void);
+
+int main(int argc, char **argv)
+{
+    char dropped[MAXSTEPS];
+    unsigned long long seed = 1;
+    int c, k, nsteps = DEFSTEPS;
+    char *p;
+
+    memset(dropped, 0, sizeof(dropped));
+    while ((c = getopt(argc, argv, "hVs:n:k:")) != EOF) {
+	switch (c) {
+	case 'h':             /* Print help message */
+	    usage("");
+	    break;
+	case 'V':             /* Comment every step */
+	    verbose = 1;
+	    break;
+	case 's':             /* Seed */
+	    seed = strtoull(optarg, NULL, 0);
+	    break;
+	case 'n':             /* Number of steps */
+	    nsteps = atoi(optarg);
+	    if (nsteps < 0 || nsteps > MAXSTEPS)
+		usage("Bad number of steps (-n)");
+	    break;
+	case 'k':             /* Steps to leave out, e.g. 2,5,7 */
+	    for (p = optarg; *p; p++) {
+		k = strtol(p, &p, 10);
+		if (k >= 0 && k < MAXSTEPS)
+		    dropped[k] = 1;
+		if (*p != ',')
+		    break;
+	    }
+	    break;
+	default:
+	    usage("Unrecognized argument");
+	}
+    }
+
+    printf("#\n# tracegen -s %llu -n %d", seed, nsteps);
+    for (k = 0; k < nsteps; k++)
+	if (dropped[k]) {
+	    printf(" -k %d", k);
+	    for (k++; k < nsteps; k++)
+		if (dropped[k])
+		    printf(",%d", k);
+	}
+    printf("\n#\n");
+
+    for (k = 0; k < nsteps; k++) {
+	if (dropped[k])
+	    continue;
+	rng = mix(seed * MAXSTEPS + k);
+	step(k);
+    }
+
+    echo_cmd(stdout, "quit");
+    printf("quit\n");
+    exit(0);
+}
+
+/*
+ * usage - Print help message and terminate
+ */
+void usage(char *msg)
+{
+    printf("%s\n", msg);
+    printf("Usage: tracegen [-hV] [-s <seed>] [-n <steps>] [-k <i,j,...>]\n");
+    printf("Options:\n");
+    printf("  -h            Print this message\n");
+    printf("  -s <seed>     Random seed (default 1)\n");
+    printf("  -n <steps>    Number of steps (default %d)\n", DEFSTEPS);
+    printf("  -k <i,j,...>  Leave out these steps (numbered from 0)\n");
+    printf("  -V            Put a comment before every step\n");
+    exit(0);
+}
+
+/*
+ * pick - Random number in [0, n) from the current step's state
+ */
+int pick(int n)
+{
+    rng = mix(rng);
+    return n > 0 ? (int)(rng % n) : 0;
+}
+
+/*
+ * step - Emit step k: pick one of the actions the model allows
+ */
+void step(int k)
+{
+    static char *sync_cmds[] = { "./myspin1", "./myspin2", "./mysplit" };
+    static char *tstp_cmds[] = { "./mytstpp", "./mytstps" };
+    static char *int_cmds[] = { "./myintp", "./myints" };
+    char cmd[MAXBUF];
+    int cand[MAXJOBS], ncand, i, slot, jid;
+    int full = njobs() >= MAXLIVE;
+
+    if (verbose)
+	printf("# step %d\n", k);
+
+    for (;;) {
+	switch (pick(9)) {
+
+	/* Start a background job that waits for a SIGNAL */
+	case 0:
+	case 1:
+	    if (full)
+		continue;
+	    sprintf(cmd, "%s %d &", sync_cmds[pick(3)], 1 + pick(9));
+	    send_cmd(cmd, 1);
+	    addjob(BG, KIND_SYNC, cmd);
+	    printf("WAIT\n");
+	    return;
+
+	/* Run a foreground job that waits, and end it somehow */
+	case 2:
+	    if (full)
+		continue;
+	    sprintf(cmd, "%s %d", sync_cmds[pick(3)], 1 + pick(9));
+	    send_cmd(cmd, 0);
+	    slot = addjob(0, KIND_SYNC, cmd);
+	    printf("WAIT\n");
+	    finish_fg(slot);
+	    return;
+
+	/* Run a job that stops or interrupts itself */
+	case 3:
+	    if (full)
+		continue;
+	    if (pick(2)) {
+		strcpy(cmd, tstp_cmds[pick(2)]);
+		send_cmd(cmd, 1);
+		addjob(ST, KIND_TSTP, cmd);
+	    }
+	    else {
+		strcpy(cmd, int_cmds[pick(2)]);
+		send_cmd(cmd, 1);
+		deletejob(addjob(0, KIND_INT, cmd));
+	    }
+	    return;
+
+	/* jobs, checked against the model */
+	case 4:
+	    send_cmd("jobs", 1);
+	    expect_jobs();
+	    return;
+
+	/* 
+	 * bg a stopped job. Not one that stopped itself: once running, 
+	 * it spins until its alarm, so when it leaves the list is up to
+	 * the clock.
+	 */
+	case 5:
+	    for (ncand = 0, i = 0; i < MAXJOBS; i++)
+		if (jobs[i].state == ST && jobs[i].kind == KIND_SYNC)
+		    cand[ncand++] = i;
+	    if (ncand == 0)
+		continue;
+	    slot = cand[pick(ncand)];
+	    sprintf(cmd, "bg %%%d", jobs[slot].jid);
+	    send_cmd(cmd, 1);
+	    jobs[slot].state = BG;
+	    return;
+
+	/* 
+	 * fg a stopped job that then finishes. mytstps exits as soon as
+	 * it's continued; mytstpp would spin until its alarm, like a
+	 * bg'd one, so it stays stopped. A sync job gets the SIGNAL if
+	 * it will be the only one waiting: it can't take it before the
+	 * shell continues it, so there is no race with the fg. A signal
+	 * sent to the shell could arrive before the fg, so there are no
+	 * SIGINTs or SIGTSTPs here, nor fgs of running jobs.
+	 */
+	case 6:
+	    for (ncand = 0, i = 0; i < MAXJOBS; i++)
+		if (jobs[i].state == ST && (jobs[i].kind == KIND_SYNC
+					    ? nwaiting() == 0
+					    : !strcmp(jobs[i].cmd, "./mytstps")))
+		    cand[ncand++] = i;
+	    if (ncand == 0)
+		continue;
+	    slot = cand[pick(ncand)];
+	    sprintf(cmd, "fg %%%d", jobs[slot].jid);
+	    if (jobs[slot].kind == KIND_TSTP)
+		send_cmd(cmd, 1);
+	    else {
+		send_cmd(cmd, 0);
+		printf("SIGNAL\nNEXT\n");
+	    }
+	    deletejob(slot);
+	    return;
+
+	/* Let a running background job finish */
+	case 7:
+	    for (ncand = 0, i = 0; i < MAXJOBS; i++)
+		if (releasable(i))
+		    cand[ncand++] = i;
+	    if (ncand == 0)
+		continue;
+	    slot = cand[pick(ncand)];
+	    printf("SIGNAL\nREAP\n");
+	    deletejob(slot);
+	    return;
+
+	/* fg or bg a job that doesn't exist */
+	case 8:
+	    do
+		jid = 1 + pick(MAXJOBS);
+	    while (findjid(jid) >= 0);
+	    sprintf(cmd, "%s %%%d", pick(2) ? "fg" : "bg", jid);
+	    send_cmd(cmd, 1);
+	    return;
+	}
+    }
+}
+
+/*
+ * finish_fg - End the foreground job in slot: stop it, interrupt it,
+ *     or (if no other job is waiting) SIGNAL it
+ */
+void finish_fg(int slot)
+{
+    int how = pick(releasable(slot) ? 3 : 2);
+
+    if (how == 0) {
+	printf("SIGINT\nNEXT\n");
+	deletejob(slot);
+    }
+    else if (how == 1) {
+	printf("SIGTSTP\nNEXT\n");
+	jobs[slot].state = ST;
+    }
+    else {
+	printf("SIGNAL\nNEXT\n");
+	deletejob(slot);
+    }
+}
+
+/*
+ * releasable - True if a SIGNAL would release the job in slot: it is
+ *     a running sync job, and the only one (a stopped job can't take
+ *     the SIGNAL, but any other running one might)
+ */
+int releasable(int slot)
+{
+    return jobs[slot].kind == KIND_SYNC && jobs[slot].state == BG
+	&& nwaiting() == 1;
+}
+
+/*
+ * nwaiting - Sync jobs waiting for a SIGNAL: the running ones
+ */
+int nwaiting(void)
+{
+    int i, n = 0;
+
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].jid && jobs[i].kind == KIND_SYNC && jobs[i].state == BG)
+	    n++;
+    return n;
+}
+
+/*
+ * send_cmd - Emit a labeled command line, and a NEXT unless the
+ *     command holds the prompt back (a foreground job)
+ */
+void send_cmd(char *cmd, int next)
+{
+    echo_cmd(stdout, cmd);
+    printf("%s\n", cmd);
+    if (next)
+	printf("NEXT\n");
+}
+
+/*
+ * addjob - Model the shell adding a job (state 0 for foreground).
+ *     Returns its slot.
+ */
+int addjob(int state, int kind, char *cmd)
+{
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++) {
+	if (jobs[i].jid == 0) {
+	    jobs[i].state = state ? state : BG;
+	    jobs[i].kind = kind;
+	    jobs[i].jid = nextjid++;
+	    if (nextjid > MAXJOBS)
+		nextjid = 1;
+	    strcpy(jobs[i].cmd, cmd);
+	    return i;
+	}
+    }
+    fprintf(stderr, "tracegen: too many jobs\n");
+    exit(1);
+}
+
+/*
+ * deletejob - Model the shell deleting the job in slot
+ */
+void deletejob(int slot)
+{
+    int i, max = 0;
+
+    memset(&jobs[slot], 0, sizeof(jobs[slot]));
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].jid > max)
+	    max = jobs[i].jid;
+    nextjid = max + 1;
+}
+
+/*
+ * findjid - Slot of the job with this ID, or -1
+ */
+int findjid(int jid)
+{
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].jid == jid)
+	    return i;
+    return -1;
+}
+
+/*
+ * njobs - Jobs in the list
+ */
+int njobs(void)
+{
+    int i, n = 0;
+
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].jid)
+	    n++;
+    return n;
+}
+
+/*
+ * expect_jobs - Check every line jobs should have printed
+ */
+void expect_jobs(void)
+{
+    char *p;
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++) {
+	if (!jobs[i].jid)
+	    continue;
+	printf("EXPECT /^\\(%d\\) \\([0-9]+\\) %s ", jobs[i].jid,
+	       jobs[i].state == ST ? "Stopped" : "Running");
+	for (p = jobs[i].cmd; *p; p++) {
+	    if (strchr(".[]()*+?{}|^$\\", *p))
+		putchar('\\');
+	    putchar(*p);
+	}
+	printf("$/\n");
+    }
+}
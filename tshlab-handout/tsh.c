@@ -5,6 +5,7 @@
  * ̸: ȣ 
  * 
  */
+#define _GNU_SOURCE         /* pipe2, memfd_create */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -15,17 +16,27 @@
 #include <fcntl.h>
 #include <sys/wait.h>
 #include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <stdint.h>
 
 /* Job states */
 #define UNDEF 0 /* undefined */
 #define FG 1    /* running in foreground */
 #define BG 2    /* running in background */
 #define ST 3    /* stopped */
+#define QU 4    /* queued, waiting for a run slot */
+#define PD 5    /* pending, waiting for the jobs it runs after */
 /* Misc manifest constants */
 #define MAXLINE    1024   /* max line size */
 #define MAXARGS     128   /* max args on a command line */
 #define MAXJOBS      16   /* max jobs at any point in time */
 #define MAXJID    1<<16   /* max job ID */
+#define MAXDEPS       8   /* max jobs an after job can wait for */
+#define DIRCACHE      8   /* directories whose listings parseline keeps */
+#define GLOBPOOL  65536   /* bytes for the names glob expansion adds */
 
 
 /* 
@@ -35,23 +46,71 @@
  *     ST -> FG  : fg command
  *     ST -> BG  : bg command
  *     BG -> FG  : fg command
- * At most 1 job can be in the FG state.
+ *     QU -> BG  : a running BG job is reaped and a run slot frees up
+ *     QU -> FG  : fg command
+ *     PD -> QU  : every job it runs after exited with status 0
+ *     PD -> UNDEF : one of those jobs failed (the PD job fails too)
+ * At most 1 job can be in the FG state.  QU and PD jobs have not been
+ * forked yet, so their pid is 0.  A PD job may only wait for jobs that
+ * already exist or have finished, so the dependencies always form a
+ * DAG.  It waits for them by sequence number, since a jid may be
+ * reused by a later job before they finish.
  */
 
 /* Global variables */
 struct job_t {              /* The job struct */
 	pid_t pid;              /* job PID */
 	int jid;                /* job ID [1, 2, ...] */
-	int state;              /* UNDEF, BG, FG, or ST */
+	int state;              /* UNDEF, BG, FG, ST, QU, or PD */
+	unsigned long seq;      /* admission order; unlike jids, never reused */
+	int shown;              /* its jid was printed, so after may name it */
 	char cmdline[MAXLINE];  /* command line */
+	unsigned long deps[MAXDEPS]; /* PD: seqs of jobs still to finish successfully */
+	int ndeps;              /* PD: number of entries in deps */
+	char args[MAXLINE];     /* QU, PD: the expanded argv, packed by packargs */
+	int argc;               /* QU, PD: number of strings in args */
 };
 struct job_t jobs[MAXJOBS]; /* The job list */
 
+struct done_t {             /* A finished job, for after */
+	unsigned long seq;      /* its sequence number, 0 if the slot is free */
+	int ok;                 /* true if it exited with status 0 */
+};
+struct done_t done[MAXJOBS+1]; /* The last shown job to finish with each jid */
+
 extern char **environ;      /* defined in libc */
 char prompt[] = "eslab_tsh> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
 int nextjid = 1;            /* next job ID to allocate */
+unsigned long nextseq = 1;  /* next admission sequence number */
+int maxrunning = 0;         /* max running BG jobs (-l), 0 = unlimited */
+int loadlimit = 0;          /* if true, derive the limit from system load (-L) */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
+
+struct capture_t {          /* Captured output of a background job */
+	int jid;                /* job ID, 0 if the slot is free */
+	int fd;                 /* read end of the job's output pipe, -1 at EOF */
+	char *ring;             /* capsize bytes mapped from a memfd */
+	unsigned long total;    /* bytes written to the ring so far */
+	unsigned long seq;      /* order the captures were started in */
+};
+struct capture_t captures[MAXJOBS]; /* Outlive their jobs until the jid is reused */
+unsigned long nextcapseq = 1; /* next capture sequence number */
+int capsize = 0;            /* ring size for captured BG output (-o), 0 = off */
+long cachemax = 16L<<20;    /* size cap of the cached command store (-c) */
+
+struct dircache_t {         /* A directory listing read for glob expansion */
+	char path[MAXLINE];     /* directory name, "" if the slot is free */
+	dev_t dev;              /* identity and mtime of the directory when */
+	ino_t ino;              /*   it was read; the listing is reused while */
+	struct timespec mtime;  /*   they are unchanged */
+	char *names;            /* the entry names, each null-terminated */
+	int *offs;              /* offset of each name in names */
+	int n;                  /* number of names */
+	int namecap, offcap;    /* allocated sizes of names and offs */
+	unsigned long used;     /* parse count at last use, for replacement */
+};
+struct dircache_t dircache[DIRCACHE];
 /* End global variables */
 
 
@@ -60,6 +119,26 @@ char sbuf[MAXLINE];         /* for composing sprintf messages */
 /* Here are the functions that you will implement */
 void eval(char *cmdline);
 int builtin_cmd(char **argv);
+void startjob(struct job_t *job, int state);
+void startqueued(void);
+void do_after(char **argv);
+void resolvedeps(struct job_t *job, int ok);
+void failjob(struct job_t *job, int depjid);
+int packargs(char *buf, char **argv);
+int runlimit(void);
+int bgrunning(struct job_t *jobs);
+int readfile(const char *path, char *buf, int size);
+int capture_pipe(int bg, int *fds);
+void capture_start(int jid, int *fds);
+void capture_drain(struct capture_t *cap);
+void capture_dump(int jid, int lines, int output_fd);
+void sigio_handler(int sig);
+int cache_key(char **argv, unsigned long long *key);
+void cache_path(char *buf, unsigned long long key, const char *suffix);
+int cache_replay(char **argv);
+void cache_exec(char **argv);
+void cache_evict(void);
+int copyfd(int from, int to, long len);
 void waitfg(pid_t pid, int output_fd);
 void sigchld_handler(int sig);
 void sigtstp_handler(int sig);
@@ -67,6 +146,10 @@ void sigint_handler(int sig);
 
 /* Here are helper routines that we've provided for you */
 int parseline(const char *cmdline, char **argv); 
+int expandglobs(char **argv, int argc, int *quoted);
+struct dircache_t *readdircache(const char *path);
+int globmatch(const char *pat, const char *name);
+int globcmp(const void *a, const void *b, void *names);
 void sigquit_handler(int sig);
 
 void clearjob(struct job_t *job);
@@ -101,7 +184,7 @@ int main(int argc, char **argv)
 	dup2(1, 2);
 
 	/* Parse the command line */
-	while ((c = getopt(argc, argv, "hvp")) != EOF) {
+	while ((c = getopt(argc, argv, "hvpl:Lo:c:")) != EOF) {
 		switch (c) {
 			case 'h':             /* print help message */
 				usage();
@@ -112,6 +195,18 @@ int main(int argc, char **argv)
 			case 'p':             /* don't print a prompt */
 				emit_prompt = 0;  /* handy for automatic testing */
 				break;
+			case 'l':             /* max running background jobs */
+				maxrunning = atoi(optarg);
+				break;
+			case 'L':             /* limit background jobs by system load */
+				loadlimit = 1;
+				break;
+			case 'o':             /* capture BG output in rings of n bytes */
+				capsize = atoi(optarg);
+				break;
+			case 'c':             /* size cap of the cached store */
+				cachemax = atol(optarg);
+				break;
 			default:
 				usage();
 		}
@@ -125,6 +220,7 @@ int main(int argc, char **argv)
 	Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
 	Signal(SIGTTIN, SIG_IGN);
 	Signal(SIGTTOU, SIG_IGN);
+	Signal(SIGIO,   sigio_handler);    /* Captured job output is ready */
 
 	/* This one provides a clean way to kill the shell */
 	Signal(SIGQUIT, sigquit_handler); 
@@ -182,19 +278,46 @@ void eval(char *cmdline)
 	char *argv[MAXARGS]; // command
 	pid_t pid;	// process ID 
 	int bg;	// BG, FG check 
+	int jid;	// queued job id 
+	int limit;	// background run limit 
+	int argc;	// queued job's argument count 
+	char args[MAXLINE];	// queued job's packed argv 
+	struct job_t *job;	// queued job 
+	int capfds[2];	// BG output capture pipe 
 	sigset_t mask;
 	
 	bg = parseline(cmdline, argv); // ɾ argv зϿ BG, FG üũ 
 	
+	if (argv[0] && !strcmp(argv[0], "cached") && cache_replay(argv))
+		return;	//    fork  ʰ ״ Ѵ. 
+	
 	if (!builtin_cmd(argv)) {
 		sigemptyset(&mask);
 		sigaddset(&mask, SIGCHLD);
 		sigaddset(&mask, SIGINT);
 		sigaddset(&mask, SIGTSTP);
+		sigaddset(&mask, SIGIO);
 	
 		if ( sigprocmask( SIG_BLOCK, &mask, NULL ) < 0 )	// SIG_BLOCK ó 
 			unix_error("error: SIG_BLOCK");
 		
+		if (bg && (limit = runlimit()) > 0 && bgrunning(jobs) >= limit) {
+			/* Keep the parsed argv: startjob may run in a handler */
+			if ((argc = packargs(args, argv)) < 0)
+				printf("%s: Argument list too long\n", argv[0]);
+			else if ((jid = addjob(jobs, 0, QU, cmdline)) > 0) {	//    fork  ʰ ⿭ ִ´. 
+				if ((job = getjobjid(jobs, jid)) != NULL) {
+					memcpy(job->args, args, sizeof(args));
+					job->argc = argc;
+				}
+				printf("(%d) (-) %s", jid, cmdline);
+			}
+			
+			if ( sigprocmask( SIG_UNBLOCK, &mask, NULL ) < 0 )
+				unix_error("error: SIG_UNBLOCK");
+			return;
+		}
+		
 		// ñ׳ ŷ  mask ʱȭ  SIGCHLD SIGINT SIGTSTP
 		// ñ׳ BLOCK  Ͻ  tsh ۵Ǵ ñ׳ Ͽ. 
 		// RACE CONDITION ߻ ʵ Ѵ. 
@@ -202,6 +325,7 @@ void eval(char *cmdline)
 		// ߻Ǿ  Jobs ش μ ϵǾ Ƿ  ߻ 
 	
 			
+		capture_pipe(bg, capfds);	// -o ɼ̸ BG job   ޴´. 
 		if((pid=fork()) == 0) {	// fork ڽμ 
 		
 			setpgid(0, 0);	// μ μ ׷ ID Ѵ. 
@@ -212,12 +336,18 @@ void eval(char *cmdline)
 				unix_error("error: SIG_UNBLOCK");
 			//ο ڽ μ ñ׳ Է¹  ֵ UNBLOCK Ѵ. 
 		
+			if (capfds[1] >= 0) {
+				dup2(capfds[1], STDOUT_FILENO);
+				dup2(capfds[1], STDERR_FILENO);
+			}
+			if (!strcmp(argv[0], "cached"))
+				cache_exec(argv);
 			if((execve(argv[0], argv, environ) < 0)) {	// 2° ڴ Ű 
 				printf("%s: Command not found\n", argv[0]);
-				exit(0);
+				exit(1);
 			}
 			// ڽ μ  α׷ execve Ͽ 
-			//   command not found, exit(0) ó 
+			//   command not found, exit(1) ó 
 		}
 		
 		if (!bg) {	// foreground job
@@ -229,13 +359,18 @@ void eval(char *cmdline)
 			
 			waitfg(pid, 1);	//  ڽ μ   ٸ. 
 		} else {	// background job
-			addjob(jobs, pid, BG, cmdline);	// background job job list ߰ 
+			if ((jid = addjob(jobs, pid, BG, cmdline)) > 0)	// background job job list ߰ 
+				capture_start(jid, capfds);
+			else if (capfds[0] >= 0) {	/* no job to capture for */
+				close(capfds[0]);
+				close(capfds[1]);
+			}
 		
 			if ( sigprocmask( SIG_UNBLOCK, &mask, NULL ) < 0 )
 				unix_error("error: SIG_UNBLOCK");
 			// θ μ ñ׳ ó Ҽ ֵ UNBLOCK Ѵ. 
 		
-			printf("(%d) (%d) %s", pid2jid(pid), pid, cmdline);	// background   
+			printf("(%d) (%d) %s", jid, pid, cmdline);	// background   
 		}
 	}	
 	return;
@@ -255,14 +390,27 @@ int builtin_cmd(char **argv)
 	int flag, jid;
 	pid_t pid;
 	struct job_t *job;	
+	sigset_t mask, prev;
 
 	if(!strcmp(cmd, "quit")) {	// quit ɾ Էϸ Ѵ. 
 		exit(0);
 	}
+	else if(!strcmp(cmd, "jobs") && argv[1] && !strcmp(argv[1], "-o")) {	// jobs -o %jid [lines] 
+		if (!argv[2] || argv[2][0] != '%') {
+			printf("jobs: usage: jobs -o %%<jid> [lines]\n");
+			return 1;
+		}
+		capture_dump(atoi(&argv[2][1]), argv[3] ? atoi(argv[3]) : 0, STDOUT_FILENO);
+		return 1;
+	}
 	else if(!strcmp(cmd, "jobs")) {	// jobs ɾ Էϸ joblist Ѵ.
 		listjobs(jobs, STDOUT_FILENO);
 		return 1;
 	}	
+	else if(!strcmp(cmd, "after")) {	// after %1 %2 -- cmd 
+		do_after(argv);
+		return 1;
+	}
 	else if(!strcmp(cmd, "bg") || !strcmp(cmd, "fg")) {	// bg, fg ɾ Է ó 
 	
 		if( !strcmp(cmd, "fg") )	// fg, bg üũϿ flag  
@@ -282,21 +430,45 @@ int builtin_cmd(char **argv)
 			//  job null̸ ش job   ó 
 		}
 
+		if (job->state == PD) {	//  job   job   . 
+			printf("%s: Job is waiting for other jobs\n", argv[1]);
+			return 1;
+		}
+
+		if (job->state == QU) {	//   job fg, bg  ٷ Ѵ. 
+			startjob(job, flag);
+			if (flag == FG)
+				waitfg(job->pid, 1);
+			else
+				printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
+			return 1;
+		}
+
 		pid = job->pid;	//  job μ id pid  
 		jid = job->jid;	//  job job id jid  
 			
+		/*
+		 * Mark the job before continuing it, with SIGCHLD blocked, so a
+		 * job that exits at once cannot be reaped in between and have
+		 * its cleared slot marked again.
+		 */
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGCHLD);
+		sigprocmask(SIG_BLOCK, &mask, &prev);
 		if (flag == BG) {	// BG ɾ Է  
 			if(job->state == ST) {
-				kill(-pid, SIGCONT);	// ߴܵ μ ٽ Ѵ. 
 				job->state = flag;	// ٽ  job state BG ٲش. 
+				kill(-pid, SIGCONT);	// ߴܵ μ ٽ Ѵ. 
 				printf("[%d] (%d) %s",jid,pid,job->cmdline);
 			}
+			sigprocmask(SIG_SETMASK, &prev, NULL);
 		}
 		else if (flag == FG){ // FG ɾ Է  
-			kill(-pid, SIGCONT);	
-			// ߴܵ μ SIGCONT signal  ٽ  
 			job->state = flag;	
 			// ٽ  job state FG ٲپ foreground  
+			kill(-pid, SIGCONT);	
+			// ߴܵ μ SIGCONT signal  ٽ  
+			sigprocmask(SIG_SETMASK, &prev, NULL);
 			waitfg(pid, 1);	//  ڽ  ٸ. 
 		}
 		return 1;
@@ -335,6 +507,238 @@ void waitfg(pid_t pid, int output_fd)
 // Background job ȯ ʾҴ θ ؼ ˻ϸ
 // sleep() Լ ȣϿ ٸ Ѵ.
 
+/*
+ * startjob - Fork and exec a queued job in the given state (FG or BG).
+ *     Safe to call from the SIGCHLD handler: the argv was parsed and
+ *     its globs expanded when the job was queued, so neither the shell
+ *     nor the child parses or allocates anything here.
+ */
+void startjob(struct job_t *job, int state)
+{
+	char *argv[MAXARGS];
+	sigset_t mask, prev;
+	int capfds[2];
+	int i;
+	char *p;
+	pid_t pid;
+
+	for (i = 0, p = job->args; i < job->argc; i++, p += strlen(p) + 1)
+		argv[i] = p;
+	argv[i] = NULL;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTSTP);
+	sigaddset(&mask, SIGIO);
+	sigprocmask(SIG_BLOCK, &mask, &prev);
+
+	capture_pipe(state == BG, capfds);
+	if ((pid = fork()) == 0) {
+		setpgid(0, 0);
+		sigprocmask(SIG_UNBLOCK, &mask, NULL);
+		if (capfds[1] >= 0) {
+			dup2(capfds[1], STDOUT_FILENO);
+			dup2(capfds[1], STDERR_FILENO);
+		}
+		if (!strcmp(argv[0], "cached"))
+			cache_exec(argv);
+		if (execve(argv[0], argv, environ) < 0) {
+			printf("%s: Command not found\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	job->pid = pid;
+	job->state = state;
+	capture_start(job->jid, capfds);
+	if (verbose)
+		printf("Started queued job. [%d] %d %s", job->jid, job->pid, job->cmdline);
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * do_after - Execute the builtin after command:
+ *
+ *     after %<jid> [%<jid> ...] -- cmd [args ...]
+ *
+ *     Registers cmd as a pending background job that the SIGCHLD
+ *     handler releases once every listed job has exited with status 0.
+ *     Listed jobs that have already finished count at once: the job
+ *     fails if one of them failed, and is queued if none is left.
+ */
+void do_after(char **argv)
+{
+	struct job_t *dep, *job;
+	sigset_t mask, prev;
+	char cmdline[MAXLINE];
+	int jids[MAXDEPS];
+	unsigned long deps[MAXDEPS];
+	char args[MAXLINE];
+	int i, k, njids = 0, ndeps = 0, failed = 0, jid, argc;
+
+	for (i = 1; argv[i] && strcmp(argv[i], "--"); i++) {
+		if (argv[i][0] != '%' || njids == MAXDEPS) {
+			printf("after: usage: after %%<jid> ... -- command\n");
+			return;
+		}
+		jids[njids++] = atoi(&argv[i][1]);
+	}
+	if (!argv[i] || !argv[i+1] || njids == 0) {
+		printf("after: usage: after %%<jid> ... -- command\n");
+		return;
+	}
+
+	/* Keep the command's argv for startjob, and a line for jobs */
+	if ((argc = packargs(args, &argv[i+1])) < 0) {
+		printf("after: command line too long\n");
+		return;
+	}
+	cmdline[0] = '\0';
+	for (i++; argv[i]; i++) {
+		if (strlen(cmdline) + strlen(argv[i]) + 4 > MAXLINE) {
+			printf("after: command line too long\n");
+			return;
+		}
+		if (strchr(argv[i], ' '))
+			sprintf(cmdline + strlen(cmdline), "'%s' ", argv[i]);
+		else
+			sprintf(cmdline + strlen(cmdline), "%s ", argv[i]);
+	}
+	cmdline[strlen(cmdline)-1] = '\n';
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &prev);
+
+	for (i = 0; i < njids; i++) {
+		if ((dep = getjobjid(jobs, jids[i])) != NULL) {
+			for (k = 0; k < ndeps; k++)
+				if (deps[k] == dep->seq)
+					break;
+			if (k == ndeps)
+				deps[ndeps++] = dep->seq;
+		} else if (jids[i] >= 1 && jids[i] <= MAXJOBS && done[jids[i]].seq) {
+			if (!done[jids[i]].ok && !failed)
+				failed = jids[i];
+		} else {
+			printf("%%%d: No Such Job\n", jids[i]);
+			sigprocmask(SIG_SETMASK, &prev, NULL);
+			return;
+		}
+	}
+
+	if ((jid = addjob(jobs, 0, PD, cmdline)) > 0
+			&& (job = getjobjid(jobs, jid)) != NULL) {
+		memcpy(job->deps, deps, sizeof(deps));
+		job->ndeps = ndeps;
+		memcpy(job->args, args, sizeof(args));
+		job->argc = argc;
+		printf("(%d) (-) %s", jid, cmdline);
+		if (failed)
+			failjob(job, failed);
+		else if (ndeps == 0) {
+			job->state = QU;
+			startqueued();
+		}
+	}
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * resolvedeps - Tell the pending jobs that job finished, with ok true
+ *     if it exited with status 0, and remember how it ended for after
+ *     commands that name it later.  Only jobs whose jid was printed
+ *     are remembered: a foreground job the user never saw a jid for
+ *     (an ls typed between two afters) must not shadow the background
+ *     job last shown with that jid.  Jobs left with no unfinished
+ *     dependencies become QU and are started by startqueued; on
+ *     failure the dependent job fails as well, and so on down the
+ *     graph.
+ *     Called with SIGCHLD blocked, before job is deleted.
+ */
+void resolvedeps(struct job_t *job, int ok)
+{
+	int i, k;
+
+	if (job == NULL || job->jid < 1)
+		return;
+	if (job->shown) {
+		done[job->jid].seq = job->seq;
+		done[job->jid].ok = ok;
+	}
+	for (i = 0; i < MAXJOBS; i++) {
+		if (jobs[i].state != PD)
+			continue;
+		for (k = 0; k < jobs[i].ndeps; k++)
+			if (jobs[i].deps[k] == job->seq)
+				break;
+		if (k == jobs[i].ndeps)
+			continue;
+
+		if (!ok) {
+			failjob(&jobs[i], job->jid);
+			continue;
+		}
+		jobs[i].deps[k] = jobs[i].deps[--jobs[i].ndeps];
+		if (jobs[i].ndeps == 0)
+			jobs[i].state = QU;
+	}
+}
+
+/*
+ * failjob - Fail pending job because job depjid did not succeed, and
+ *     with it the jobs that wait for it.  Called with SIGCHLD blocked.
+ */
+void failjob(struct job_t *job, int depjid)
+{
+	printf("Job [%d] (-) failed: job [%d] did not succeed\n", job->jid, depjid);
+	resolvedeps(job, 0);
+	clearjob(job);
+	nextjid = maxjid(jobs)+1;
+}
+
+/*
+ * packargs - Copy the strings of argv into buf, one after another,
+ *     so that startjob can rebuild the argv without parsing or
+ *     allocating.  Returns the argument count, or -1 if they don't
+ *     fit in MAXLINE bytes.
+ */
+int packargs(char *buf, char **argv)
+{
+	int argc, len, used = 0;
+
+	for (argc = 0; argv[argc]; argc++) {
+		len = strlen(argv[argc]) + 1;
+		if (used + len > MAXLINE || argc == MAXARGS-1)
+			return -1;
+		memcpy(buf + used, argv[argc], len);
+		used += len;
+	}
+	return argc;
+}
+
+/*
+ * startqueued - Start queued jobs, oldest first, while the number of
+ *     running background jobs is under the admission limit.  The limit
+ *     is read once per call: with -L it costs two /proc reads, and this
+ *     runs in the SIGCHLD handler.
+ */
+void startqueued(void)
+{
+	int i, next, limit = runlimit();
+
+	while (limit == 0 || bgrunning(jobs) < limit) {
+		next = -1;
+		for (i = 0; i < MAXJOBS; i++)
+			if (jobs[i].state == QU && (next < 0 || jobs[i].seq < jobs[next].seq))
+				next = i;
+		if (next < 0)
+			return;
+		startjob(&jobs[next], BG);
+	}
+}
+
 
 /*****************
  * Signal handlers
@@ -352,18 +756,24 @@ void sigchld_handler(int sig)
 
 	int status;
 	pid_t child_pid;
+	struct job_t *job;
 
 	// ڽ μ  Ȥ ߴܵ ¸ óѴ. 
 	while((child_pid = waitpid(-1 ,&status, WNOHANG|WUNTRACED)) > 0){ 
 	// ڽμ   ٸ 
 	
+		capture_drain(&captures[0]);	//  job   од. 
 		if((WIFEXITED(status))>0){
+			resolvedeps(getjobpid(jobs, child_pid), WEXITSTATUS(status) == 0);	//  job    
 			if(!(deletejob(jobs,child_pid)))	// delete job ó 
 				printf("error: delete job\n");
 		}
 		else if((WIFSIGNALED(status))!=0){	// μ  
+			if ((job = getjobpid(jobs, child_pid)) != NULL)
+				job->shown = 1;	/* the message below names its jid */
 			printf("Job [%d] (%d) terminated by signal %d\n",pid2jid(child_pid),child_pid, WTERMSIG(status));
 			// SIGINT 2, SIGTERM 15 ó
+			resolvedeps(getjobpid(jobs, child_pid), 0);	// ñ׳η Ǹ з ó 
 						
 			if(!(deletejob(jobs,child_pid)))	// job list  μ job  
 				printf("error: delete job\n"); 
@@ -371,10 +781,12 @@ void sigchld_handler(int sig)
 		else if((WIFSTOPPED(status))==1){	// μ ߴ 
 			struct job_t* j=getjobpid(jobs,child_pid);
 			j->state=ST;	// state ST· ٲ۴. 
+			j->shown=1;	/* the message below names its jid */
 			printf("Job [%d] (%d) stopped by signal %d\n",pid2jid(child_pid),child_pid, WSTOPSIG(status));
 			// SIGTST 20 ó 
 		}
 	}
+	startqueued();	// ȸ job  Կ   job Ѵ. 
 	return;
 }
 // ڽ μ ǰų ߴܵǸ Ŀ θ μ SIGCHLD ñ׳ Ѵ. 
@@ -388,7 +800,18 @@ void sigchld_handler(int sig)
 // WIFSIGNALED ñ׳  ؼ ڽμ Ǿٰ Ǵ  true Ѵ. 
 // WIFSTOPPED ڽ μ   ¶ true Ѵ. 
 
-/* 
+/*
+ * sigio_handler - The kernel sends a SIGIO to the shell whenever a
+ *     background job writes to its capture pipe.  Move everything
+ *     available into the job's ring buffer so the job never blocks.
+ */
+void sigio_handler(int sig)
+{
+	capture_drain(&captures[0]);
+	return;
+}
+
+/*
  * sigint_handler - The kernel sends a SIGINT to the shell whenver the
  *    user types ctrl-c at the keyboard.  Catch it and send it along
  *    to the foreground job.  
@@ -448,6 +871,8 @@ int parseline(const char *cmdline, char **argv)
 	char *delim;                /* points to first space delimiter */
 	int argc;                   /* number of args */
 	int bg;                     /* background job? */
+	int quoted[MAXARGS];        /* was argv[i] in single quotes? */
+	int q;
 
 	strcpy(buf, cmdline);
 	buf[strlen(buf)-1] = ' '; /* replace trailing '\n' with space */
@@ -459,12 +884,15 @@ int parseline(const char *cmdline, char **argv)
 	if (*buf == '\'') {
 		buf++;
 		delim = strchr(buf, '\'');
+		q = 1;
 	}
 	else {
 		delim = strchr(buf, ' ');
+		q = 0;
 	}
 
 	while (delim) {
+		quoted[argc] = q;
 		argv[argc++] = buf;
 		*delim = '\0';
 		buf = delim + 1;
@@ -474,12 +902,15 @@ int parseline(const char *cmdline, char **argv)
 		if (*buf == '\'') {
 			buf++;
 			delim = strchr(buf, '\'');
+			q = 1;
 		}
 		else {
 			delim = strchr(buf, ' ');
+			q = 0;
 		}
 	} 
 
+	argc = expandglobs(argv, argc, quoted);
 	argv[argc] = NULL;
 
 	if (argc == 0)  /* ignore blank line */
@@ -493,6 +924,228 @@ int parseline(const char *cmdline, char **argv)
 
 }
 
+/*
+ * expandglobs - Replace each unquoted argument containing *, ? or [
+ *     by the sorted names matching it, or leave it alone if nothing
+ *     matches.  Only the last path component may contain wildcards.
+ *     The names live in a static pool that the next call reuses, like
+ *     parseline's own buffer.  Returns the new argc.
+ */
+int expandglobs(char **argv, int argc, int *quoted)
+{
+	static char pool[GLOBPOOL];
+	static int *matches = NULL;
+	static int matchcap = 0;
+	char *out[MAXARGS];
+	char dir[MAXLINE];
+	char *pat, *slash, *name;
+	struct dircache_t *dc;
+	int i, k, nout = 0, nmatch, used = 0, plen, len;
+
+	for (i = 0; i < argc; i++) {
+		if (quoted[i] || !strpbrk(argv[i], "*?[")
+				|| ((slash = strrchr(argv[i], '/')) != NULL
+					&& strcspn(argv[i], "*?[") < (size_t)(slash - argv[i]))) {
+			if (nout < MAXARGS-1)
+				out[nout++] = argv[i];
+			continue;
+		}
+
+		/* Split into the directory to read and the pattern to match */
+		if (slash) {
+			plen = slash - argv[i] + 1;
+			snprintf(dir, MAXLINE, "%.*s", plen > 1 ? plen - 1 : 1, argv[i]);
+			pat = slash + 1;
+		}
+		else {
+			plen = 0;
+			strcpy(dir, ".");
+			pat = argv[i];
+		}
+
+		nmatch = 0;
+		if ((dc = readdircache(dir)) != NULL) {
+			if (matchcap < dc->n) {
+				matchcap = dc->n;
+				if ((matches = realloc(matches, matchcap * sizeof(int))) == NULL)
+					unix_error("realloc error");
+			}
+			for (k = 0; k < dc->n; k++) {
+				name = dc->names + dc->offs[k];
+				if (name[0] == '.' && pat[0] != '.')	/* hidden unless asked */
+					continue;
+				if (globmatch(pat, name))
+					matches[nmatch++] = dc->offs[k];
+			}
+			qsort_r(matches, nmatch, sizeof(int), globcmp, dc->names);
+		}
+
+		if (nmatch == 0) {
+			if (nout < MAXARGS-1)
+				out[nout++] = argv[i];
+			continue;
+		}
+		for (k = 0; k < nmatch; k++) {
+			name = dc->names + matches[k];
+			len = plen + strlen(name) + 1;
+			if (nout == MAXARGS-1 || used + len > GLOBPOOL) {
+				printf("%s: Too many matches\n", argv[i]);
+				break;
+			}
+			memcpy(pool + used, argv[i], plen);
+			strcpy(pool + used + plen, name);
+			out[nout++] = pool + used;
+			used += len;
+		}
+	}
+
+	memcpy(argv, out, nout * sizeof(char *));
+	return nout;
+}
+
+/*
+ * readdircache - Return the listing of directory path, reading it
+ *     with getdents64 only if it is not cached or changed since it
+ *     was read.  Returns NULL if the directory can't be read.
+ */
+struct dircache_t *readdircache(const char *path)
+{
+	static unsigned long clock = 0;
+	struct linux_dirent64 {
+		uint64_t d_ino;
+		int64_t d_off;
+		unsigned short d_reclen;
+		unsigned char d_type;
+		char d_name[];
+	} *de;
+	char buf[32768];
+	struct dircache_t *dc = NULL;
+	struct stat st;
+	int i, fd, n, pos, len;
+
+	if ((fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	clock++;
+	for (i = 0; i < DIRCACHE; i++) {
+		if (!strcmp(dircache[i].path, path)) {
+			dc = &dircache[i];
+			break;
+		}
+		if (!dc || dircache[i].used < dc->used)
+			dc = &dircache[i];
+	}
+	dc->used = clock;
+	if (!strcmp(dc->path, path) && dc->dev == st.st_dev && dc->ino == st.st_ino
+			&& dc->mtime.tv_sec == st.st_mtim.tv_sec
+			&& dc->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+		close(fd);
+		return dc;
+	}
+
+	/* (Re)read the directory into the slot's buffers */
+	snprintf(dc->path, MAXLINE, "%s", path);
+	dc->dev = st.st_dev;
+	dc->ino = st.st_ino;
+	dc->mtime = st.st_mtim;
+	dc->n = 0;
+	pos = 0;
+	while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < n; i += de->d_reclen) {
+			de = (struct linux_dirent64 *)(buf + i);
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+				continue;
+			len = strlen(de->d_name) + 1;
+			if (pos + len > dc->namecap) {
+				dc->namecap = (pos + len) * 2;
+				if ((dc->names = realloc(dc->names, dc->namecap)) == NULL)
+					unix_error("realloc error");
+			}
+			if (dc->n == dc->offcap) {
+				dc->offcap = dc->offcap ? dc->offcap * 2 : 256;
+				if ((dc->offs = realloc(dc->offs, dc->offcap * sizeof(int))) == NULL)
+					unix_error("realloc error");
+			}
+			memcpy(dc->names + pos, de->d_name, len);
+			dc->offs[dc->n++] = pos;
+			pos += len;
+		}
+	}
+	close(fd);
+	if (n < 0) {
+		dc->path[0] = '\0';
+		return NULL;
+	}
+	return dc;
+}
+
+/*
+ * globmatch - Return true if name matches the glob pattern pat (*, ?,
+ *     [abc], [a-z], [!abc]).  When a match fails after a *, only the
+ *     most recent * is retried one character further, so the time is
+ *     bounded by the product of the lengths instead of growing
+ *     exponentially with the number of stars.
+ */
+int globmatch(const char *pat, const char *name)
+{
+	const char *p = pat, *n = name;
+	const char *star = NULL, *restart = NULL;
+	const char *q;
+	int neg, ok;
+
+	while (*n) {
+		if (*p == '*') {
+			star = ++p;
+			restart = n;
+			continue;
+		}
+		if (*p == '[' && p[1] && strchr(p + 2, ']')) {
+			q = p + 1;
+			neg = (*q == '!' || *q == '^');
+			if (neg)
+				q++;
+			ok = 0;
+			do {
+				if (q[1] == '-' && q[2] && q[2] != ']') {
+					if ((unsigned char)*n >= (unsigned char)q[0]
+							&& (unsigned char)*n <= (unsigned char)q[2])
+						ok = 1;
+					q += 3;
+				}
+				else if (*q++ == *n)
+					ok = 1;
+			} while (*q && *q != ']');
+			if (*q == ']' && ok != neg) {
+				p = q + 1;
+				n++;
+				continue;
+			}
+		}
+		else if (*p && (*p == '?' || *p == *n)) {
+			p++;
+			n++;
+			continue;
+		}
+		if (!star)
+			return 0;
+		p = star;
+		n = ++restart;
+	}
+	while (*p == '*')
+		p++;
+	return *p == '\0';
+}
+
+/* globcmp - qsort_r comparator for offsets into a dircache name buffer */
+int globcmp(const void *a, const void *b, void *names)
+{
+	return strcmp((char *)names + *(const int *)a, (char *)names + *(const int *)b);
+}
+
 /***********************************************
  * Helper routines that manipulate the job list
  **********************************************/
@@ -510,7 +1163,10 @@ void clearjob(struct job_t *job) {
 	job->pid = 0;
 	job->jid = 0;
 	job->state = UNDEF;
+	job->seq = 0;
+	job->shown = 0;
 	job->cmdline[0] = '\0';
+	job->ndeps = 0;
 }
 
 
@@ -525,26 +1181,28 @@ int maxjid(struct job_t *jobs)
 	return max;
 }
 
-/* addjob - Add a job to the job list */
+/* addjob - Add a job to the job list. Returns its jid, or 0 if it wasn't added */
 int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) 
 {
 	int i;
 
-	if (pid < 1)
+	if (pid < 1 && state != QU && state != PD)
 		return 0;
 
 	for (i = 0; i < MAXJOBS; i++) {
-		if (jobs[i].pid == 0) {
+		if (jobs[i].state == UNDEF) {
 			jobs[i].pid = pid;
 			jobs[i].state = state;
 			jobs[i].jid = nextjid++;
+			jobs[i].seq = nextseq++;
+			jobs[i].shown = (state != FG);
 			if (nextjid > MAXJOBS)
 				nextjid = 1;
 			strcpy(jobs[i].cmdline, cmdline);
 			if(verbose){
 				printf("Added job. [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
 			}
-			return 1;
+			return jobs[i].jid;
 		}
 	}
 	printf("Tried to create too many jobs\n");
@@ -569,6 +1227,16 @@ int deletejob(struct job_t *jobs, pid_t pid)
 	return 0;
 }
 
+/* bgrunning - Return the number of running background jobs */
+int bgrunning(struct job_t *jobs) {
+	int i, n = 0;
+
+	for (i = 0; i < MAXJOBS; i++)
+		if (jobs[i].state == BG)
+			n++;
+	return n;
+}
+
 /* fgpid - Return PID of current foreground job, 0 if no such job */
 pid_t fgpid(struct job_t *jobs) {
 	int i;
@@ -626,8 +1294,11 @@ void listjobs(struct job_t *jobs, int output_fd)
 
 	for (i = 0; i < MAXJOBS; i++) {
 		memset(buf, '\0', MAXLINE);
-		if (jobs[i].pid != 0) {
-			sprintf(buf, "(%d) (%d) ", jobs[i].jid, jobs[i].pid);
+		if (jobs[i].state != UNDEF) {
+			if (jobs[i].state == QU || jobs[i].state == PD)
+				sprintf(buf, "(%d) (-) ", jobs[i].jid);
+			else
+				sprintf(buf, "(%d) (%d) ", jobs[i].jid, jobs[i].pid);
 			if(write(output_fd, buf, strlen(buf)) < 0) {
 				fprintf(stderr, "Error writing to output file\n");
 				exit(1);
@@ -643,6 +1314,12 @@ void listjobs(struct job_t *jobs, int output_fd)
 				case ST:
 					sprintf(buf, "Stopped ");
 					break;
+				case QU:
+					sprintf(buf, "Queued ");
+					break;
+				case PD:
+					sprintf(buf, "Pending ");
+					break;
 				default:
 					sprintf(buf, "listjobs: Internal error: job[%d].state=%d ",
 							i, jobs[i].state);
@@ -671,15 +1348,505 @@ void listjobs(struct job_t *jobs, int output_fd)
  * Other helper routines
  ***********************/
 
+/*
+ * runlimit - Return how many background jobs may run at once, 0 if
+ *     unlimited.  With -L the limit is the number of CPUs left idle
+ *     by the 1-minute load average, scaled down by the share of time
+ *     tasks were stalled on the CPU (PSI "some avg10"), and capped by
+ *     -l if given.  At least one job is always admitted.
+ */
+int runlimit(void)
+{
+	char buf[MAXLINE];
+	char *p;
+	double load = 0.0, stall = 0.0;
+	int limit;
+
+	if (!loadlimit)
+		return maxrunning;
+
+	if (readfile("/proc/loadavg", buf, MAXLINE) > 0)
+		load = strtod(buf, NULL);
+	if (readfile("/proc/pressure/cpu", buf, MAXLINE) > 0
+			&& (p = strstr(buf, "avg10=")) != NULL)
+		stall = strtod(p + 6, NULL);
+
+	limit = (int)((sysconf(_SC_NPROCESSORS_ONLN) - load) * (100.0 - stall) / 100.0);
+	if (maxrunning > 0 && limit > maxrunning)
+		limit = maxrunning;
+	return limit < 1 ? 1 : limit;
+}
+
+/*
+ * readfile - Read up to size-1 bytes of a small file into buf and
+ *     null-terminate it.  Returns the number of bytes read, -1 on error.
+ */
+int readfile(const char *path, char *buf, int size)
+{
+	int fd, n;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	n = read(fd, buf, size - 1);
+	close(fd);
+	if (n < 0)
+		return -1;
+	buf[n] = '\0';
+	return n;
+}
+
+/*
+ * capture_pipe - With -o, create the pipe a BG job's stdout and stderr
+ *     are sent to.  fds is set to -1s when output is not captured.
+ */
+int capture_pipe(int bg, int *fds)
+{
+	fds[0] = fds[1] = -1;
+	if (!bg || capsize <= 0)
+		return 0;
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		fds[0] = fds[1] = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * capture_start - Attach the read end of a capture pipe to job jid.
+ *     The ring lives in a memfd so its size stays fixed at capsize
+ *     bytes no matter how much the job writes.  Any ring left by an
+ *     earlier job with the same jid is released.  If every slot is in
+ *     use, the ring of the job that finished and was started longest
+ *     ago goes; jids wrap, so the smallest jid need not be the oldest.
+ */
+void capture_start(int jid, int *fds)
+{
+	struct capture_t *cap = NULL;
+	char name[MAXLINE];
+	int i, memfd;
+
+	if (fds[0] < 0)
+		return;
+	close(fds[1]);
+
+	for (i = 0; i < MAXJOBS; i++)
+		if (captures[i].jid == jid || (!cap && captures[i].jid == 0))
+			cap = &captures[i];
+	if (cap == NULL) {	/* evict the oldest finished job's ring */
+		for (i = 0; i < MAXJOBS; i++)
+			if (getjobjid(jobs, captures[i].jid) == NULL
+					&& (!cap || captures[i].seq < cap->seq))
+				cap = &captures[i];
+	}
+	if (cap == NULL) {	/* no job has finished: the oldest ring goes */
+		for (i = 0, cap = &captures[0]; i < MAXJOBS; i++)
+			if (captures[i].seq < cap->seq)
+				cap = &captures[i];
+	}
+	if (cap->jid != 0) {
+		if (cap->fd >= 0)
+			close(cap->fd);
+		munmap(cap->ring, capsize);
+		cap->jid = 0;
+	}
+
+	sprintf(name, "tsh-job-%d", jid);
+	if ((memfd = memfd_create(name, MFD_CLOEXEC)) < 0 || ftruncate(memfd, capsize) < 0
+			|| (cap->ring = mmap(NULL, capsize, PROT_READ|PROT_WRITE, MAP_SHARED, memfd, 0)) == MAP_FAILED) {
+		printf("capture: %s\n", strerror(errno));
+		if (memfd >= 0)
+			close(memfd);
+		close(fds[0]);
+		return;
+	}
+	close(memfd);	/* the mapping keeps the memory alive */
+
+	fcntl(fds[0], F_SETOWN, getpid());
+	fcntl(fds[0], F_SETFL, O_NONBLOCK | O_ASYNC);
+	cap->total = 0;
+	cap->seq = nextcapseq++;
+	cap->fd = fds[0];
+	cap->jid = jid;
+	capture_drain(cap);	/* output written before O_ASYNC was set */
+}
+
+/*
+ * capture_drain - Read whatever is pending on the capture pipes from
+ *     cap to the end of the table into their rings, wrapping around
+ *     and overwriting the oldest bytes.
+ */
+void capture_drain(struct capture_t *cap)
+{
+	char buf[MAXLINE];
+	int n, off, len;
+
+	for (; cap < &captures[MAXJOBS]; cap++) {
+		if (cap->jid == 0 || cap->fd < 0)
+			continue;
+		while ((n = read(cap->fd, buf, MAXLINE)) > 0) {
+			for (off = 0; off < n; off += len) {
+				len = capsize - (int)(cap->total % capsize);
+				if (len > n - off)
+					len = n - off;
+				memcpy(cap->ring + cap->total % capsize, buf + off, len);
+				cap->total += len;
+			}
+		}
+		if (n == 0) {	/* every writer is gone */
+			close(cap->fd);
+			cap->fd = -1;
+		}
+	}
+}
+
+/*
+ * capture_dump - Write the captured output of job jid to output_fd,
+ *     only its last lines lines if lines > 0.
+ */
+void capture_dump(int jid, int lines, int output_fd)
+{
+	struct capture_t *cap = NULL;
+	sigset_t mask, prev;
+	char *buf;
+	int i, start, len;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGIO);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &prev);
+	capture_drain(&captures[0]);
+
+	for (i = 0; i < MAXJOBS; i++)
+		if (captures[i].jid == jid && jid > 0)
+			cap = &captures[i];
+	if (cap == NULL) {
+		printf("%%%d: No captured output\n", jid);
+		sigprocmask(SIG_SETMASK, &prev, NULL);
+		return;
+	}
+
+	/* Unroll the ring so the output is contiguous */
+	len = cap->total < (unsigned long)capsize ? (int)cap->total : capsize;
+	start = cap->total < (unsigned long)capsize ? 0 : (int)(cap->total % capsize);
+	if ((buf = malloc(len + 1)) == NULL)
+		unix_error("malloc error");
+	memcpy(buf, cap->ring + start, len - start);
+	memcpy(buf + len - start, cap->ring, start);
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+
+	start = 0;
+	if (lines > 0)
+		for (start = len; start > 0; start--)
+			if (buf[start-1] == '\n' && start != len && --lines == 0)
+				break;
+
+	fflush(stdout);
+	if (write(output_fd, buf + start, len - start) < 0) {
+		fprintf(stderr, "Error writing to output file\n");
+		exit(1);
+	}
+	free(buf);
+}
+
+/*
+ * cache_key - Parse the prefix of a cached command line:
+ *
+ *     cached [-e VAR]... [-i FILE]... cmd [args ...]
+ *
+ *     and hash (64-bit FNV-1a) the working directory, cmd and its
+ *     args, the values of the -e variables, and the inode, size and
+ *     mtime of the -i files.  Returns the index of cmd in argv, or -1
+ *     on a usage error.
+ */
+int cache_key(char **argv, unsigned long long *key)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	char cwd[MAXLINE];
+	struct stat st;
+	char *p, *val;
+	int i, k, cmd;
+
+#define HASH(ptr, len) \
+	for (p = (char *)(ptr), k = 0; k < (int)(len); k++) \
+		h = (h ^ (unsigned char)p[k]) * 1099511628211ULL
+
+	for (cmd = 1; argv[cmd] && argv[cmd][0] == '-'
+			&& (!strcmp(argv[cmd], "-e") || !strcmp(argv[cmd], "-i")); cmd += 2)
+		if (!argv[cmd+1])
+			return -1;
+	if (!argv[cmd])
+		return -1;
+
+	if (getcwd(cwd, MAXLINE) != NULL)
+		HASH(cwd, strlen(cwd) + 1);
+	for (i = cmd; argv[i]; i++)
+		HASH(argv[i], strlen(argv[i]) + 1);
+	for (i = 1; i < cmd; i += 2) {
+		HASH(argv[i+1], strlen(argv[i+1]) + 1);
+		if (argv[i][1] == 'e') {
+			if ((val = getenv(argv[i+1])) != NULL)
+				HASH(val, strlen(val) + 1);
+		}
+		else if (stat(argv[i+1], &st) == 0) {
+			HASH(&st.st_ino, sizeof(st.st_ino));
+			HASH(&st.st_size, sizeof(st.st_size));
+			HASH(&st.st_mtim, sizeof(st.st_mtim));
+		}
+	}
+#undef HASH
+
+	*key = h;
+	return cmd;
+}
+
+/*
+ * cache_path - Name of the store entry for key in $TSH_CACHE_DIR
+ *     (default $HOME/.tsh_cache).  A null key names the directory.
+ */
+void cache_path(char *buf, unsigned long long key, const char *suffix)
+{
+	char *dir;
+
+	if ((dir = getenv("TSH_CACHE_DIR")) != NULL)
+		snprintf(buf, MAXLINE, "%s", dir);
+	else
+		snprintf(buf, MAXLINE, "%s/.tsh_cache", getenv("HOME") ? getenv("HOME") : ".");
+	if (key)
+		snprintf(buf + strlen(buf), MAXLINE - strlen(buf), "/%016llx%s", key, suffix);
+}
+
+/*
+ * cache_replay - If the store has an entry for a cached command line,
+ *     write its stdout and stderr back and mark it recently used.
+ *     Returns 1 if the command was handled (replayed or rejected), 0
+ *     if it has to be run.
+ *
+ *     An entry is a header line "<status> <outlen> <errlen>" followed
+ *     by the stdout bytes and then the stderr bytes.
+ */
+int cache_replay(char **argv)
+{
+	unsigned long long key;
+	char path[MAXLINE], header[64];
+	int fd, n, status;
+	long outlen, errlen;
+
+	if (cache_key(argv, &key) < 0) {
+		printf("cached: usage: cached [-e VAR]... [-i FILE]... command\n");
+		return 1;
+	}
+	cache_path(path, key, "");
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+
+	n = read(fd, header, sizeof(header) - 1);
+	header[n > 0 ? n : 0] = '\0';
+	if (sscanf(header, "%d %ld %ld", &status, &outlen, &errlen) != 3) {
+		close(fd);
+		return 0;
+	}
+	lseek(fd, strchr(header, '\n') - header + 1, SEEK_SET);
+
+	fflush(stdout);
+	copyfd(fd, STDOUT_FILENO, outlen);
+	copyfd(fd, STDERR_FILENO, errlen);
+	close(fd);
+	utimensat(AT_FDCWD, path, NULL, 0);	/* LRU order is by mtime */
+	if (verbose)
+		printf("cached: replayed %016llx (status %d)\n", key, status);
+	return 1;
+}
+
+/*
+ * cache_exec - Child side of a cached job that missed the store.  Run
+ *     the command with its output going to temporary files, record the
+ *     entry if it exited normally, replay the output, and exit with
+ *     the command's status.  Never returns.  Exits with _exit so that
+ *     stdio cleanup cannot move the offset of the stdin it shares with
+ *     the shell.
+ *
+ *     The shell's handlers are dropped first: the job's own child is
+ *     not in the job list, and this process must reap it itself.  When
+ *     the command stops on its own, this process stops with it, so the
+ *     shell sees the job stop; it is continued again on fg or bg.
+ *     Temporaries carry the pid, so concurrent misses on the same
+ *     command don't share them.
+ */
+void cache_exec(char **argv)
+{
+	unsigned long long key;
+	char path[MAXLINE], outpath[MAXLINE], errpath[MAXLINE], tmppath[MAXLINE];
+	char suffix[32];
+	struct stat outst, errst;
+	int cmd, outfd, errfd, fd, status;
+	pid_t pid;
+	FILE *fp;
+
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTSTP, SIG_DFL);
+
+	if ((cmd = cache_key(argv, &key)) < 0)
+		_exit(1);
+	cache_path(path, 0, "");
+	mkdir(path, 0700);
+	cache_path(path, key, "");
+	sprintf(suffix, ".%d.out", (int)getpid());
+	cache_path(outpath, key, suffix);
+	sprintf(suffix, ".%d.err", (int)getpid());
+	cache_path(errpath, key, suffix);
+	if ((outfd = open(outpath, O_RDWR|O_CREAT|O_TRUNC, 0600)) < 0
+			|| (errfd = open(errpath, O_RDWR|O_CREAT|O_TRUNC, 0600)) < 0) {
+		/* No store: just run the command */
+		execve(argv[cmd], &argv[cmd], environ);
+		printf("%s: Command not found\n", argv[cmd]);
+		fflush(stdout);
+		_exit(1);
+	}
+
+	if ((pid = fork()) == 0) {
+		dup2(outfd, STDOUT_FILENO);
+		dup2(errfd, STDERR_FILENO);
+		if (execve(argv[cmd], &argv[cmd], environ) < 0) {
+			printf("%s: Command not found\n", argv[cmd]);
+			fflush(stdout);
+			_exit(1);
+		}
+	}
+	if (pid < 0) {
+		unlink(outpath);
+		unlink(errpath);
+		_exit(1);
+	}
+	while (1) {
+		if (waitpid(pid, &status, WUNTRACED|WCONTINUED) < 0) {
+			if (errno == EINTR)
+				continue;
+			unlink(outpath);
+			unlink(errpath);
+			_exit(1);
+		}
+		if (WIFCONTINUED(status))
+			continue;
+		if (!WIFSTOPPED(status))
+			break;
+		/* Stop too, unless the shell has already continued the job */
+		if (waitpid(pid, &fd, WCONTINUED|WNOHANG) == 0) {
+			raise(SIGSTOP);
+			kill(pid, SIGCONT);
+		}
+	}
+
+	lseek(outfd, 0, SEEK_SET);
+	lseek(errfd, 0, SEEK_SET);
+	fstat(outfd, &outst);
+	fstat(errfd, &errst);
+	copyfd(outfd, STDOUT_FILENO, outst.st_size);
+	copyfd(errfd, STDERR_FILENO, errst.st_size);
+
+	if (WIFEXITED(status) && outst.st_size + errst.st_size < cachemax) {
+		sprintf(suffix, ".%d.tmp", (int)getpid());
+		cache_path(tmppath, key, suffix);
+		if ((fd = open(tmppath, O_WRONLY|O_CREAT|O_TRUNC, 0600)) >= 0) {
+			fp = fdopen(fd, "w");
+			fprintf(fp, "%d %ld %ld\n", WEXITSTATUS(status),
+					(long)outst.st_size, (long)errst.st_size);
+			fflush(fp);
+			lseek(outfd, 0, SEEK_SET);
+			lseek(errfd, 0, SEEK_SET);
+			copyfd(outfd, fd, outst.st_size);
+			copyfd(errfd, fd, errst.st_size);
+			fclose(fp);
+			rename(tmppath, path);
+			cache_evict();
+		}
+	}
+	unlink(outpath);
+	unlink(errpath);
+
+	if (WIFSIGNALED(status)) {
+		signal(WTERMSIG(status), SIG_DFL);
+		raise(WTERMSIG(status));
+	}
+	_exit(WEXITSTATUS(status));
+}
+
+/*
+ * cache_evict - Delete the least recently used store entries until
+ *     the store is no larger than cachemax bytes.
+ */
+void cache_evict(void)
+{
+	char dir[MAXLINE], path[MAXLINE + 256], oldest[MAXLINE + 256];
+	struct dirent *de;
+	struct stat st;
+	time_t oldtime;
+	long total, oldsize;
+	DIR *dp;
+
+	cache_path(dir, 0, "");
+	while (1) {
+		if ((dp = opendir(dir)) == NULL)
+			return;
+		total = 0;
+		oldest[0] = '\0';
+		oldtime = 0;
+		oldsize = 0;
+		while ((de = readdir(dp)) != NULL) {
+			if (strlen(de->d_name) != 16)	/* entries only, not temporaries */
+				continue;
+			snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+			if (stat(path, &st) < 0)
+				continue;
+			total += st.st_size;
+			if (!oldest[0] || st.st_mtime < oldtime) {
+				strcpy(oldest, path);
+				oldtime = st.st_mtime;
+				oldsize = st.st_size;
+			}
+		}
+		closedir(dp);
+		if (total <= cachemax || !oldest[0] || unlink(oldest) < 0)
+			return;
+		if (verbose)
+			printf("cached: evicted %s (%ld bytes)\n", oldest, oldsize);
+	}
+}
+
+/*
+ * copyfd - Copy len bytes from descriptor from to descriptor to.
+ *     Returns the number of bytes copied.
+ */
+int copyfd(int from, int to, long len)
+{
+	char buf[MAXLINE];
+	long done = 0;
+	int n;
+
+	while (done < len) {
+		n = read(from, buf, len - done < MAXLINE ? len - done : MAXLINE);
+		if (n <= 0)
+			break;
+		if (write(to, buf, n) < 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
 /*
  * usage - print a help message
  */
 void usage(void) 
 {
-	printf("Usage; shell [-hvp]\n");
+	printf("Usage; shell [-hvp] [-l <n>] [-L] [-o <bytes>] [-c <bytes>]\n");
 	printf("   -h   print this message\n");
 	printf("   -v   print additional diagnostic information \n");
 	printf("   -p   do not emit a command prompt \n");
+	printf("   -l   run at most <n> background jobs, queue the rest \n");
+	printf("   -L   limit background jobs by system load and CPU pressure \n");
+	printf("   -o   capture background job output in <bytes> rings (jobs -o %%jid) \n");
+	printf("   -c   cap the cached command store at <bytes> (default 16M) \n");
 	exit(1);
 }
 
@@ -710,6 +1877,7 @@ handler_t *Signal(int signum, handler_t *handler)
 
 	action.sa_handler = handler;  
 	sigemptyset(&action.sa_mask); /* block sigs of type being handled */
+	sigaddset(&action.sa_mask, SIGIO); /* and SIGIO, which drains the capture rings */
 	action.sa_flags = SA_RESTART; /* restart syscalls if possible */
 
 	if (sigaction(signum, &action, &old_action) < 0)
@@ -0,0 +1,374 @@
+/*
+ * vtime.c - Virtual time for runtrace -w, preloaded into the shell
+ *
+ * runtrace -w <factor> puts this library in LD_PRELOAD, so the shell,
+ * fork.c's wrapper, and every job inherit it. Each wall clock the
+ * processes can read runs factor times faster than real time, and
+ * every way they have of waiting for time to pass is shortened to
+ * match: alarm and ITIMER_REAL, sleep, usleep, nanosleep,
+ * clock_nanosleep, and the timeouts of select, pselect, poll, ppoll
+ * and epoll_wait. A 4-second alarm(JOB_TIMEOUT) at factor 10 fires
+ * after 0.4 real seconds, while runtrace divides its own timeouts by
+ * the same factor, so the order in which things time out is kept.
+ *
+ * runtrace passes the factor and the moment virtual time starts in
+ * VTIME="<factor> <monotonic ns> <realtime ns>". Every process scales
+ * around that same origin, so they all agree on what time it is.
+ * Without VTIME, the library changes nothing.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+
+#define NSEC 1000000000LL
+
+static double warp = 1.0;        /* virtual seconds per real second */
+static long long mono0, real0;   /* origin of virtual time, ns */
+
+/* The functions being wrapped */
+static int (*real_clock_gettime)(clockid_t, struct timespec *);
+static int (*real_nanosleep)(const struct timespec *, struct timespec *);
+static int (*real_clock_nanosleep)(clockid_t, int, const struct timespec *,
+				   struct timespec *);
+static int (*real_setitimer)(int, const struct itimerval *,
+			     struct itimerval *);
+static int (*real_getitimer)(int, struct itimerval *);
+static int (*real_select)(int, fd_set *, fd_set *, fd_set *,
+			  struct timeval *);
+static int (*real_pselect)(int, fd_set *, fd_set *, fd_set *,
+			   const struct timespec *, const sigset_t *);
+static int (*real_ppoll)(struct pollfd *, nfds_t, const struct timespec *,
+			 const sigset_t *);
+static int (*real_epoll_wait)(int, struct epoll_event *, int, int);
+
+/*
+ * vtime_init - Find the real functions and read VTIME. Runs before
+ *     main, but the wrappers also call it in case another library's
+ *     constructor gets to them first.
+ */
+__attribute__((constructor))
+static void vtime_init(void)
+{
+    static int done = 0;
+    char *str;
+    double f;
+    long long m, r;
+
+    if (done)
+	return;
+    real_clock_gettime = dlsym(RTLD_NEXT, "clock_gettime");
+    real_nanosleep = dlsym(RTLD_NEXT, "nanosleep");
+    real_clock_nanosleep = dlsym(RTLD_NEXT, "clock_nanosleep");
+    real_setitimer = dlsym(RTLD_NEXT, "setitimer");
+    real_getitimer = dlsym(RTLD_NEXT, "getitimer");
+    real_select = dlsym(RTLD_NEXT, "select");
+    real_pselect = dlsym(RTLD_NEXT, "pselect");
+    real_ppoll = dlsym(RTLD_NEXT, "ppoll");
+    real_epoll_wait = dlsym(RTLD_NEXT, "epoll_wait");
+    done = 1;
+
+    if ((str = getenv("VTIME")) == NULL)
+	return;
+    if (sscanf(str, "%lf %lld %lld", &f, &m, &r) != 3 || f <= 0) {
+	fprintf(stderr, "vtime: ignoring bad VTIME '%s'\n", str);
+	return;
+    }
+    warp = f;
+    mono0 = m;
+    real0 = r;
+}
+
+/*
+ * Conversions between nanosecond counts, timespecs and timevals.
+ * Durations shrink by warp on the way to the kernel and grow by it
+ * on the way back.
+ */
+static long long ts_ns(const struct timespec *ts)
+{
+    return ts->tv_sec * NSEC + ts->tv_nsec;
+}
+
+static struct timespec ns_ts(long long ns)
+{
+    struct timespec ts;
+
+    if (ns < 0)
+	ns = 0;
+    ts.tv_sec = ns / NSEC;
+    ts.tv_nsec = ns % NSEC;
+    return ts;
+}
+
+static long long tv_ns(const struct timeval *tv)
+{
+    return tv->tv_sec * NSEC + tv->tv_usec * 1000LL;
+}
+
+static struct timeval ns_tv(long long ns)
+{
+    struct timeval tv;
+
+    if (ns < 0)
+	ns = 0;
+    tv.tv_sec = ns / NSEC;
+    tv.tv_usec = (ns % NSEC) / 1000;
+    return tv;
+}
+
+static long long to_real(long long ns)
+{
+    return (long long)(ns / warp);
+}
+
+static long long to_virtual(long long ns)
+{
+    return (long long)(ns * warp);
+}
+
+/*
+ * origin - Where virtual time starts on clock clk, or -1 if clk is
+ *     not a wall clock (the CPU-time clocks keep running at real speed)
+ */
+static int origin(clockid_t clk, long long *base)
+{
+    switch (clk) {
+    case CLOCK_REALTIME:
+    case CLOCK_REALTIME_COARSE:
+    case CLOCK_TAI:
+	*base = real0;
+	return 0;
+    case CLOCK_MONOTONIC:
+    case CLOCK_MONOTONIC_COARSE:
+    case CLOCK_MONOTONIC_RAW:
+    case CLOCK_BOOTTIME:
+	*base = mono0;
+	return 0;
+    default:
+	return -1;
+    }
+}
+
+/*
+ * Reading the clocks
+ */
+int clock_gettime(clockid_t clk, struct timespec *ts)
+{
+    long long base;
+    int rc;
+
+    vtime_init();
+    if ((rc = real_clock_gettime(clk, ts)) < 0 || warp == 1.0
+	|| origin(clk, &base) < 0)
+	return rc;
+    *ts = ns_ts(base + to_virtual(ts_ns(ts) - base));
+    return 0;
+}
+
+int gettimeofday(struct timeval *tv, void *tz)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    tv->tv_sec = ts.tv_sec;
+    tv->tv_usec = ts.tv_nsec / 1000;
+    return 0;
+}
+
+time_t time(time_t *t)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (t)
+	*t = ts.tv_sec;
+    return ts.tv_sec;
+}
+
+/*
+ * Sleeping
+ */
+int clock_nanosleep(clockid_t clk, int flags, const struct timespec *req,
+		    struct timespec *rem)
+{
+    struct timespec rts, rrem;
+    long long base;
+    int rc;
+
+    vtime_init();
+    if (warp == 1.0 || origin(clk, &base) < 0)
+	return real_clock_nanosleep(clk, flags, req, rem);
+
+    /* A deadline is moved back toward the origin, a duration shrunk */
+    if (flags & TIMER_ABSTIME) {
+	rts = ns_ts(base + to_real(ts_ns(req) - base));
+	return real_clock_nanosleep(clk, flags, &rts, rem);
+    }
+    rts = ns_ts(to_real(ts_ns(req)));
+    rc = real_clock_nanosleep(clk, flags, &rts, &rrem);
+    if (rc == EINTR && rem)
+	*rem = ns_ts(to_virtual(ts_ns(&rrem)));
+    return rc;
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem)
+{
+    struct timespec rts, rrem;
+    int rc;
+
+    vtime_init();
+    if (warp == 1.0)
+	return real_nanosleep(req, rem);
+    rts = ns_ts(to_real(ts_ns(req)));
+    rc = real_nanosleep(&rts, &rrem);
+    if (rc < 0 && errno == EINTR && rem)
+	*rem = ns_ts(to_virtual(ts_ns(&rrem)));
+    return rc;
+}
+
+int usleep(useconds_t us)
+{
+    struct timespec ts = ns_ts(us * 1000LL);
+
+    return nanosleep(&ts, NULL);
+}
+
+unsigned int sleep(unsigned int secs)
+{
+    struct timespec ts = ns_ts(secs * NSEC), rem;
+
+    if (nanosleep(&ts, &rem) < 0)
+	return rem.tv_sec + (rem.tv_nsec > 0);
+    return 0;
+}
+
+/*
+ * Timers. alarm() goes through setitimer, so a job's alarm and a
+ * later getitimer() agree.
+ */
+int setitimer(__itimer_which_t which, const struct itimerval *new,
+	      struct itimerval *old)
+{
+    struct itimerval rnew, rold;
+    int rc;
+
+    vtime_init();
+    if (warp == 1.0 || which != ITIMER_REAL)
+	return real_setitimer(which, new, old);
+    rnew.it_value = ns_tv(to_real(tv_ns(&new->it_value)));
+    rnew.it_interval = ns_tv(to_real(tv_ns(&new->it_interval)));
+
+    /* Don't let a short timer round down to "disarmed" */
+    if (rnew.it_value.tv_sec == 0 && rnew.it_value.tv_usec == 0
+	&& (new->it_value.tv_sec || new->it_value.tv_usec))
+	rnew.it_value.tv_usec = 1;
+    if (rnew.it_interval.tv_sec == 0 && rnew.it_interval.tv_usec == 0
+	&& (new->it_interval.tv_sec || new->it_interval.tv_usec))
+	rnew.it_interval.tv_usec = 1;
+
+    if ((rc = real_setitimer(which, &rnew, &rold)) == 0 && old) {
+	old->it_value = ns_tv(to_virtual(tv_ns(&rold.it_value)));
+	old->it_interval = ns_tv(to_virtual(tv_ns(&rold.it_interval)));
+    }
+    return rc;
+}
+
+int getitimer(__itimer_which_t which, struct itimerval *cur)
+{
+    int rc;
+
+    vtime_init();
+    if ((rc = real_getitimer(which, cur)) < 0 || warp == 1.0
+	|| which != ITIMER_REAL)
+	return rc;
+    cur->it_value = ns_tv(to_virtual(tv_ns(&cur->it_value)));
+    cur->it_interval = ns_tv(to_virtual(tv_ns(&cur->it_interval)));
+    return 0;
+}
+
+unsigned int alarm(unsigned int secs)
+{
+    struct itimerval new, old;
+
+    new.it_value.tv_sec = secs;
+    new.it_value.tv_usec = 0;
+    new.it_interval.tv_sec = 0;
+    new.it_interval.tv_usec = 0;
+    if (setitimer(ITIMER_REAL, &new, &old) < 0)
+	return 0;
+
+    /* Like glibc: round to the nearest second, but never report 0 */
+    if (old.it_value.tv_usec >= 500000
+	|| (old.it_value.tv_sec == 0 && old.it_value.tv_usec > 0))
+	old.it_value.tv_sec++;
+    return old.it_value.tv_sec;
+}
+
+/*
+ * Waiting for descriptors: only the timeouts change
+ */
+int select(int n, fd_set *r, fd_set *w, fd_set *e, struct timeval *tv)
+{
+    struct timeval rtv;
+    int rc;
+
+    vtime_init();
+    if (warp == 1.0 || tv == NULL)
+	return real_select(n, r, w, e, tv);
+    rtv = ns_tv(to_real(tv_ns(tv)));
+    rc = real_select(n, r, w, e, &rtv);
+    *tv = ns_tv(to_virtual(tv_ns(&rtv)));
+    return rc;
+}
+
+int pselect(int n, fd_set *r, fd_set *w, fd_set *e,
+	    const struct timespec *ts, const sigset_t *mask)
+{
+    struct timespec rts;
+
+    vtime_init();
+    if (warp == 1.0 || ts == NULL)
+	return real_pselect(n, r, w, e, ts, mask);
+    rts = ns_ts(to_real(ts_ns(ts)));
+    return real_pselect(n, r, w, e, &rts, mask);
+}
+
+int ppoll(struct pollfd *fds, nfds_t n, const struct timespec *ts,
+	  const sigset_t *mask)
+{
+    struct timespec rts;
+
+    vtime_init();
+    if (warp == 1.0 || ts == NULL)
+	return real_ppoll(fds, n, ts, mask);
+    rts = ns_ts(to_real(ts_ns(ts)));
+    return real_ppoll(fds, n, &rts, mask);
+}
+
+int poll(struct pollfd *fds, nfds_t n, int ms)
+{
+    struct timespec ts = ns_ts(ms * 1000000LL);
+
+    return ppoll(fds, n, ms < 0 ? NULL : &ts, NULL);
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int max, int ms)
+{
+    long long rms;
+
+    vtime_init();
+    if (warp == 1.0 || ms <= 0)
+	return real_epoll_wait(epfd, events, max, ms);
+
+    /* epoll_wait counts in ms: round up, or it would never block */
+    rms = (to_real(ms * 1000000LL) + 999999) / 1000000;
+    return real_epoll_wait(epfd, events, max, rms);
+}
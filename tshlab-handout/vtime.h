@@ -0,0 +1,58 @@
+/*
+ * vtime.h - Checks shared by runtrace and sdriver for virtual time (-w)
+ *
+ * vtime.so can only be preloaded into programs built for the same ELF
+ * class and machine. If it is not, ld.so prints an error and runs the
+ * program without it, in real time, while runtrace still divides its
+ * timeouts by the warp factor. So -w checks every shell it is about
+ * to warp first, and refuses to run rather than compare a warped
+ * shell with an unwarped one.
+ */
+#ifndef __VTIME_H__
+#define __VTIME_H__
+
+#include <stdio.h>
+#include <string.h>
+#include <elf.h>
+
+/*
+ * vtime_elf - Read the ELF class and machine of path into kind.
+ *     Returns 0 if path is not an ELF file (a script, say).
+ */
+static inline int vtime_elf(const char *path, char *kind, size_t size)
+{
+    unsigned char hdr[EI_NIDENT + 4];
+    FILE *fp;
+    size_t n;
+
+    if ((fp = fopen(path, "r")) == NULL)
+	return 0;
+    n = fread(hdr, 1, sizeof(hdr), fp);
+    fclose(fp);
+    if (n < sizeof(hdr) || memcmp(hdr, ELFMAG, SELFMAG))
+	return 0;
+    snprintf(kind, size, "%s %s",
+	     hdr[EI_CLASS] == ELFCLASS32 ? "32-bit" : "64-bit",
+	     hdr[EI_NIDENT + 2] == EM_386 ? "i386" :
+	     hdr[EI_NIDENT + 2] == EM_X86_64 ? "x86-64" : "ELF");
+    return 1;
+}
+
+/*
+ * vtime_check - Make sure lib can be preloaded into prog. Prints why
+ *     not and returns 0 if it can't.
+ */
+static inline int vtime_check(const char *prog, const char *lib)
+{
+    char progkind[32], libkind[32];
+
+    if (!vtime_elf(prog, progkind, sizeof(progkind))
+	|| !vtime_elf(lib, libkind, sizeof(libkind))
+	|| !strcmp(progkind, libkind))
+	return 1;
+    printf("Error: %s is %s but %s is %s, so it would run in real time "
+	   "under -w. Rebuild it, or drop -w.\n", prog, progkind, lib, libkind);
+    return 0;
+}
+
+#endif /* __VTIME_H__ */